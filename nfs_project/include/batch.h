@@ -0,0 +1,29 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+//Small-file batching: many files travel as one archive stream instead of one PULL/PUSH pair each
+//PACK carries a directory and is followed by a DATA stream of newline-separated file names,
+//the reply is an archive stream of those files; UNPACK carries a directory and is followed by an archive stream
+//
+//Archive records (integers big-endian):
+//    'F' u16 name_len <name> u64 size u64 mtime_ns <size bytes>
+//    'X' u16 name_len <name>     the source could not read the file
+//Names are paths relative to the directory, UNPACK creates missing subdirectories
+
+#define BATCH_MAX_NAMES (4 << 20)  //Largest name list PACK accepts
+
+//Reads the name list that follows a PACK request
+//Returns 0 on success, -1 if it was too large (it is still fully consumed) and -2 if the connection failed
+int batch_read_names(Conn *conn, uint32_t stream_id, char **names, size_t *len);
+
+//Sends the named files of a directory as an archive stream, returns 0 on success
+int batch_send_archive(int dir_fd, char *names, size_t len, int sock, uint32_t stream_id);
+
+//Writes every file of an archive stream into a directory, dir_fd may be -1 to discard them all
+//Returns 0 once the stream is consumed (the counters tell how it went) and -1 if the connection failed
+int batch_unpack(Conn *conn, uint32_t stream_id, int dir_fd, uint32_t *written, uint32_t *failed);
+
+#endif
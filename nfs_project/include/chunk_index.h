@@ -0,0 +1,46 @@
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Index of the content-defined chunks held by files on this host, used by DEDUP (see dedup.h)
+//It lives in two files of the index directory:
+//    chunks.idx  a header and an open-addressing table of 24-byte slots keyed by chunk digest and length,
+//                mapped with mmap() at startup and rebuilt into a table twice as large at 3/4 load
+//    paths.log   append-only records naming the files the slots point into, read into memory at startup
+//Both are in native byte order and never leave the host. The index is only a hint: every hit is checked
+//against the file's current contents before it is used, so slots left by changed or deleted files are harmless
+
+#define CHUNK_PATH_MAX 512
+
+//One chunk of a file
+typedef struct{
+    uint64_t key;     //XXH3-64 of the chunk's bytes
+    uint64_t offset;
+    uint32_t len;
+} ChunkRef;
+
+//Where a chunk was last seen
+typedef struct{
+    char path[CHUNK_PATH_MAX];
+    uint64_t offset;
+} ChunkLocation;
+
+//Opens the index in dir, creating the directory and its files as needed, returns 0 on success
+int chunk_index_open(const char *dir);
+
+//Non-zero once chunk_index_open() succeeded
+int chunk_index_enabled(void);
+
+//Looks up a chunk, returns 1 with the place it was last seen and 0 if it is unknown
+int chunk_index_find(uint64_t key, uint32_t len, ChunkLocation *out);
+
+//Returns 1 if path was last indexed at exactly this size and mtime (ns)
+int chunk_index_current(const char *path, uint64_t size, int64_t mtime);
+
+//Records that path, at the given size and mtime, holds these chunks; slots of the same chunks are repointed
+//Returns 0 on success and -1 if the index could not be updated
+int chunk_index_add(const char *path, uint64_t size, int64_t mtime, const ChunkRef *chunks, size_t count);
+
+#endif
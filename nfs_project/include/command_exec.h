@@ -1,24 +1,122 @@
 #ifndef COMMAND_EXEC_H
 #define COMMAND_EXEC_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include "protocol.h"
+#include "digest.h"
+#include "lz.h"
+
 #define BUF_SIZE 4096
+#define SESSION_MAX_STREAMS 64  //PUSH streams that may be open at once on one connection
+#define MAX_WATCHES 256         //WATCH streams that may be open at once, each on a thread of its own
 
 //Struct to hold parsed command info
 typedef struct{
-    char type[8];    //LIST, PULL, PUSH
-    char arg1[512];  //Path for LIST/PULL/PUSH
-    int chunk_size;  //Used for PUSH only
-    char *data;      //Payload for PUSH
+    char type[8];    //LIST, PULL, PUSH, DATA, HELLO, SENDTO, SIGS, DELTA, PATCH, COMMIT, PACK, UNPACK, WATCH, HASH, CHUNKS, DEDUP
+    char arg1[512];  //Path for LIST/PULL/PUSH/SENDTO
+    char arg2[128];  //Target host:port for SENDTO
+    char arg3[512];  //Target path for SENDTO, page cursor for a paged LIST
+    int chunk_size;  //Used for text PUSH only
+    char *data;      //Payload for text PUSH
+    int binary;      //Set when the command arrived as a binary frame
+    int flags;       //Frame flags of a binary command
+    uint32_t stream_id;  //Stream id of a binary command, echoed in its replies
+    uint64_t length;     //Payload length of a binary command
+    int64_t mtime;       //mtime (ns) a PUSH should apply, -1 if none
+    uint64_t range_off;  //FRAME_RANGE: first byte of the range
+    uint64_t range_len;  //FRAME_RANGE: PULL length, or the final file size for PUSH
 } Command;
 
+//An open binary PUSH, fed by the DATA frames carrying its stream id
+typedef struct{
+    uint32_t stream_id;
+    int file;    //Destination file, -1 if it could not be opened
+    int err;     //First error hit while writing, reported when the stream ends
+    int in_use;
+    int64_t mtime;  //mtime (ns) applied when the stream completes, -1 to leave it
+    off_t offset;   //File offset the next payload byte is written at
+    Digest *digest; //FRAME_DIGEST: digest of the payload received so far, NULL otherwise
+} PushStream;
+
+//A binary PULL sent out as DATA frames whenever the socket has room
+typedef struct{
+    int file;            //Source file, -1 when no PULL is in progress
+    uint32_t stream_id;
+    off_t offset;        //Next file offset to send
+    uint64_t left;       //File bytes not yet announced in a frame header
+    uint64_t frame_left; //Payload bytes still owed by the current DATA frame
+    unsigned char hdr[FRAME_HDR_SIZE];
+    size_t hdr_off;      //Bytes of hdr already sent
+    Digest *digest;      //FRAME_DIGEST: digest of the bytes sent so far, NULL otherwise
+    LzStream *lz;        //FRAME_COMPRESS: packs each frame's block, NULL otherwise
+    const unsigned char *payload;  //Compressed PULL: unsent part of the current frame's payload
+} PullStream;
+
+//Per-connection state
+typedef struct{
+    Conn *conn;
+    int persistent;    //Set by HELLO: keep serving requests until the peer closes
+    int served;        //Number of commands handled so far
+    int open_streams;  //Number of PushStream slots in use
+    PushStream streams[SESSION_MAX_STREAMS];
+    PullStream pull;
+
+    //DATA frame whose payload is being received
+    int rx_active;
+    int rx_fin;
+    uint32_t rx_stream_id;
+    uint64_t rx_left;
+    PushStream *rx;    //NULL when the payload is discarded (refused stream)
+    int rx_packed;     //The payload is a compressed block, collected whole in unpack->packed
+    size_t rx_got;     //Bytes of a compressed payload collected so far
+    LzStream *unpack;  //Created by the first compressed DATA frame
+
+    //Legacy text PUSH in progress
+    int text_push;     //Destination file, -1 when none is open
+    int in_text_push;
+
+    int park_holds;    //Non-zero while a background task owns the connection
+
+    //Zero-copy state
+    int pipe_fds[2];   //Pipe used to splice DATA payload into files, created on first use
+    int no_splice;     //splice() is not usable for this connection
+    int no_sendfile;   //sendfile() is not usable for this connection
+} Session;
+
+//What the connection waits for when session_serve() returns
+enum{
+    SERVE_READ,   //More input is needed
+    SERVE_WRITE,  //The socket must drain before the PULL can continue
+    SERVE_CLOSE,  //The connection is finished or broken
+    SERVE_PARK    //A background task owns the connection; call session_unpark() once done with it
+};
+
+//Reads the next text or binary command from the connection
+//Returns 1 on success, 0 for an invalid command and -1 when the connection must be closed
+int read_command(Conn *conn, Command *cmd);
+
+//Executes a parsed command on the given session
+//Returns 0 to keep serving the connection, -1 when it must be closed
+int run_command(Session *session, Command *cmd);
+
+//Prepares a session for a freshly accepted connection
+void session_init(Session *session, Conn *conn);
+
+//Closes any streams left open when the connection ends
+void session_cleanup(Session *session);
+
+//Serves a non-blocking connection until it would block, returns one of SERVE_*
+int session_serve(Session *session);
 
-//Reads a line of input from socket
-int socket_read_line(int sock, char *buf, int max_len);
+//Registers the callback that hands an unparked session back to the event loop
+void session_set_resume_hook(void (*hook)(Session *));
 
-//Parses raw input text into Command structure
-int parse_command(char *text, Command *cmd);
+//Drops one hold on a parked session, the last hold triggers the resume hook
+void session_unpark(Session *session);
 
-//Executes a parsed command on the given socket
-void run_command(int fd, Command *cmd);
+//Starts the threads that run blocking commands (LIST, SENDTO, PACK, SIGS, DEDUP...), threads for each step
+//of an exchange; returns 0 on success and -1 if a thread could not be created
+int session_tasks_start(int threads);
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include "protocol.h"
+
+#define POOL_BUCKETS 64    //Hash buckets for (host, port) endpoints
+#define POOL_MAX_IDLE 32   //Idle connections kept per endpoint
+
+//Returns a session-mode connection to host:port, reusing an idle one when possible
+//Returns NULL if no connection could be established
+Conn *pool_acquire(const char *host, int port);
+
+//Hands a connection back to the pool
+//Connections with unread replies or a broken stream must be released with reusable = 0
+void pool_release(const char *host, int port, Conn *conn, int reusable);
+
+//Closes every idle connection
+void pool_destroy(void);
+
+//Called by the connecting thread with the time a new session took to set up (connect and HELLO), if set
+extern void (*pool_connect_hook)(long long ns);
+
+#endif
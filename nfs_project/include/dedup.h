@@ -0,0 +1,42 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+#include "chunk_index.h"
+
+//Content-defined chunk deduplication (CHUNKS/DEDUP)
+//The source cuts its file into FastCDC chunks and sends their digests first; the target finds the chunks
+//it already holds through its chunk index (see chunk_index.h), answers with the list of chunks it still
+//wants, and only their bytes are sent. Cut points follow the content, so an insertion only
+//changes the chunks around it, and chunks shared with any other file on the target are not sent again
+//
+//Chunk list: per chunk u64 key (XXH3-64 of its bytes) and u32 len, then u64 digest of the whole file and u32 0
+//Want list: one bit per chunk of the list, most significant bit first, set for the chunks to send
+//Chunk data: the bytes of the wanted chunks in list order
+//All integers are big-endian, the streams travel as DATA frames ending with FIN
+
+#define DEDUP_MIN_CHUNK (8 * 1024)    //No cut before this many bytes
+#define DEDUP_AVG_CHUNK (32 * 1024)   //Expected chunk size
+#define DEDUP_MAX_CHUNK (256 * 1024)  //Forced cut after this many bytes
+
+//Returns the length of the chunk starting at data, at most len (the whole of len when it is the last one)
+size_t dedup_cut(const unsigned char *data, size_t len);
+
+//Sends the chunk list of file on stream_id, reads the want list from conn and sends the wanted chunks
+//Returns 0 on success and -1 on error; the streams are then broken and the connection must be dropped
+int dedup_send(Conn *conn, int file, uint32_t stream_id);
+
+//Reads a chunk list from conn and builds the file in out_file (opened read-write) from indexed chunks and
+//the chunks it asks for; on success the chunks of the new file are returned in refs (free() them)
+//Returns 0 on success, -1 on a local failure with err set and -2 if the connection failed
+//After a local failure the streams are fully consumed; the caller's OP_ERR then takes the place of the want
+//list or of the final reply, depending on how far it got
+int dedup_receive(Conn *conn, uint32_t stream_id, int out_file, ChunkRef **refs, size_t *count,
+                  uint64_t *size, uint64_t *reused, char *err, size_t err_len);
+
+//Indexes the chunks of an existing file unless the index already knows it at its current size and mtime
+void dedup_index_file(const char *path);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+//rsync-style delta transfer
+//The target signs its copy block by block (SIGS), the source matches its file against those
+//signatures (DELTA) and the target rebuilds the file from its old blocks plus literal data (PATCH)
+//
+//Signature stream: u32 block_size, then per full block u32 weak sum and u64 strong hash
+//Delta stream: u32 block_size, then records
+//    'C' u64 first_block u32 block_count  copy blocks of the old file
+//    'L' u32 len <len bytes>               literal data
+//All integers are big-endian, the streams travel as DATA frames ending with FIN
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+
+//Picks the block size for a file: about sqrt(size), within DELTA_MIN_BLOCK..DELTA_MAX_BLOCK
+uint32_t delta_block_size(uint64_t size);
+
+//Signatures of the target's copy, indexed by weak sum
+typedef struct DeltaSigs DeltaSigs;
+
+//Sends the signatures of a file as DATA frames on stream_id, returns 0 on success
+int delta_send_signatures(int file, int sock, uint32_t stream_id);
+
+//Reads a signature stream from conn up to its FIN
+//Returns 0 on success, -1 if the stream was malformed (it is still fully consumed) and -2 if the connection failed
+int delta_read_signatures(Conn *conn, uint32_t stream_id, DeltaSigs **out);
+
+void delta_free_signatures(DeltaSigs *sigs);
+
+//Sends the delta of file against the signatures as DATA frames on stream_id, returns 0 on success
+int delta_send_delta(const DeltaSigs *sigs, int file, int sock, uint32_t stream_id);
+
+//Rebuilds a file from old_file and the delta stream arriving on conn, writing it to new_file
+//Returns 0 on success, -1 on a local failure (the stream is still fully consumed) and -2 if the connection failed
+int delta_apply(Conn *conn, uint32_t stream_id, int old_file, int new_file, uint64_t *size_out);
+
+#endif
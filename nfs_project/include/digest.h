@@ -0,0 +1,33 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Content digests for HASH and FRAME_DIGEST streams: XXH3-64 with seed 0, the same values as XXH3_64bits()
+//Long inputs are mixed 64 bytes at a time; the inner loop runs on AVX2 or SSE2 when the CPU has them,
+//picked once at startup, with a portable scalar fallback. All paths give the same result
+
+#define DIGEST_BUFFER 256  //Input collected before it is mixed, the digest of shorter inputs is computed at the end
+
+//Streaming digest state
+typedef struct{
+    uint64_t acc[8] __attribute__((aligned(64)));
+    unsigned char buffer[DIGEST_BUFFER] __attribute__((aligned(64)));
+    size_t buffered;   //Bytes waiting in buffer
+    size_t stripes;    //Stripes mixed into the current block
+    uint64_t total;    //Bytes seen so far
+} Digest;
+
+void digest_init(Digest *d);
+
+//Adds bytes to the digest
+void digest_update(Digest *d, const void *data, size_t len);
+
+//Returns the digest of everything added so far; the state may keep being updated
+uint64_t digest_final(const Digest *d);
+
+//Name of the inner loop in use: "avx2", "sse2" or "scalar"
+const char *digest_impl(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include "mapping.h"
+#include "utils.h"
+
+//Asynchronous log of transfer results
+//Workers append fixed-size records to their own lock-free ring; a background thread formats them
+//and writes them out in large batches, so a logged event costs a copy instead of a stdio call
+
+#define LOG_RING_RECORDS 1024  //Records buffered per logging thread
+#define LOG_MAX_RINGS 256      //Threads beyond this share rings
+#define LOG_MSG_INLINE 86      //Longest message kept inside a record, longer ones are copied to the heap
+#define LOG_MSG_MAX 4096       //Longest message logged, the rest is cut off
+
+//Operations and results of a logged event
+enum{ LOG_PULL, LOG_PUSH, LOG_DELTA, LOG_SENDTO, LOG_STRIPE, LOG_COMMIT, LOG_BATCH, LOG_VERIFY, LOG_DEDUP, LOG_OPS };
+#define LOG_OP_NAMES { "PULL", "PUSH", "DELTA", "SENDTO", "STRIPE", "COMMIT", "BATCH", "VERIFY", "DEDUP" }
+enum{ LOG_OK, LOG_FAIL };
+
+//Output formats: one text line per event, or the compact binary log read by nfs_logdump
+enum{ LOG_TEXT, LOG_BINARY };
+
+//Binary log layout (little-endian): the 8-byte LOG_MAGIC, then tagged records
+//  LOG_REC_MAPPING: u32 id, u16 len + source spec, u16 len + target spec
+//                   (written before the first event of a mapping and again if its id is reused)
+//  LOG_REC_EVENT:   u64 time_ns, u32 mapping id, u32 thread, u8 op, u8 result, u32 batch_count,
+//                   u16 len + file name (empty for a batch), u16 len + message
+#define LOG_MAGIC "NFSLOG\0\1"
+enum{ LOG_REC_MAPPING = 1, LOG_REC_EVENT = 2 };
+
+//Returns the name of a LOG_* operation as it appears in the text log
+const char *log_op_name(int op);
+
+//Opens the log file and starts the writer thread, returns 0 on success
+int logger_start(const char *path, int format);
+
+//Writes out every record logged so far, stops the writer thread and closes the file
+void logger_stop(void);
+
+//Logs the result of one step of a job; never blocks on I/O
+//The record keeps references on the mapping and the file name until it is written
+void log_transfer(const SyncMapping *map, const Job *job, long tid, int op, int result, const char *msg);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Fast compression of FRAME_COMPRESS streams: blocks in the LZ4 block format, packed with a single greedy level
+//Every DATA frame carries one independent block, so a relay can forward frames without looking inside them.
+//A compressed payload is the be32 length of the raw block followed by the block; frames whose block did not
+//shrink go out raw, without the flag
+
+#define LZ_BLOCK (256 * 1024)                  //Largest raw block packed at once
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)     //Worst-case packed size of n bytes
+#define LZ_FRAME_MAX (4 + LZ_BOUND(LZ_BLOCK))  //Largest compressed DATA payload
+#define LZ_SKIP_MAX 16                         //Most blocks sent raw after one failed to shrink
+
+//Packing or unpacking side of one stream
+typedef struct{
+    int skip;       //Blocks still sent raw after the last one that did not shrink
+    int backoff;    //Blocks to skip after the next miss, doubles up to LZ_SKIP_MAX
+    uint64_t bytes; //Raw bytes passed through
+    uint64_t ns;    //Time spent packing
+    unsigned char raw[LZ_BLOCK];
+    unsigned char packed[LZ_FRAME_MAX];
+} LzStream;
+
+//Compresses len bytes into at most cap bytes, returns the packed size or 0 if it would not fit
+size_t lz_compress(const void *in, size_t len, void *out, size_t cap);
+
+//Decompresses a block into at most cap bytes, returns the raw size or -1 if the block is malformed
+long lz_decompress(const void *in, size_t len, void *out, size_t cap);
+
+void lz_stream_init(LzStream *z);
+
+//Packs the first len bytes of z->raw into a DATA payload in z->packed
+//Returns its length, or 0 when the block did not shrink by an eighth (or was skipped) and goes out raw
+size_t lz_pack(LzStream *z, size_t len);
+
+//Unpacks a compressed DATA payload held in z->packed into z->raw, returns the raw size or -1 if it is malformed
+long lz_unpack(LzStream *z, size_t len);
+
+#endif
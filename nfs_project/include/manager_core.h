@@ -3,24 +3,31 @@
 
 #include <pthread.h>
 #include "utils.h"
+#include "mapping.h"
 
-//Holds information for a sync pair (source -> target)
-typedef struct SyncMapping{
-    char src_path[256];
-    char src_host[64];
-    char dst_path[256];
-    char dst_host[64];
-    int dst_port;
-    int src_port;
-    struct SyncMapping *next;
-} SyncMapping;
-
-//Global list of active sync mappings and its mutex
-extern pthread_mutex_t mapping_list_mutex;
-extern SyncMapping *mapping_list_head;
-
-//Background sync request initiator
-void *init_sync_request(void *arg);
+
+//Scans a mapping and queues its new or changed files, takes over one reference to the mapping
+void init_sync_request(SyncMapping *entry);
+
+//Starts the discovery pool: a fixed number of threads that run init_sync_request() for added mappings
+void discovery_start(int threads);
+
+//Stops the discovery pool once running scans return, mappings still waiting are dropped
+void discovery_stop(void);
+
+//Starts the thread that follows the change streams of scanned mappings (WATCH on their source clients)
+//A mapping's changes are queued once it was quiet for debounce_ms; mappings scanned earlier are not watched
+void watch_start(int debounce_ms);
+
+//Stops following the change streams and closes them, call once discovery_stop() returned
+void watch_stop(void);
+
+//Starts the thread that rescans mappings with an interval, default_interval (seconds, 0 for none)
+//applies to mappings added without one; call before any mapping is added
+void resync_start(int default_interval);
+
+//Stops the periodic rescans, call once discovery_stop() returned
+void resync_stop(void);
 
 //Handles commands sent from the nfs_console
 void *monitor_console_input(void *arg);
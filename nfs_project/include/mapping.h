@@ -0,0 +1,77 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stdint.h>
+
+//Holds information for a sync pair (source -> target)
+//Mappings are interned: every job of a pair refers to the one shared instance by id
+typedef struct SyncMapping{
+    char src_path[256];
+    char src_host[64];
+    char dst_path[256];
+    char dst_host[64];
+    int dst_port;
+    int src_port;
+    uint32_t id;    //Index in the mapping table, valid while the mapping is referenced
+    uint32_t dest;  //Hash of dst_host:dst_port, selects the job queue shard
+    int refs;       //The registry, running scans and queued jobs each hold one
+    int priority;   //Class of the mapping's jobs in the queue (PRIO_* in utils.h)
+    int cancelled;  //Cancel token: set once the mapping is cancelled, its jobs are then dropped
+    int watching;   //Set while a change stream of the source is open or being reopened
+    int interval;   //Seconds between periodic rescans, 0 for none
+    int compress;   //Relayed file data is compressed when both clients support it
+    int dedup;      //Large files go through CHUNKS/DEDUP when the target keeps a chunk index
+    int scans;      //Scans of the mapping queued or running
+
+    //Transfer totals, added to once per finished job (see metrics.h)
+    uint64_t jobs_done;
+    uint64_t jobs_failed;
+    uint64_t bytes;
+    uint64_t reported_bytes;  //bytes at the previous stats report, for its rate
+
+    //Registry indexes, guarded by the registry's writer lock
+    uint64_t pair_hash;    //Hash of the whole normalized pair
+    uint64_t source_hash;  //Hash of the source spec
+    struct SyncMapping *next_pair;
+    struct SyncMapping *next_source;
+} SyncMapping;
+
+#define MAPPING_CHUNK 1024        //Table slots allocated at a time
+#define MAPPING_MAX_CHUNKS 4096   //Bounds the number of live mappings
+
+//Parses "<path>@<host>:<port>" source and target specs into a new, normalized mapping
+//Paths lose repeated and trailing slashes and host names are lowercased, so equal pairs compare equal
+//Returns NULL if a spec is malformed or memory ran out
+SyncMapping *mapping_parse(const char *src, const char *dst);
+
+//Parses a priority class name ("high", "normal" or "low"), returns the PRIO_* value or -1
+int mapping_priority(const char *name);
+
+//Parses a resync interval: seconds, or a number followed by s, m, h or d; returns the seconds or -1
+int mapping_interval(const char *text);
+
+//Registers a parsed mapping unless the same pair is already registered
+//Returns 0 when added (the registry and the caller then each hold a reference),
+//1 for a duplicate and -1 if the table is full; in both failure cases the mapping is freed
+int mapping_add(SyncMapping *mapping);
+
+//Unregisters every mapping whose source matches the spec, returns how many were removed
+//Removed mappings are marked cancelled; scans and jobs still holding one keep it alive,
+//but stop at their next check of mapping_cancelled()
+int mapping_cancel(const char *src);
+
+//Returns non-zero once the mapping was cancelled, safe to call from any thread holding a reference
+int mapping_cancelled(const SyncMapping *mapping);
+
+//Calls fn for every registered mapping while holding the registry lock, fn must not add or cancel
+void mapping_foreach(void (*fn)(SyncMapping *mapping, void *arg), void *arg);
+
+//Returns the mapping with the given id without locking; the caller must hold a reference to it
+SyncMapping *mapping_get(uint32_t id);
+
+void mapping_ref(SyncMapping *mapping);
+
+//Drops a reference, the last one frees the mapping and recycles its id
+void mapping_unref(SyncMapping *mapping);
+
+#endif
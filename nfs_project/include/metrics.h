@@ -0,0 +1,74 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "mapping.h"
+
+//Live metrics of the manager, read by the console 'stats' command and the optional Prometheus endpoint
+//Every thread records into its own slot and is the only writer of it, so recording is a few plain
+//stores; readers add the slots up without locking
+
+#define METRICS_MAX_THREADS 1024  //Threads that get a slot, later ones are not measured
+#define METRICS_TOP_MAPPINGS 20   //Mappings listed by 'stats'
+
+//Log-linear latency histogram in nanoseconds (HDR style): 8 linear sub-buckets per power of two,
+//so every bucket is within 12.5% of the values it counts; values from 2^40 ns (~18 min) on share the last one
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} Histogram;
+
+//Measured latencies
+enum{
+    LAT_CONNECT,     //New connection to a client, including the HELLO exchange
+    LAT_FIRST_BYTE,  //From a PULL request to the source's reply
+    LAT_TRANSFER,    //A whole job, from dequeue to the target's acknowledgement
+    LAT_KINDS
+};
+
+//Counters of one thread
+typedef struct{
+    long worker;  //Worker index, -1 for other threads
+    uint64_t jobs_done;
+    uint64_t jobs_failed;
+    uint64_t bytes;    //Payload bytes relayed or reported by direct transfers
+    uint64_t busy_ns;  //Time spent on finished jobs
+    int64_t job_start_ns;  //Start of the running job, 0 while idle
+    uint64_t job_seq;      //Odd while the two fields above change, so readers can retry
+    Histogram latency[LAT_KINDS];
+} ThreadMetrics;
+
+//Returns a monotonic timestamp in nanoseconds
+long long metrics_now(void);
+
+//Starts the clock of the first report and hooks connection setup times
+void metrics_init(void);
+
+//Labels the calling thread's slot with its worker index
+void metrics_worker(long worker);
+
+//Records one latency sample of the given kind
+void metrics_latency(int kind, long long ns);
+
+//Marks the start of a job on the calling thread, so reports count it as busy while it runs
+//Returns the start timestamp
+long long metrics_job_start(void);
+
+//Records a finished job of the mapping: bytes moved, outcome and the time it took
+void metrics_job(SyncMapping *map, uint64_t bytes, int ok, long long ns);
+
+//Writes the human-readable report of the 'stats' command; rates cover the time since the previous report
+void metrics_report(int fd);
+
+//Writes the metrics in the Prometheus text exposition format
+void metrics_prometheus(int fd);
+
+//Starts a thread serving the Prometheus format over HTTP on the port, returns 0 on success
+int metrics_serve(int port);
+
+#endif
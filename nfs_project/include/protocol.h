@@ -0,0 +1,174 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FRAME_MAGIC    0xF5        //First byte of every binary frame (never valid ASCII text)
+#define FRAME_VERSION  1           //Wire format version
+#define FRAME_HDR_SIZE 16          //Size of an encoded frame header
+#define FRAME_CHUNK    (1 << 20)   //Maximum payload carried by one DATA frame
+#define CONN_BUF_SIZE  (64 * 1024) //Read buffer size of a buffered connection
+#define FRAME_MAX_REQUEST 2048     //Largest payload accepted on a request frame
+#define LIST_CURSOR_MAX 512        //Longest page cursor of a paged LIST
+
+//Frame opcodes
+enum{
+    OP_LIST = 1,  //Payload: directory path
+    OP_PULL = 2,  //Payload: file path, reply is OP_OK(size, mtime_ns) followed by DATA frames
+    OP_PUSH = 3,  //Payload: file path, followed by DATA frames, reply is OP_OK or OP_ERR
+    OP_DATA = 4,  //Payload: raw bytes of the stream
+    OP_OK   = 5,  //Success reply, payload depends on the request
+    OP_ERR  = 6,  //Failure reply, payload is an error message
+    OP_HELLO = 7, //Payload: u32 capability bits, switches the connection to session mode
+    OP_SENDTO = 8, //Payload: "<path> <host:port> <dst_path>", reply is OP_OK(size) once the target has the file
+    OP_SIGS  = 9,  //Payload: file path, reply is DATA frames with the file's block signatures (see delta.h)
+    OP_DELTA = 10, //Payload: file path, followed by a signature stream, reply is OP_OK(size, mtime_ns) and the delta
+    OP_PATCH = 11, //Payload: file path, followed by a delta stream, reply is OP_OK(size) once the file is rebuilt
+    OP_COMMIT = 12, //Payload: file path, renames the part file written by ranged PUSHes over it, reply is OP_OK
+    OP_PACK  = 13,  //Payload: directory, followed by a stream of file names, reply is an archive stream (see batch.h)
+    OP_UNPACK = 14, //Payload: directory, followed by an archive stream, reply is OP_OK(u32 written, u32 failed)
+    OP_WATCH = 15,  //Payload: directory, reply is OP_OK and then DATA frames of changed files until the peer closes (see watch.h)
+    OP_HASH  = 16,  //Payload: file path, reply is OP_OK(u64 digest, u64 size) with the digest of the whole file (see digest.h)
+    OP_CHUNKS = 17, //Payload: file path, reply is OP_OK(size, mtime_ns) and the chunk list, then the chunk data
+                    //once the want list arrived on the same stream (see dedup.h)
+    OP_DEDUP = 18   //Payload: file path, followed by a chunk list; the reply is the want list, then the chunk data
+                    //is read and the final reply is OP_OK(u64 size, u64 reused_bytes)
+};
+
+//Capability bits exchanged in HELLO
+#define CAP_SESSION 0x01  //Many requests per connection, PUSH streams may interleave
+#define CAP_COMPRESS 0x02 //Sends FRAME_COMPRESS PULLs compressed and accepts compressed DATA frames
+#define CAP_DEDUP 0x04    //Keeps a chunk index and accepts DEDUP
+
+//Frame flags
+#define FRAME_FIN  0x01  //Last DATA frame of a stream
+#define FRAME_META 0x02  //LIST: entries carry "<size> <mtime_ns> <inode> <name>"; PUSH/PATCH/COMMIT/DEDUP: payload starts with a u64 mtime
+#define FRAME_RANGE 0x04 //PULL: path is preceded by u64 offset and u64 length; PUSH: by u64 offset and u64 file size,
+                         //the data then goes to "<path>.nfs-part" until COMMIT;
+                         //LIST: one page, the payload is u64 max_entries then "<dir>\0<cursor>" (see walk.h),
+                         //the entries are followed by OP_OK(next cursor), empty once the listing is complete
+#define FRAME_RECURSIVE 0x08 //LIST: list the whole tree, entries are named by their path relative to the directory
+#define FRAME_DIGEST 0x10    //PULL: the DATA stream is followed by OP_OK(u64 digest) of the bytes sent;
+                             //PUSH: the final OP_OK carries the u64 digest of the bytes received
+#define FRAME_COMPRESS 0x20  //PULL: DATA frames may be compressed, the stream is followed by OP_OK(u64 bytes, u64 pack_ns),
+                             //after the digest when FRAME_DIGEST is set too;
+                             //DATA: the payload is a compressed block (see lz.h)
+#define FRAME_RESCAN 0x40    //DATA of a WATCH stream: empty frame, the client lost events and the tree must be listed again
+
+//Decoded frame header
+//Wire layout (big-endian): magic(1) version(1) opcode(1) flags(1) stream_id(4) length(8)
+typedef struct{
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t stream_id;
+    uint64_t length;
+} FrameHeader;
+
+//Buffered reader over a connected socket
+//The socket may be non-blocking: the blocking calls below then wait with poll() when it would block
+typedef struct{
+    int fd;
+    uint32_t caps; //Capabilities the peer reported in HELLO, 0 if none were exchanged
+    size_t start;  //Offset of first unread byte in buf
+    size_t end;    //Offset one past the last valid byte in buf
+    char buf[CONN_BUF_SIZE];
+} Conn;
+
+//Allocates a buffered reader for a socket (returns NULL on failure)
+Conn *conn_open(int fd);
+
+//Closes the socket and frees the reader
+void conn_close(Conn *conn);
+
+//Returns the next byte without consuming it, or -1 on EOF/error
+int conn_peek(Conn *conn);
+
+//Consumes and returns the next byte, or -1 on EOF/error
+int conn_getc(Conn *conn);
+
+//Reads up to and including delim (or max_len - 1 bytes), NUL-terminates the result
+//Returns the number of bytes stored, or -1 on EOF/error before any byte was read
+int conn_read_until(Conn *conn, char *buf, size_t max_len, char delim);
+
+//Reads exactly len bytes, returns 0 on success and -1 on EOF/error
+int conn_read_exact(Conn *conn, void *buf, size_t len);
+
+//Reads at most len bytes, serving buffered data first and reading the socket directly otherwise
+ssize_t conn_read_some(Conn *conn, void *buf, size_t len);
+
+//Reads at most len bytes without blocking
+//Returns the number of bytes read, 0 if nothing is available yet and -1 on EOF/error
+ssize_t conn_try_read(Conn *conn, void *buf, size_t len);
+
+//Checks without blocking whether input is available
+//Returns 1 if there is buffered or readable data, 0 if not and -1 on EOF/error
+int conn_has_input(Conn *conn);
+
+//Reads and decodes one frame header, returns 0 on success and -1 on EOF/bad header
+int conn_read_frame(Conn *conn, FrameHeader *hdr);
+
+//Decodes a frame header already in memory, returns 0 on success and -1 on a bad header
+int frame_decode(const unsigned char raw[FRAME_HDR_SIZE], FrameHeader *hdr);
+
+//Encodes a frame header into out
+void frame_encode(unsigned char out[FRAME_HDR_SIZE], int opcode, int flags, uint32_t stream_id, uint64_t length);
+
+//Sends a header and its payload with a single writev, returns 0 on success
+int frame_send(int fd, int opcode, int flags, uint32_t stream_id, const void *payload, size_t len);
+
+//Blocks until a non-blocking socket is ready for the given poll events, returns 0 on success
+int wait_ready(int fd, short events);
+
+//Writes the whole buffer, retrying on short writes, returns 0 on success
+int write_all(int fd, const void *buf, size_t len);
+
+//Payload of one DATA stream read as a single byte sequence, frame boundaries are invisible
+typedef struct{
+    Conn *conn;
+    uint32_t stream_id;
+    uint64_t frame_left;  //Unread payload of the current frame
+    int last;             //The current frame carries FIN
+} StreamIn;
+
+#define STREAM_OUT_BUF (256 * 1024)  //Bytes collected before a DATA frame is sent
+
+//DATA stream being written, small records are batched into large frames
+typedef struct{
+    int sock;
+    uint32_t stream_id;
+    size_t len;
+    unsigned char buf[STREAM_OUT_BUF];
+} StreamOut;
+
+//Starts reading the DATA stream with the given id
+void stream_in_init(StreamIn *in, Conn *conn, uint32_t stream_id);
+
+//Reads exactly len bytes of the stream
+//Returns 0 on success, 1 if the stream ended before the first byte and -1 on error
+int stream_read(StreamIn *in, void *buf, size_t len);
+
+//Reads at most len bytes, returns the count, 0 at the end of the stream and -1 on error
+ssize_t stream_read_some(StreamIn *in, void *buf, size_t len);
+
+//Discards the rest of the stream, returns 0 once FIN was consumed
+int stream_skip(StreamIn *in);
+
+//Allocates a writer for a DATA stream (returns NULL on failure), release it with free()
+StreamOut *stream_out_open(int sock, uint32_t stream_id);
+
+//Appends bytes to the stream, full buffers go out as DATA frames
+int stream_write(StreamOut *out, const void *data, size_t len);
+
+//Sends the buffered bytes; fin sends them (possibly none) as the final frame
+int stream_flush(StreamOut *out, int fin);
+
+//Returns a fresh stream id for a request issued by this process
+uint32_t next_stream_id(void);
+
+//Connect to a remote server (source or target client), returns the socket or -1
+int connect_to(const char *ip, int port);
+
+#endif
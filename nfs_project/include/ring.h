@@ -0,0 +1,45 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+//Bounded multi-producer/multi-consumer ring of fixed-size elements without locks
+//Every cell carries a sequence number that tells producers and consumers whose turn it is,
+//so a push or pop is one compare-and-swap on its position counter plus a copy
+typedef struct{
+    unsigned char *cells;
+    size_t cell_size;  //Sequence number plus element, rounded to keep cells aligned
+    size_t elem_size;
+    size_t capacity;
+
+    //Producer and consumer positions live on separate cache lines
+    size_t head __attribute__((aligned(64)));  //Next position to push
+    size_t tail __attribute__((aligned(64)));  //Next position to pop
+} Ring;
+
+//Allocates the cells (at least two), returns 0 on success
+int ring_init(Ring *ring, size_t capacity, size_t elem_size);
+
+//Copies elem into the ring, returns 0 on success and -1 when it is full
+int ring_try_push(Ring *ring, const void *elem);
+
+//Copies the oldest element out, returns 0 on success and -1 when the ring is empty
+int ring_try_pop(Ring *ring, void *elem);
+
+//Number of elements in the ring, exact only while no push or pop is in progress
+size_t ring_size(Ring *ring);
+
+//Moves the elements into new cells for capacity elements, returns 0 on success
+//and -1 if they do not fit or memory ran out; no push or pop may run meanwhile,
+//but ring_size() may, and never sees the ring emptier than it is
+int ring_resize(Ring *ring, size_t capacity);
+
+void ring_destroy(Ring *ring);
+
+//Sleeps while *word still holds expected (futex), wakeups may be spurious
+void park_wait(unsigned int *word, unsigned int expected);
+
+//Wakes up to count threads sleeping on word
+void park_wake(unsigned int *word, int count);
+
+#endif
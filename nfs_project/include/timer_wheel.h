@@ -0,0 +1,41 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Hierarchical timer wheel counting in abstract ticks
+//Level 0 has one slot per tick, every higher level one slot per full turn of the level below; a timer sits
+//in the level its distance falls into and moves down a level (cascades) when that slot comes around,
+//so adding a timer and firing it is O(1) however many are pending
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)  //Slots per level
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1ULL << (WHEEL_BITS * WHEEL_LEVELS))  //Timers further out fire after WHEEL_SPAN - 1 ticks
+
+//A pending timer, embedded in or owned by whatever it fires for
+typedef struct TimerNode{
+    struct TimerNode *next;
+    uint64_t expires;  //Tick the timer fires at
+    void *arg;
+} TimerNode;
+
+typedef struct{
+    uint64_t now;  //Last tick processed
+    size_t count;  //Pending timers
+    TimerNode *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+//Starts an empty wheel at the given tick
+void wheel_init(TimerWheel *wheel, uint64_t now);
+
+//Arms a timer for the given tick; one at or before the current tick fires on the next one
+void wheel_add(TimerWheel *wheel, TimerNode *node, uint64_t expires);
+
+//Moves the wheel forward to tick now, returns the timers that fired linked through next
+TimerNode *wheel_advance(TimerWheel *wheel, uint64_t now);
+
+//Removes every pending timer, returns them linked through next
+TimerNode *wheel_take_all(TimerWheel *wheel);
+
+#endif
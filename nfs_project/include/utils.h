@@ -1,34 +1,126 @@
 #ifndef UTILS_H
 #define UTILS_H
 #include <pthread.h>
+#include <stdint.h>
+#include "ring.h"
 
-//A job that describes one file to copy from a source to a destination
+//Shared by the stripes of one file, the last stripe to finish commits the file
 typedef struct{
-    char filename[256];
-    char src_dir[256];
-    char src_ip[64];
-    int src_port;
-    char dst_dir[256];
-    char dst_ip[64];
-    int dst_port;
+    int remaining;  //Stripes not finished yet
+    int failed;     //Set once any stripe failed
+} StripeGroup;
+
+//A job that describes one file (or one stripe of it) to copy from a source to a destination
+//Endpoints live in the job's SyncMapping and the name in a PathArena, so a queue slot stays small
+typedef struct{
+    const char *filename;  //Path relative to the mapping's directories (PathArena string), NULL for a batch
+    uint32_t mapping;      //Id of the SyncMapping, the job holds a reference to it
+    uint32_t dest;         //The mapping's target hash, selects the queue shard
+    long size;        //Size reported by the source listing
+    long long mtime;  //Source mtime in nanoseconds
+    long dst_size;    //Size of the target's current copy, 0 if it has none
+    long offset;      //Byte range of a stripe
+    long length;
+    StripeGroup *stripes;  //NULL for a whole-file job
+    char *batch;      //Newline-separated names of a batch of small files, NULL for a single file
+    int batch_count;
+    int priority;     //Class of the mapping (PRIO_*), picks the queue lane with the job's size
 } Job;
 
-//A queue for storing jobs
+//Priority classes of a mapping, set with 'add'; higher classes are served first
+enum{ PRIO_HIGH, PRIO_NORMAL, PRIO_LOW, PRIO_CLASSES };
+
+#define PATH_BLOCK_SIZE (64 * 1024)  //Size and alignment of a PathArena block
+
+typedef struct PathBlock PathBlock;
+
+//Bump allocator for the file names of queued jobs
+//Names are packed into aligned blocks; each name holds a reference on its block,
+//which is freed once the arena moved on and every name in it was released
+typedef struct{
+    PathBlock *current;
+} PathArena;
+
+//Copies a name into the arena, returns NULL if it is too long or memory ran out
+const char *path_store(PathArena *arena, const char *name);
+
+//Takes another reference on a stored name (one per job that carries it)
+void path_retain(const char *path);
+void path_release(const char *path);
+
+//Drops the arena's hold on its current block; names already handed out stay valid
+void path_arena_close(PathArena *arena);
+
+#define QUEUE_SHARDS 16  //Number of destination shards in a job queue
+#define QUEUE_BANDS 3    //Size bands per priority class (shortest-job-first)
+#define QUEUE_LANES (PRIO_CLASSES * QUEUE_BANDS)
+
+//Scheduling policies: jobs of a class are taken in arrival order, or the smaller ones first
+enum{ QUEUE_FIFO, QUEUE_SJF };
+
+//The jobs of one lane of a shard, in a lock-free ring of Jobs that is resized to follow its load
+//Pushes and pops only count themselves in users; a resize waits until no push or pop is left
 typedef struct{
-    Job *items;  //Array of jobs
-    int capacity; //Maximum number of jobs
-    int size;  //Current number of jobs in the queue
-    int head;
-    int tail;
-
-    pthread_mutex_t mutex;  //Protects access to the queue
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
+    Ring ring;
+    int users;  //Pushes and pops in progress, made negative while the ring is resized
+    long long resized_ms;  //Last resize
+} QueueRing;
+
+//The jobs bound for one group of destinations, one lane per priority class and size band
+typedef struct{
+    QueueRing lanes[QUEUE_LANES];
+    int active;  //Jobs of this shard being processed right now
+} QueueShard;
+
+//State of one lane across all shards
+typedef struct{
+    int queued;           //Jobs waiting in the lane, empty lanes are skipped without touching the rings
+    long long served_ms;  //Last pop from the lane, or when it last became non-empty
+} QueueLane;
+
+//A queue for storing jobs, sharded by destination and split into priority lanes
+//Each worker starts looking at its home shard and steals from the others when it is empty
+//A shard already served by its fair share of workers is only picked when no other shard has work,
+//so one slow destination cannot take every worker
+//Within that, lanes are served in order: higher classes first and, under QUEUE_SJF, smaller jobs first;
+//a waiting lane not served for aging_ms gets the next job, so large and low-priority jobs cannot starve
+//The capacity bounds the jobs waiting in the whole queue; a lane's ring starts small, grows when it is
+//full and the queue is not, and shrinks again once it is mostly empty
+//Pushes and pops never lock; idle workers and producers facing a full queue sleep on futexes
+typedef struct{
+    QueueShard shards[QUEUE_SHARDS];
+    QueueLane lanes[QUEUE_LANES];
+    int capacity;    //Jobs that may wait at once, across all shards and lanes
+    int fair_share;  //Workers per shard before other shards are preferred
+    int policy;      //QUEUE_FIFO or QUEUE_SJF
+    int aging_ms;    //0 disables aging
+    int closed;
+
+    //Futex words: bumped on every event a sleeper may care about, with a count of sleepers
+    unsigned int job_seq __attribute__((aligned(64)));  //A job was pushed or the queue closed
+    int idle_workers;
+    unsigned int space_seq __attribute__((aligned(64)));  //A job was popped
+    int blocked_producers;
+    int waiting __attribute__((aligned(64)));  //Places taken by pushes and not freed by pops yet
 } Queue;
 
-void queue_init(Queue *q, int capacity);
-void queue_push(Queue *q, const Job *job);
-void queue_pop(Queue *q, Job *job);
+//Capacity bounds the jobs waiting in the whole queue, workers is the number of threads that pop
+void queue_init(Queue *q, int capacity, int workers, int policy, int aging_ms);
+//Blocks while capacity jobs are waiting, returns -1 without queueing once the queue is closed
+int queue_push(Queue *q, const Job *job);
+
+//Takes the next job for the worker with the given home shard
+//Returns the job's shard, to be passed to queue_done(), or -1 once the queue is closed and empty
+int queue_pop(Queue *q, int home, Job *job);
+
+//Marks a job taken from the shard as finished
+void queue_done(Queue *q, int shard);
+
+//Counts the jobs waiting in the queue and the ones being processed, both approximate under load
+void queue_stats(Queue *q, long *waiting, long *running);
+
+//Wakes every worker; queue_pop() keeps handing out the remaining jobs, then returns -1
+void queue_close(Queue *q);
 void queue_destroy(Queue *q);
 
-#endif
\ No newline at end of file
+#endif
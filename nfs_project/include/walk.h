@@ -0,0 +1,50 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+
+//Directory listings for LIST
+//Directories are read with getdents64 into large buffers, entries are packed into large DATA frames
+//Every regular file becomes one entry named by its path relative to the listed directory, either the
+//bare path or "<size> <mtime_ns> <inode> <path>"; symbolic links are never followed
+//
+//Whole trees are listed in one stream by WALK_THREADS threads working on different subdirectories
+//Paged listings walk depth first and stop after a number of entries, handing back a cursor of getdents64
+//offsets in hex, "<off>:<ino>/<off>:<ino>/.../<pos>": for every directory on the way down, the offset of
+//the entry of the next one and that one's inode, then the position in the deepest one. The next page
+//(possibly on another connection) finds each directory again from its entry and resumes exactly there
+//The cursor does not depend on the length of names; a subdirectory WALK_PAGE_DEPTH levels down is listed
+//whole within the page instead of being walked into, so a page may run past its entry limit but its
+//cursor stays short
+
+#define WALK_THREADS 4             //Threads listing one tree
+#define WALK_DENTS_BUF (1 << 20)   //getdents64 buffer of one directory reader
+#define WALK_PAGE_DEPTH 12         //Directories a page cursor can stand in, deeper subtrees go out whole
+
+//Reads one directory in large getdents64 batches
+typedef struct DirReader DirReader;
+
+DirReader *dir_reader_open(void);
+void dir_reader_close(DirReader *reader);
+
+//Starts reading the directory fd at the given offset (0 for the beginning)
+int dir_reader_reset(DirReader *reader, int fd, uint64_t offset);
+
+//Returns the next entry: its name, d_type and the offset just past it
+//Returns 1 on success, 0 at the end of the directory and -1 on error
+int dir_reader_next(DirReader *reader, const char **name, int *type, uint64_t *next_offset);
+
+//Streams the entries of the tree below root_fd as DATA frames on stream_id, the last one carries FIN
+//Returns 0 on success and -1 if the stream could not be sent
+int walk_send_tree(int root_fd, int meta, int sock, uint32_t stream_id);
+
+//Streams about max_entries entries (0 for no limit) starting at cursor ("" for the beginning)
+//as DATA frames on stream_id, the last one carries FIN; recursive also descends into subdirectories
+//next (LIST_CURSOR_MAX bytes) receives the cursor of the following page, or "" once the listing is complete
+//Returns 0 on success, -1 if the stream could not be sent and -2 for a malformed cursor (nothing was sent)
+int walk_send_page(int root_fd, int meta, int recursive, const char *cursor, uint64_t max_entries,
+                   int sock, uint32_t stream_id, char *next, size_t next_len);
+
+#endif
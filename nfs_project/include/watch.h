@@ -0,0 +1,26 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+//Change streams for WATCH
+//Every directory of the tree gets an inotify watch (directories created or moved in later too); files
+//that were written and closed, moved in or had their attributes changed are collected for WATCH_COALESCE_MS,
+//so a burst of events on one file becomes a single entry
+//Each batch goes out as DATA frames of "<size> <mtime_ns> <inode> <path>" lines, the LIST -l format
+//with paths relative to the watched directory, every frame holding whole lines; files deleted again before
+//the batch is sent are left out. When the kernel dropped events an empty frame flagged FRAME_RESCAN
+//goes out instead, the peer then has to list the tree again
+//The stream never ends on its own: it stops once the peer closes the connection
+//fanotify would need CAP_SYS_ADMIN, which nfs_client does not run with, so inotify is used throughout
+
+#define WATCH_COALESCE_MS 50  //Time events are collected before a batch goes out
+#define WATCH_EVENT_BUF (64 * 1024)  //Bytes read from the inotify descriptor at once
+
+//Watches the tree below dir and streams its changes on stream_id until the peer closes the connection
+//Replies OP_OK once every directory is watched, or OP_ERR if the directory cannot be watched
+//Returns 0 when the peer closed the connection and -1 if the stream broke
+int watch_tree(const char *dir, Conn *conn, uint32_t stream_id);
+
+#endif
@@ -11,8 +11,21 @@ extern volatile sig_atomic_t is_terminating;
 //Used to coordinate shutdown across threads
 extern pthread_mutex_t terminate_mutex;
 extern pthread_cond_t terminate_cond;
-//Shared log file for logging operations
-extern FILE *log_file;
+//Set when sources should send files straight to targets (SENDTO) instead of through the manager
+extern int direct_transfer;
+//Files larger than this are split into stripes of this size moved by several workers (0 disables striping)
+extern long stripe_size;
+
+//Transfers are checked with content digests when set; a mismatched file is copied again up to this many times
+extern int verify_retries;
+
+//Small files are batched until either limit is reached (batch_files <= 1 disables batching)
+extern int batch_files;
+extern long batch_bytes;
+
+#define DELTA_MIN_SIZE (1L << 20)   //Changed files smaller than this are simply copied whole
+#define DEDUP_MIN_SIZE (1L << 20)   //Files of dedup mappings smaller than this are not worth a chunk list
+#define BATCH_FILE_MAX (64L << 10)  //Largest file that may join a batch
 
 //Main loop function for each worker thread
 void *sync_worker_loop(void *arg);
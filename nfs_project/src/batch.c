@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#define BATCH_NAME_MAX 1023  //Longest relative path of a batched file
+
+//A name must stay inside the batch's directory: a relative path without empty, "." or ".." components
+static int valid_name(const char *name, size_t len){
+    if (len == 0 || len > BATCH_NAME_MAX || name[0] == '/' || name[len - 1] == '/'){
+        return 0;
+    }
+    const char *end = name + len;
+    for (const char *p = name; p < end; ){
+        const char *slash = memchr(p, '/', end - p);
+        size_t n = (slash ? slash : end) - p;
+        if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.')){
+            return 0;
+        }
+        p += n + 1;
+    }
+    return 1;
+}
+
+//Creates the missing parent directories of a name below the directory
+static void make_parents(int dir_fd, const char *name){
+    char path[BATCH_NAME_MAX + 1];
+    snprintf(path, sizeof(path), "%s", name);
+    for (char *p = path; (p = strchr(p, '/')); ++p){
+        *p = '\0';
+        mkdirat(dir_fd, path, 0755);
+        *p = '/';
+    }
+}
+
+int batch_read_names(Conn *conn, uint32_t stream_id, char **names, size_t *len){
+    StreamIn in;
+    stream_in_init(&in, conn, stream_id);
+    size_t cap = 4096;
+    size_t used = 0;
+    char *buf = malloc(cap + 1);
+
+    while (buf){
+        if (used == cap){
+            if (cap >= BATCH_MAX_NAMES){
+                break;
+            }
+            char *grown = realloc(buf, cap * 2 + 1);
+            if (!grown){
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t r = stream_read_some(&in, buf + used, cap - used);
+        if (r < 0){
+            free(buf);
+            return -2;
+        }
+        if (r == 0){
+            buf[used] = '\0';
+            *names = buf;
+            *len = used;
+            return 0;
+        }
+        used += r;
+    }
+
+    free(buf);
+    return stream_skip(&in) == 0 ? -1 : -2;
+}
+
+//Writes a record header: tag, u16 name length and the name
+static int put_name(StreamOut *out, char tag, const char *name, size_t len){
+    unsigned char hdr[3];
+    uint16_t be = htobe16((uint16_t)len);
+    hdr[0] = tag;
+    memcpy(hdr + 1, &be, sizeof(be));
+    if (stream_write(out, hdr, sizeof(hdr)) != 0){
+        return -1;
+    }
+    return stream_write(out, name, len);
+}
+
+//Adds one file to the archive, a file that cannot be read becomes an 'X' record
+static int pack_file(int dir_fd, const char *name, size_t len, StreamOut *out, char *buf, size_t buf_len){
+    if (!valid_name(name, len)){
+        return put_name(out, 'X', name, len < BATCH_NAME_MAX ? len : BATCH_NAME_MAX);
+    }
+    int file = openat(dir_fd, name, O_RDONLY);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) < 0 || !S_ISREG(st.st_mode)){
+        if (file >= 0){
+            close(file);
+        }
+        return put_name(out, 'X', name, len);
+    }
+
+    uint64_t meta[2] = {
+        htobe64(st.st_size),
+        htobe64((uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec)
+    };
+    int rc = put_name(out, 'F', name, len) == 0 && stream_write(out, meta, sizeof(meta)) == 0 ? 0 : -1;
+
+    uint64_t left = st.st_size;
+    while (rc == 0 && left > 0){
+        size_t want = left < buf_len ? left : buf_len;
+        ssize_t r = read(file, buf, want);
+        if (r < 0 && errno == EINTR){
+            continue;
+        }
+        //A file that shrank while being packed is padded; its new mtime makes the next sync resend it
+        if (r <= 0){
+            memset(buf, 0, want);
+            r = want;
+        }
+        rc = stream_write(out, buf, r);
+        left -= r;
+    }
+    close(file);
+    return rc;
+}
+
+int batch_send_archive(int dir_fd, char *names, size_t len, int sock, uint32_t stream_id){
+    StreamOut *out = stream_out_open(sock, stream_id);
+    char *buf = malloc(CONN_BUF_SIZE);
+    int rc = out && buf ? 0 : -1;
+
+    char *end = names + len;
+    char *name = names;
+    while (rc == 0 && name < end){
+        char *nl = memchr(name, '\n', end - name);
+        if (!nl){
+            nl = end;
+        }
+        *nl = '\0';
+        if (nl > name){
+            rc = pack_file(dir_fd, name, nl - name, out, buf, CONN_BUF_SIZE);
+        }
+        name = nl + 1;
+    }
+    if (rc == 0){
+        rc = stream_flush(out, 1);
+    }
+
+    free(buf);
+    free(out);
+    return rc;
+}
+
+//Writes one 'F' record's data to the directory, the data is consumed even when the file cannot be written
+//Returns 1 when the file was written, 0 when it was skipped and -1 if the stream broke
+static int unpack_file(StreamIn *in, int dir_fd, const char *name, char *buf, size_t buf_len){
+    uint64_t meta[2];
+    if (stream_read(in, meta, sizeof(meta)) != 0){
+        return -1;
+    }
+    uint64_t left = be64toh(meta[0]);
+    int64_t mtime = (int64_t)be64toh(meta[1]);
+
+    int file = -1;
+    if (dir_fd >= 0 && valid_name(name, strlen(name))){
+        file = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file < 0 && errno == ENOENT && strchr(name, '/')){
+            make_parents(dir_fd, name);
+            file = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+    }
+    int ok = file >= 0;
+    while (left > 0){
+        size_t want = left < buf_len ? left : buf_len;
+        if (stream_read(in, buf, want) != 0){
+            if (file >= 0){
+                close(file);
+            }
+            return -1;
+        }
+        if (ok && write_all(file, buf, want) != 0){
+            ok = 0;
+        }
+        left -= want;
+    }
+    if (file < 0){
+        return 0;
+    }
+
+    struct timespec times[2] = {
+        { 0, UTIME_OMIT },
+        { mtime / 1000000000LL, mtime % 1000000000LL }
+    };
+    if (ok && futimens(file, times) != 0){
+        ok = 0;
+    }
+    if (close(file) != 0){
+        ok = 0;
+    }
+    return ok;
+}
+
+int batch_unpack(Conn *conn, uint32_t stream_id, int dir_fd, uint32_t *written, uint32_t *failed){
+    StreamIn in;
+    stream_in_init(&in, conn, stream_id);
+    char *buf = malloc(CONN_BUF_SIZE);
+    *written = 0;
+    *failed = 0;
+    if (!buf){
+        return stream_skip(&in) == 0 ? 0 : -1;
+    }
+
+    int rc = 0;
+    while (1){
+        unsigned char hdr[3];
+        int r = stream_read(&in, hdr, sizeof(hdr));
+        if (r > 0){
+            break;
+        }
+        uint16_t len;
+        memcpy(&len, hdr + 1, sizeof(len));
+        len = be16toh(len);
+        char name[BATCH_NAME_MAX + 1];
+        if (r < 0 || len > BATCH_NAME_MAX || stream_read(&in, name, len) != 0){
+            rc = -1;
+            break;
+        }
+        name[len] = '\0';
+
+        if (hdr[0] == 'X'){
+            (*failed)++;
+            continue;
+        }
+        if (hdr[0] != 'F'){
+            rc = stream_skip(&in);
+            (*failed)++;
+            break;
+        }
+        int w = unpack_file(&in, dir_fd, name, buf, CONN_BUF_SIZE);
+        if (w < 0){
+            rc = -1;
+            break;
+        }
+        if (w){
+            (*written)++;
+        } else{
+            (*failed)++;
+        }
+    }
+    free(buf);
+    return rc;
+}
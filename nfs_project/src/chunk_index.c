@@ -0,0 +1,350 @@
+#include "chunk_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "NFSCIDX1"
+#define INDEX_MIN_SLOTS (1 << 16)
+
+//Header of chunks.idx, the slots follow it
+typedef struct{
+    char magic[8];
+    uint64_t slots;  //Power of two
+    uint64_t used;
+    char reserved[40];
+} IndexHeader;
+
+//Table slot, file is 1 + the id of the file holding the chunk and 0 marks an empty slot
+typedef struct{
+    uint64_t key;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t file;
+} ChunkSlot;
+
+//Record of paths.log, the path follows it; a later record of the same id updates size and mtime
+typedef struct{
+    uint32_t id;
+    uint32_t path_len;
+    uint64_t size;
+    int64_t mtime;
+} PathRecord;
+
+//A file chunks were recorded for
+typedef struct{
+    char *path;
+    uint64_t size;
+    int64_t mtime;
+} IndexedFile;
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static int index_enabled = 0;
+static char table_path[CHUNK_PATH_MAX];
+static int table_fd = -1;
+static IndexHeader *table = NULL;  //Mapped chunks.idx
+static int log_fd = -1;
+
+//Files by id, and an open-addressing table of 1 + id by path (0 if empty) kept at most half full
+static IndexedFile *files = NULL;
+static uint32_t file_count = 0;
+static uint32_t file_cap = 0;
+static uint32_t *file_slots = NULL;
+static uint32_t file_mask = 0;
+
+static ChunkSlot *slots_of(IndexHeader *hdr){
+    return (ChunkSlot *)(hdr + 1);
+}
+
+static size_t table_bytes(uint64_t slots){
+    return sizeof(IndexHeader) + slots * sizeof(ChunkSlot);
+}
+
+//FNV-1a of a path
+static uint32_t path_hash(const char *path){
+    uint32_t h = 2166136261u;
+    for (const char *p = path; *p; ++p){
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h;
+}
+
+//Finds the entry of path in file_slots, or the empty one it would take
+static uint32_t *file_slot(const char *path){
+    for (uint32_t i = path_hash(path) & file_mask; ; i = (i + 1) & file_mask){
+        uint32_t id = file_slots[i];
+        if (id == 0 || strcmp(files[id - 1].path, path) == 0){
+            return &file_slots[i];
+        }
+    }
+}
+
+//Doubles the room for files
+static int grow_files(void){
+    uint32_t cap = file_cap ? file_cap * 2 : 1024;
+    IndexedFile *grown = realloc(files, cap * sizeof(IndexedFile));
+    if (!grown){
+        return -1;
+    }
+    files = grown;
+    uint32_t *slots = calloc((size_t)cap * 2, sizeof(uint32_t));
+    if (!slots){
+        return -1;
+    }
+    free(file_slots);
+    file_slots = slots;
+    file_mask = cap * 2 - 1;
+    file_cap = cap;
+    for (uint32_t id = 0; id < file_count; ++id){
+        *file_slot(files[id].path) = id + 1;
+    }
+    return 0;
+}
+
+//Returns the id of path, registering it when create is set; -1 if it is unknown or memory ran out
+static int64_t file_id(const char *path, int create){
+    if (file_slots){
+        uint32_t *slot = file_slot(path);
+        if (*slot){
+            return *slot - 1;
+        }
+    }
+    if (!create || (file_count == file_cap && grow_files() != 0)){
+        return -1;
+    }
+    char *copy = strdup(path);
+    if (!copy){
+        return -1;
+    }
+    files[file_count].path = copy;
+    files[file_count].size = 0;
+    files[file_count].mtime = INT64_MIN;
+    *file_slot(path) = file_count + 1;
+    return file_count++;
+}
+
+//Appends the current size and mtime of a file to paths.log
+static int append_path(uint32_t id){
+    const IndexedFile *f = &files[id];
+    unsigned char rec[sizeof(PathRecord) + CHUNK_PATH_MAX];
+    PathRecord hdr = { id, (uint32_t)strlen(f->path), f->size, f->mtime };
+    memcpy(rec, &hdr, sizeof(hdr));
+    memcpy(rec + sizeof(hdr), f->path, hdr.path_len);
+    ssize_t len = sizeof(hdr) + hdr.path_len;
+    return write(log_fd, rec, len) == len ? 0 : -1;
+}
+
+//Reads paths.log; a record cut short by a crash is dropped so later records start cleanly
+static int load_paths(void){
+    struct stat st;
+    if (fstat(log_fd, &st) < 0){
+        return -1;
+    }
+    size_t size = st.st_size;
+    unsigned char *data = malloc(size ? size : 1);
+    if (!data){
+        return -1;
+    }
+    size_t got = 0;
+    while (got < size){
+        ssize_t r = pread(log_fd, data + got, size - got, got);
+        if (r <= 0){
+            free(data);
+            return -1;
+        }
+        got += r;
+    }
+
+    size_t off = 0;
+    char path[CHUNK_PATH_MAX];
+    while (off + sizeof(PathRecord) <= size){
+        PathRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));
+        if (rec.path_len == 0 || rec.path_len >= CHUNK_PATH_MAX || rec.id > file_count ||
+            off + sizeof(rec) + rec.path_len > size){
+            break;
+        }
+        memcpy(path, data + off + sizeof(rec), rec.path_len);
+        path[rec.path_len] = '\0';
+        int64_t id = file_id(path, rec.id == file_count);
+        if (id != rec.id){
+            break;
+        }
+        files[id].size = rec.size;
+        files[id].mtime = rec.mtime;
+        off += sizeof(rec) + rec.path_len;
+    }
+    free(data);
+    return off < size ? ftruncate(log_fd, off) : 0;
+}
+
+//Maps an index file with the given number of slots, emptying it first when fresh is set
+static IndexHeader *map_table(int fd, uint64_t slots, int fresh){
+    size_t len = table_bytes(slots);
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, len) != 0)){
+        return NULL;
+    }
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED){
+        return NULL;
+    }
+    IndexHeader *hdr = p;
+    if (fresh){
+        memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+        hdr->slots = slots;
+        hdr->used = 0;
+    }
+    return hdr;
+}
+
+//Points the slot of a chunk at its latest place, taking a free slot for a new chunk
+static void put_slot(IndexHeader *hdr, uint64_t key, uint32_t len, uint64_t offset, uint32_t file){
+    ChunkSlot *slots = slots_of(hdr);
+    uint64_t mask = hdr->slots - 1;
+    for (uint64_t i = (key ^ len * 0x9E3779B97F4A7C15ULL) & mask; ; i = (i + 1) & mask){
+        ChunkSlot *s = &slots[i];
+        if (s->file == 0){
+            hdr->used++;
+            s->key = key;
+            s->len = len;
+        } else if (s->key != key || s->len != len){
+            continue;
+        }
+        s->offset = offset;
+        s->file = file;
+        return;
+    }
+}
+
+//Rebuilds the table into one twice as large, swapped in with rename()
+static int grow_table(void){
+    char tmp[CHUNK_PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", table_path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0){
+        return -1;
+    }
+    IndexHeader *bigger = map_table(fd, table->slots * 2, 1);
+    if (!bigger){
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    ChunkSlot *old = slots_of(table);
+    for (uint64_t i = 0; i < table->slots; ++i){
+        if (old[i].file){
+            put_slot(bigger, old[i].key, old[i].len, old[i].offset, old[i].file);
+        }
+    }
+    if (rename(tmp, table_path) != 0){
+        munmap(bigger, table_bytes(bigger->slots));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    munmap(table, table_bytes(table->slots));
+    close(table_fd);
+    table = bigger;
+    table_fd = fd;
+    return 0;
+}
+
+int chunk_index_open(const char *dir){
+    char log_path[CHUNK_PATH_MAX];
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST){
+        return -1;
+    }
+    if ((size_t)snprintf(table_path, sizeof(table_path), "%s/chunks.idx", dir) >= sizeof(table_path) ||
+        (size_t)snprintf(log_path, sizeof(log_path), "%s/paths.log", dir) >= sizeof(log_path)){
+        return -1;
+    }
+    table_fd = open(table_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (table_fd < 0 || log_fd < 0){
+        return -1;
+    }
+
+    //A table that does not match its header (new, or cut short by a crash) starts over, and so do the paths
+    struct stat st;
+    IndexHeader hdr;
+    int valid = fstat(table_fd, &st) == 0 && pread(table_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) == 0 && hdr.slots >= INDEX_MIN_SLOTS &&
+                (hdr.slots & (hdr.slots - 1)) == 0 && (uint64_t)st.st_size == table_bytes(hdr.slots);
+    if (valid ? load_paths() != 0 : ftruncate(log_fd, 0) != 0){
+        return -1;
+    }
+    table = map_table(table_fd, valid ? hdr.slots : INDEX_MIN_SLOTS, !valid);
+    if (!table){
+        return -1;
+    }
+    index_enabled = 1;
+    return 0;
+}
+
+int chunk_index_enabled(void){
+    return index_enabled;
+}
+
+int chunk_index_find(uint64_t key, uint32_t len, ChunkLocation *out){
+    if (!index_enabled){
+        return 0;
+    }
+    int found = 0;
+    pthread_mutex_lock(&index_lock);
+    ChunkSlot *slots = slots_of(table);
+    uint64_t mask = table->slots - 1;
+    for (uint64_t i = (key ^ len * 0x9E3779B97F4A7C15ULL) & mask; slots[i].file; i = (i + 1) & mask){
+        if (slots[i].key == key && slots[i].len == len){
+            //Slots may outlive the paths.log record they point to after a crash
+            if (slots[i].file <= file_count){
+                snprintf(out->path, sizeof(out->path), "%s", files[slots[i].file - 1].path);
+                out->offset = slots[i].offset;
+                found = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return found;
+}
+
+int chunk_index_current(const char *path, uint64_t size, int64_t mtime){
+    if (!index_enabled){
+        return 0;
+    }
+    pthread_mutex_lock(&index_lock);
+    int64_t id = file_id(path, 0);
+    int current = id >= 0 && files[id].size == size && files[id].mtime == mtime;
+    pthread_mutex_unlock(&index_lock);
+    return current;
+}
+
+int chunk_index_add(const char *path, uint64_t size, int64_t mtime, const ChunkRef *chunks, size_t count){
+    if (!index_enabled || strlen(path) >= CHUNK_PATH_MAX){
+        return -1;
+    }
+    pthread_mutex_lock(&index_lock);
+    int64_t id = file_id(path, 1);
+    int rc = id < 0 ? -1 : 0;
+    //The path is logged before any slot refers to it
+    if (rc == 0 && (files[id].size != size || files[id].mtime != mtime)){
+        files[id].size = size;
+        files[id].mtime = mtime;
+        rc = append_path((uint32_t)id);
+    }
+    for (size_t i = 0; rc == 0 && i < count; ++i){
+        if ((table->used + 1) * 4 > table->slots * 3 && grow_table() != 0){
+            rc = -1;
+            break;
+        }
+        put_slot(table, chunks[i].key, chunks[i].len, chunks[i].offset, (uint32_t)id + 1);
+    }
+    pthread_mutex_unlock(&index_lock);
+    return rc;
+}
@@ -1,4 +1,11 @@
+#define _GNU_SOURCE
 #include "command_exec.h"
+#include "conn_pool.h"
+#include "delta.h"
+#include "dedup.h"
+#include "batch.h"
+#include "walk.h"
+#include "watch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +13,12 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <endian.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
 //Helper to trim input string
 static void cleanup_string(char *text){
@@ -15,144 +28,1813 @@ static void cleanup_string(char *text){
     }
 }
 
-//Reads a line from socket until newline or max_len is reached
-int socket_read_line(int sock, char *buf, int max_len){
-    int i = 0;
-    char c;
-    while (i < max_len - 1){
-        if (read(sock, &c, 1) <= 0){
+//Sends an error reply in the format the command arrived in
+static int reply_error(Conn *conn, Command *cmd, const char *msg){
+    if (cmd->binary){
+        return frame_send(conn->fd, OP_ERR, 0, cmd->stream_id, msg, strlen(msg));
+    }
+    char line[BUF_SIZE];
+    int n = snprintf(line, sizeof(line), "-1 %s\n", msg);
+    write_all(conn->fd, line, n);
+    return 0;
+}
+
+//Reads and discards len bytes of payload
+static int skip_payload(Conn *conn, uint64_t len){
+    char temp[BUF_SIZE];
+    while (len > 0){
+        ssize_t r = conn_read_some(conn, temp, len < sizeof(temp) ? len : sizeof(temp));
+        if (r <= 0){
             return -1;
         }
-        buf[i++] = c;
-        if (c == '\n'){
-            break;
+        len -= r;
+    }
+    return 0;
+}
+
+//Modification time of a stat result in nanoseconds since the epoch
+static int64_t stat_mtime_ns(const struct stat *st){
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+//A command running on a task thread while its session is parked
+typedef struct ParkedTask{
+    Session *session;
+    Command cmd;
+    void *(*fn)(void *);
+    struct ParkedTask *next;  //Next task waiting in the same pool
+} ParkedTask;
+
+//Task pools by step of a relayed exchange. A task may block until the next step of its exchange runs
+//(SIGS -> DELTA -> PATCH, CHUNKS -> DEDUP, PACK -> UNPACK), and that step can be queued on this same client
+//when it is both source and target; with a pool per step a full pool never waits on its own queue
+//Tasks that wait on no other task (LIST, HASH, SENDTO) share the last pool
+enum{ STEP_FIRST, STEP_SECOND, STEP_LAST, TASK_STEPS };
+
+//A fixed set of threads running the tasks queued for one step, in arrival order
+//The queue needs no bound of its own: a queued task keeps its session parked, so each
+//connection has at most one task waiting
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    ParkedTask *head;
+    ParkedTask *tail;
+} TaskPool;
+
+static TaskPool task_pools[TASK_STEPS];
+static int task_pools_started = 0;
+
+//WATCH streams last until the peer closes, so each runs on its own thread, and at most MAX_WATCHES at once
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int watch_count = 0;
+
+//Hands the connection back to the event loop and frees the task
+static void finish_task(ParkedTask *task){
+    session_unpark(task->session);
+    free(task);
+}
+
+//Runs the tasks queued on a pool, forever
+static void *task_thread(void *arg){
+    TaskPool *pool = arg;
+    while (1){
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head){
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        ParkedTask *task = pool->head;
+        pool->head = task->next;
+        if (!pool->head){
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        task->fn(task);
+    }
+    return NULL;
+}
+
+int session_tasks_start(int threads){
+    for (int step = 0; step < TASK_STEPS; ++step){
+        TaskPool *pool = &task_pools[step];
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->ready, NULL);
+        pool->head = pool->tail = NULL;
+        for (int i = 0; i < threads; ++i){
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, task_thread, pool) != 0){
+                return -1;
+            }
+            pthread_detach(tid);
+        }
+    }
+    task_pools_started = 1;
+    return 0;
+}
+
+//Builds the task of a command and parks its session; NULL (error already replied) if memory ran out
+static ParkedTask *park_task(Session *session, Command *cmd, void *(*fn)(void *)){
+    ParkedTask *task = malloc(sizeof(ParkedTask));
+    if (!task){
+        reply_error(session->conn, cmd, strerror(errno));
+        return NULL;
+    }
+    task->session = session;
+    task->cmd = *cmd;
+    task->fn = fn;
+    task->next = NULL;
+
+    //One hold for the serving I/O thread, one for the task
+    session->park_holds = 2;
+    return task;
+}
+
+//Queues fn on the pool of its step; the task owns the connection until it calls finish_task()
+static int start_parked(Session *session, Command *cmd, void *(*fn)(void *), int step){
+    if (!task_pools_started){
+        return reply_error(session->conn, cmd, "cannot start task");
+    }
+    ParkedTask *task = park_task(session, cmd, fn);
+    if (!task){
+        return 0;
+    }
+    TaskPool *pool = &task_pools[step];
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail){
+        pool->tail->next = task;
+    } else{
+        pool->head = task;
+    }
+    pool->tail = task;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+//Creates a directory and any missing parents ("mkdir -p"), returns 0 on success
+static int make_dirs(const char *path){
+    char dir[sizeof(((Command *)0)->arg1) + 16];
+    snprintf(dir, sizeof(dir), "%s", path);
+    if (!dir[0]){
+        return -1;
+    }
+    for (char *p = dir + 1; ; ++p){
+        if (*p == '/' || *p == '\0'){
+            char c = *p;
+            *p = '\0';
+            if (mkdir(dir, 0755) != 0 && errno != EEXIST){
+                return -1;
+            }
+            if (!c){
+                return 0;
+            }
+            *p = c;
         }
     }
-    buf[i] = '\0';
-    return i;
+}
+
+//Opens a file for writing, creating the missing parent directories of a file deep in a synced tree
+static int open_for_write(const char *path, int flags, mode_t mode){
+    int file = open(path, flags, mode);
+    const char *slash = strrchr(path, '/');
+    if (file >= 0 || errno != ENOENT || !slash || slash == path){
+        return file;
+    }
+    char dir[sizeof(((Command *)0)->arg1) + 16];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    if (make_dirs(dir) != 0){
+        return -1;
+    }
+    return open(path, flags, mode);
+}
+
+//Formats one LIST entry: the bare name, or "<size> <mtime_ns> <inode> <name>" with FRAME_META
+//Returns the entry length, or 0 if the entry is not a regular file
+static size_t format_entry(int dir_fd, const char *name, int type, int meta, char *out, size_t room){
+    if (type != DT_REG && type != DT_UNKNOWN){
+        return 0;
+    }
+
+    struct stat st;
+    int have_stat = 0;
+    if (meta || type == DT_UNKNOWN){
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)){
+            return 0;
+        }
+        have_stat = 1;
+    }
+
+    int n;
+    if (meta && have_stat){
+        n = snprintf(out, room, "%lld %lld %llu %s\n", (long long)st.st_size,
+                     (long long)stat_mtime_ns(&st), (unsigned long long)st.st_ino, name);
+    } else{
+        n = snprintf(out, room, "%s\n", name);
+    }
+    return n > 0 && (size_t)n < room ? (size_t)n : 0;
+}
+
+//Lists a directory for a binary LIST while the session is parked
+//A whole tree goes out in one stream listed by parallel threads; FRAME_RANGE asks for one page
+//of a listing, which ends with OK(cursor of the next page, empty once the listing is complete)
+static void *list_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+    int meta = cmd->flags & FRAME_META;
+    int recursive = cmd->flags & FRAME_RECURSIVE;
+    int paged = cmd->flags & FRAME_RANGE;
+
+    int root = open(cmd->arg1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root < 0){
+        reply_error(conn, cmd, strerror(errno));
+    } else if (recursive && !paged){
+        if (walk_send_tree(root, meta, conn->fd, cmd->stream_id) != 0){
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    } else{
+        char next[LIST_CURSOR_MAX];
+        int r = walk_send_page(root, meta, recursive, cmd->arg3, paged ? cmd->range_len : 0,
+                               conn->fd, cmd->stream_id, next, sizeof(next));
+        if (r == -2){
+            reply_error(conn, cmd, "bad cursor");
+        } else if (r != 0 || (paged && frame_send(conn->fd, OP_OK, 0, cmd->stream_id, next, strlen(next)) != 0)){
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    if (root >= 0){
+        close(root);
+    }
+
+    finish_task(task);
+    return NULL;
 }
 
 //Executes LIST command: sends names of all regular files in given directory
-static void exec_list(int fd, const char *path){
-    DIR *dir = opendir(path);
-    if (!dir){
-        dprintf(fd, "ERR: cannot open %s\n.\n", path);
-        return;
+//Text replies end with a "." line, binary replies pack the entries into DATA frames
+//With FRAME_META (text: "LIST -l <dir>") each entry also carries size, mtime and inode
+//Binary listings run on list_task(), which also handles FRAME_RECURSIVE and FRAME_RANGE
+static int exec_list(Session *session, Command *cmd){
+    if (cmd->binary){
+        return start_parked(session, cmd, list_task, STEP_LAST);
+    }
+
+    int fd = session->conn->fd;
+    int meta = cmd->flags & FRAME_META;
+    int dir = open(cmd->arg1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DirReader *reader = dir >= 0 ? dir_reader_open() : NULL;
+    char *out = reader ? malloc(STREAM_OUT_BUF) : NULL;
+    if (!out || dir_reader_reset(reader, dir, 0) != 0){
+        if (dir >= 0){
+            close(dir);
+        }
+        dir_reader_close(reader);
+        free(out);
+        char line[BUF_SIZE];
+        int n = snprintf(line, sizeof(line), "ERR: cannot open %s\n.\n", cmd->arg1);
+        write_all(fd, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+        return 0;
     }
-    struct dirent *e;
-    while ((e = readdir(dir))){
-        if (e->d_type == DT_REG){
-            dprintf(fd, "%s\n", e->d_name);
+
+    //Entries go out in large writes instead of one per file
+    char entry[512];
+    size_t used = 0;
+    int rc = 0;
+    const char *name;
+    int type;
+    uint64_t off;
+    while (rc == 0 && dir_reader_next(reader, &name, &type, &off) > 0){
+        size_t n = format_entry(dir, name, type, meta, entry, sizeof(entry));
+        if (n == 0){
+            continue;
+        }
+        if (used + n + 2 > STREAM_OUT_BUF){
+            rc = write_all(fd, out, used);
+            used = 0;
         }
+        memcpy(out + used, entry, n);
+        used += n;
     }
-    dprintf(fd, ".\n");
-    closedir(dir);
+    close(dir);
+    dir_reader_close(reader);
+    if (rc == 0){
+        memcpy(out + used, ".\n", 2);
+        rc = write_all(fd, out, used + 2);
+    }
+    free(out);
+    return rc;
+}
+
+//Sends len bytes of a file to the socket with sendfile(), falling back to a buffered copy
+static int copy_file_bytes(int file, int fd, uint64_t len){
+    while (len > 0){
+        ssize_t w = sendfile(fd, file, NULL, len);
+        if (w > 0){
+            len -= w;
+            continue;
+        }
+        if (w == 0){
+            return -1;
+        }
+        if (errno == EINTR){
+            continue;
+        }
+        if (errno == EAGAIN){
+            if (wait_ready(fd, POLLOUT) != 0){
+                return -1;
+            }
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS){
+            break;
+        }
+        return -1;
+    }
+
+    char temp[CONN_BUF_SIZE];
+    while (len > 0){
+        ssize_t r = read(file, temp, len < sizeof(temp) ? len : sizeof(temp));
+        if (r <= 0){
+            return -1;
+        }
+        if (write_all(fd, temp, r) != 0){
+            return -1;
+        }
+        len -= r;
+    }
+    return 0;
+}
+
+//Starts the next DATA frame of a PULL, the last frame carries FIN
+//A compressed PULL reads the frame's block and packs it here; returns -1 if the file could not be read
+static int pull_next_frame(PullStream *pull){
+    if (!pull->lz){
+        uint64_t n = pull->left < FRAME_CHUNK ? pull->left : FRAME_CHUNK;
+        frame_encode(pull->hdr, OP_DATA, n == pull->left ? FRAME_FIN : 0, pull->stream_id, n);
+        pull->hdr_off = 0;
+        pull->frame_left = n;
+        pull->left -= n;
+        return 0;
+    }
+
+    LzStream *z = pull->lz;
+    size_t n = pull->left < LZ_BLOCK ? pull->left : LZ_BLOCK;
+    for (size_t got = 0; got < n; ){
+        ssize_t r = pread(pull->file, z->raw + got, n - got, pull->offset + got);
+        if (r <= 0){
+            return -1;
+        }
+        got += r;
+    }
+    if (pull->digest){
+        digest_update(pull->digest, z->raw, n);
+    }
+
+    size_t packed = lz_pack(z, n);
+    int flags = (n == pull->left ? FRAME_FIN : 0) | (packed ? FRAME_COMPRESS : 0);
+    pull->payload = packed ? z->packed : z->raw;
+    frame_encode(pull->hdr, OP_DATA, flags, pull->stream_id, packed ? packed : n);
+    pull->hdr_off = 0;
+    pull->frame_left = packed ? packed : n;
+    pull->offset += n;
+    pull->left -= n;
+    return 0;
+}
+
+//Sends the OK that follows the last DATA frame of a PULL with FRAME_DIGEST or FRAME_COMPRESS
+//and releases what the PULL allocated
+static int pull_trailer(int fd, PullStream *pull){
+    uint64_t fields[3];
+    size_t count = 0;
+    if (pull->digest){
+        fields[count++] = htobe64(digest_final(pull->digest));
+    }
+    if (pull->lz){
+        fields[count++] = htobe64(pull->lz->bytes);
+        fields[count++] = htobe64(pull->lz->ns);
+    }
+    free(pull->digest);
+    free(pull->lz);
+    pull->digest = NULL;
+    pull->lz = NULL;
+    if (count == 0){
+        return 0;
+    }
+    return frame_send(fd, OP_OK, 0, pull->stream_id, fields, count * sizeof(fields[0]));
 }
 
 //Executes PULL command: sends contents of specified file to socket
-static void exec_pull(int fd, const char *path){
-    int file = open(path, O_RDONLY);
+static int exec_pull(Session *session, Command *cmd){
+    Conn *conn = session->conn;
+    int fd = conn->fd;
+    int file = open(cmd->arg1, O_RDONLY);
     if (file < 0){
-        dprintf(fd, "-1 %s\n", strerror(errno));
-        return;
+        return reply_error(conn, cmd, strerror(errno));
     }
 
-    off_t sz = lseek(file, 0, SEEK_END);
-    lseek(file, 0, SEEK_SET);
-    dprintf(fd, "%ld ", sz);
+    struct stat st;
+    if (fstat(file, &st) < 0){
+        int err = errno;
+        close(file);
+        return reply_error(conn, cmd, strerror(err));
+    }
 
-    char temp[BUF_SIZE];
-    ssize_t r;
-    while ((r = read(file, temp, sizeof(temp))) > 0){
-        write(fd, temp, r);
+    if (!cmd->binary){
+        char size_str[32];
+        int n = snprintf(size_str, sizeof(size_str), "%ld ", (long)st.st_size);
+        int rc = write_all(fd, size_str, n) == 0 ? copy_file_bytes(file, fd, st.st_size) : -1;
+        close(file);
+        return rc;
+    }
+
+    //FRAME_DIGEST hashes the bytes as they go out, the digest follows the last DATA frame
+    Digest *digest = NULL;
+    if (cmd->flags & FRAME_DIGEST){
+        digest = malloc(sizeof(Digest));
+        if (!digest){
+            close(file);
+            return reply_error(conn, cmd, strerror(errno));
+        }
+        digest_init(digest);
+    }
+
+    //FRAME_COMPRESS packs the file block by block, blocks that do not shrink go out raw
+    LzStream *lz = NULL;
+    if (cmd->flags & FRAME_COMPRESS){
+        lz = malloc(sizeof(LzStream));
+        if (!lz){
+            free(digest);
+            close(file);
+            return reply_error(conn, cmd, strerror(errno));
+        }
+        lz_stream_init(lz);
     }
+
+    //Binary mode: OK carries size and mtime, the DATA frames are sent by pump_pull() as the socket drains
+    uint64_t info[2] = { htobe64(st.st_size), htobe64(stat_mtime_ns(&st)) };
+    if (frame_send(fd, OP_OK, 0, cmd->stream_id, info, sizeof(info)) != 0){
+        free(digest);
+        free(lz);
+        close(file);
+        return -1;
+    }
+
+    //A ranged PULL sends only its part of the file, clipped to the current end of file
+    uint64_t off = 0;
+    uint64_t len = st.st_size;
+    if (cmd->flags & FRAME_RANGE){
+        off = cmd->range_off < len ? cmd->range_off : len;
+        len = cmd->range_len < len - off ? cmd->range_len : len - off;
+    }
+
+    PullStream *pull = &session->pull;
+    pull->file = file;
+    pull->stream_id = cmd->stream_id;
+    pull->offset = off;
+    pull->left = len;
+    pull->digest = digest;
+    pull->lz = lz;
+    return pull_next_frame(pull);
+}
+
+//Sends as much of the current PULL as the socket accepts
+//Returns 1 when the PULL is complete, 0 when the socket is full (or one frame was sent) and -1 on error
+static int pump_pull(Session *session){
+    PullStream *pull = &session->pull;
+    int fd = session->conn->fd;
+    char temp[CONN_BUF_SIZE];
+
+    while (1){
+        if (pull->hdr_off < FRAME_HDR_SIZE){
+            ssize_t w = write(fd, pull->hdr + pull->hdr_off, FRAME_HDR_SIZE - pull->hdr_off);
+            if (w < 0){
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            }
+            pull->hdr_off += w;
+            continue;
+        }
+
+        if (pull->frame_left == 0){
+            if (pull->left == 0){
+                close(pull->file);
+                pull->file = -1;
+                return pull_trailer(fd, pull) == 0 ? 1 : -1;
+            }
+            //Yield between frames so one large file cannot monopolize an I/O thread
+            return pull_next_frame(pull) == 0 ? 0 : -1;
+        }
+
+        //A compressed PULL sends the payload built by pull_next_frame()
+        if (pull->lz){
+            ssize_t w = write(fd, pull->payload, pull->frame_left);
+            if (w < 0){
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            }
+            pull->payload += w;
+            pull->frame_left -= w;
+            continue;
+        }
+
+        //Zero-copy: the file goes from the page cache to the socket without entering user space
+        //A digest needs the bytes, so those PULLs take the buffered path
+        if (!session->no_sendfile && !pull->digest){
+            ssize_t w = sendfile(fd, pull->file, &pull->offset, pull->frame_left);
+            if (w > 0){
+                pull->frame_left -= w;
+                continue;
+            }
+            if (w == 0){
+                //The file shrank after its size was announced, the stream cannot be completed
+                return -1;
+            }
+            if (errno == EAGAIN || errno == EINTR){
+                return 0;
+            }
+            if (errno != EINVAL && errno != ENOSYS){
+                return -1;
+            }
+            session->no_sendfile = 1;
+        }
+
+        size_t want = pull->frame_left < sizeof(temp) ? pull->frame_left : sizeof(temp);
+        ssize_t r = pread(pull->file, temp, want, pull->offset);
+        if (r <= 0){
+            return -1;
+        }
+        ssize_t w = write(fd, temp, r);
+        if (w < 0){
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        if (pull->digest){
+            digest_update(pull->digest, temp, w);
+        }
+        pull->offset += w;
+        pull->frame_left -= w;
+    }
+}
+
+//Finds the open PUSH stream with the given id
+static PushStream *find_stream(Session *session, uint32_t stream_id){
+    for (int i = 0; i < SESSION_MAX_STREAMS; ++i){
+        PushStream *st = &session->streams[i];
+        if (st->in_use && st->stream_id == stream_id){
+            return st;
+        }
+    }
+    return NULL;
+}
+
+//Closes a PUSH stream and returns the first error it hit (0 if none)
+static int close_stream(Session *session, PushStream *st){
+    int err = st->err;
+    if (st->file >= 0 && close(st->file) != 0 && !err){
+        err = errno;
+    }
+    st->in_use = 0;
+    st->file = -1;
+    free(st->digest);
+    st->digest = NULL;
+    session->open_streams--;
+    return err;
+}
+
+//Sizes a part file and reserves its blocks so stripes can be written in any order
+//Returns 0 or an errno value
+static int preallocate(int file, uint64_t size){
+    struct stat st;
+    if (fstat(file, &st) < 0){
+        return errno;
+    }
+    //Every stripe asks for the same size, so only a stale part file from an earlier attempt is cut
+    if ((uint64_t)st.st_size != size && ftruncate(file, size) < 0){
+        return errno;
+    }
+    if (size > 0 && fallocate(file, 0, 0, size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS){
+        return errno;
+    }
+    return 0;
+}
+
+//Writes DATA payload at the stream's file offset
+static void write_stream(PushStream *st, const char *buf, size_t len){
+    if (st->digest){
+        digest_update(st->digest, buf, len);
+    }
+    while (len > 0 && !st->err){
+        ssize_t w = pwrite(st->file, buf, len, st->offset);
+        if (w < 0){
+            if (errno != EINTR){
+                st->err = errno;
+            }
+            continue;
+        }
+        st->offset += w;
+        buf += w;
+        len -= w;
+    }
+}
+
+//Opens a binary PUSH stream, its contents arrive in later DATA frames
+static int exec_push_open(Session *session, Command *cmd){
+    if (find_stream(session, cmd->stream_id)){
+        return reply_error(session->conn, cmd, "stream id in use");
+    }
+
+    PushStream *st = NULL;
+    for (int i = 0; i < SESSION_MAX_STREAMS && !st; ++i){
+        if (!session->streams[i].in_use){
+            st = &session->streams[i];
+        }
+    }
+    if (!st){
+        return reply_error(session->conn, cmd, "too many open streams");
+    }
+
+    st->stream_id = cmd->stream_id;
+    st->mtime = cmd->mtime;
+    st->offset = 0;
+    st->digest = NULL;
+    if (cmd->flags & FRAME_DIGEST){
+        st->digest = malloc(sizeof(Digest));
+        if (!st->digest){
+            return reply_error(session->conn, cmd, strerror(errno));
+        }
+        digest_init(st->digest);
+    }
+    if (cmd->flags & FRAME_RANGE){
+        //Stripes of one file land in a shared part file, COMMIT moves it into place and sets the mtime
+        char part[sizeof(cmd->arg1) + 16];
+        snprintf(part, sizeof(part), "%s.nfs-part", cmd->arg1);
+        st->file = open_for_write(part, O_WRONLY | O_CREAT, 0644);
+        st->err = st->file < 0 ? errno : preallocate(st->file, cmd->range_len);
+        st->offset = cmd->range_off;
+        st->mtime = -1;
+    } else{
+        st->file = open_for_write(cmd->arg1, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        st->err = st->file < 0 ? errno : 0;
+    }
+    st->in_use = 1;
+    session->open_streams++;
+    return 0;
+}
+
+//Executes DATA frame: the payload is consumed by drain_data() as it arrives
+static int exec_data(Session *session, Command *cmd){
+    //A NULL stream means it was refused at PUSH time and its error reply is already sent
+    session->rx = find_stream(session, cmd->stream_id);
+    session->rx_stream_id = cmd->stream_id;
+    session->rx_left = cmd->length;
+    session->rx_fin = cmd->flags & FRAME_FIN;
+    session->rx_active = 1;
+    session->rx_packed = 0;
+
+    //A compressed block is collected whole before it is unpacked, one that cannot be fails its stream
+    if ((cmd->flags & FRAME_COMPRESS) && session->rx){
+        if (!session->unpack && (session->unpack = malloc(sizeof(LzStream))) != NULL){
+            lz_stream_init(session->unpack);
+        }
+        if (!session->unpack){
+            session->rx->err = ENOMEM;
+        } else if (cmd->length > LZ_FRAME_MAX){
+            session->rx->err = EPROTO;
+        } else{
+            session->rx_packed = 1;
+            session->rx_got = 0;
+        }
+    }
+    return 0;
+}
+
+//Creates the session's splice pipe on first use
+static int session_pipe(Session *session){
+    if (session->pipe_fds[0] >= 0){
+        return 0;
+    }
+    if (pipe2(session->pipe_fds, O_CLOEXEC) < 0){
+        session->pipe_fds[0] = -1;
+        session->pipe_fds[1] = -1;
+        return -1;
+    }
+    //A pipe as large as a DATA frame moves a whole frame per splice pair
+    fcntl(session->pipe_fds[1], F_SETPIPE_SZ, FRAME_CHUNK);
+    return 0;
+}
+
+//Moves DATA payload socket -> pipe -> file inside the kernel
+//Returns 1 when the payload is done or splice is unusable, 0 when more input is needed and -1 on error
+static int splice_data(Session *session, PushStream *st){
+    int sock = session->conn->fd;
+    while (session->rx_left > 0){
+        size_t want = session->rx_left < FRAME_CHUNK ? session->rx_left : FRAME_CHUNK;
+        ssize_t n = splice(sock, NULL, session->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0){
+            return -1;
+        }
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN){
+                return 0;
+            }
+            if (errno == EINVAL){
+                session->no_splice = 1;
+                return 1;
+            }
+            return -1;
+        }
+        session->rx_left -= n;
+
+        //The pipe is always emptied so the next socket splice starts clean
+        while (n > 0){
+            loff_t off = st->offset;
+            ssize_t m = splice(session->pipe_fds[0], NULL, st->file, &off, n, SPLICE_F_MOVE);
+            if (m > 0){
+                st->offset = off;
+            }
+            if (m < 0 && errno == EINTR){
+                continue;
+            }
+            if (m <= 0){
+                //Files that splice() rejects keep the bytes already in the pipe and go on with the buffered copy;
+                //a real I/O error fails the stream and the pipe is only emptied
+                int rejected = m < 0 && (errno == EINVAL || errno == ENOSYS);
+                if (!rejected){
+                    st->err = m < 0 ? errno : EIO;
+                }
+                char temp[BUF_SIZE];
+                while (n > 0){
+                    ssize_t d = read(session->pipe_fds[0], temp, n < (ssize_t)sizeof(temp) ? (size_t)n : sizeof(temp));
+                    if (d <= 0){
+                        return -1;
+                    }
+                    if (rejected){
+                        write_stream(st, temp, d);
+                    }
+                    n -= d;
+                }
+                if (rejected){
+                    session->no_splice = 1;
+                }
+                return 1;
+            }
+            n -= m;
+        }
+    }
+    return 1;
+}
+
+//Ends the current DATA frame, FIN completes its stream and sends the reply
+//Returns 1 on success and -1 if the reply could not be sent
+static int finish_data(Session *session){
+    Conn *conn = session->conn;
+    PushStream *st = session->rx;
+    session->rx_active = 0;
+    if (!st || !session->rx_fin){
+        return 1;
+    }
+
+    //The source's mtime is what the next metadata LIST comparison looks at
+    if (st->mtime >= 0 && st->file >= 0 && !st->err){
+        struct timespec times[2] = {
+            { 0, UTIME_OMIT },
+            { st->mtime / 1000000000LL, st->mtime % 1000000000LL }
+        };
+        if (futimens(st->file, times) != 0){
+            st->err = errno;
+        }
+    }
+
+    Command reply = { .binary = 1, .stream_id = session->rx_stream_id };
+    uint64_t digest = st->digest ? htobe64(digest_final(st->digest)) : 0;
+    size_t digest_len = st->digest ? sizeof(digest) : 0;
+    int err = close_stream(session, st);
+    if (err){
+        return reply_error(conn, &reply, strerror(err)) == 0 ? 1 : -1;
+    }
+    return frame_send(conn->fd, OP_OK, 0, reply.stream_id, &digest, digest_len) == 0 ? 1 : -1;
+}
+
+//Collects a compressed DATA payload and writes it out unpacked once it is complete
+//Returns 1 when the frame is complete, 0 when more input is needed and -1 on error
+static int drain_packed(Session *session){
+    PushStream *st = session->rx;
+    LzStream *z = session->unpack;
+    while (session->rx_left > 0){
+        ssize_t r = conn_try_read(session->conn, z->packed + session->rx_got, session->rx_left);
+        if (r <= 0){
+            return r;
+        }
+        session->rx_got += r;
+        session->rx_left -= r;
+    }
+
+    if (st->file >= 0 && !st->err){
+        long n = lz_unpack(z, session->rx_got);
+        if (n < 0){
+            st->err = EPROTO;
+        } else{
+            write_stream(st, (const char *)z->raw, n);
+        }
+    }
+    return finish_data(session);
+}
+
+//Writes the available part of the current DATA payload to its file, FIN completes the stream
+//Returns 1 when the frame is complete, 0 when more input is needed and -1 on error
+static int drain_data(Session *session){
+    Conn *conn = session->conn;
+    PushStream *st = session->rx;
+    char temp[CONN_BUF_SIZE];
+
+    if (session->rx_packed){
+        return drain_packed(session);
+    }
+
+    //Bytes already in the read buffer are written out first
+    while (session->rx_left > 0 && conn->start != conn->end){
+        size_t want = session->rx_left < sizeof(temp) ? session->rx_left : sizeof(temp);
+        ssize_t r = conn_try_read(conn, temp, want);
+        if (st && st->file >= 0){
+            write_stream(st, temp, r);
+        }
+        session->rx_left -= r;
+    }
+
+    //The rest is spliced straight from the socket into the file, unless the stream is hashed
+    if (session->rx_left > 0 && st && st->file >= 0 && !st->err && !st->digest &&
+        !session->no_splice && session_pipe(session) == 0){
+        int r = splice_data(session, st);
+        if (r <= 0){
+            return r;
+        }
+    }
+
+    //Fallback: buffered copy, also used to discard payload of refused or failed streams
+    while (session->rx_left > 0){
+        size_t want = session->rx_left < sizeof(temp) ? session->rx_left : sizeof(temp);
+        ssize_t r = conn_try_read(conn, temp, want);
+        if (r <= 0){
+            return r;
+        }
+        if (st && st->file >= 0){
+            write_stream(st, temp, r);
+        }
+        session->rx_left -= r;
+    }
+    return finish_data(session);
+}
+
+//Executes HELLO: switches the connection to session mode and reports capabilities
+static int exec_hello(Session *session, Command *cmd){
+    session->persistent = 1;
+    uint32_t caps = htobe32(CAP_SESSION | CAP_COMPRESS | (chunk_index_enabled() ? CAP_DEDUP : 0));
+    return frame_send(session->conn->fd, OP_OK, 0, cmd->stream_id, &caps, sizeof(caps));
+}
+
+//Called when a parked session may be served again
+static void (*resume_hook)(Session *) = NULL;
+
+void session_set_resume_hook(void (*hook)(Session *)){
+    resume_hook = hook;
+}
+
+void session_unpark(Session *session){
+    if (__atomic_sub_fetch(&session->park_holds, 1, __ATOMIC_ACQ_REL) == 0 && resume_hook){
+        resume_hook(session);
+    }
+}
+
+//Streams a whole file as DATA frames on a blocking socket, the last frame carries FIN
+static int send_file_frames(int sock, int file, uint64_t size, uint32_t stream_id){
+    uint64_t left = size;
+    do{
+        uint64_t n = left < FRAME_CHUNK ? left : FRAME_CHUNK;
+        unsigned char hdr[FRAME_HDR_SIZE];
+        frame_encode(hdr, OP_DATA, n == left ? FRAME_FIN : 0, stream_id, n);
+        if (send(sock, hdr, sizeof(hdr), n > 0 ? MSG_MORE : 0) != sizeof(hdr) ||
+            copy_file_bytes(file, sock, n) != 0){
+            return -1;
+        }
+        left -= n;
+    } while (left > 0);
+    return 0;
+}
+
+//Sends a PUSH request that asks the target to give the file the source's mtime
+static int send_push_request(int sock, uint32_t stream_id, const char *path, int64_t mtime){
+    char payload[FRAME_MAX_REQUEST];
+    size_t len = strlen(path);
+    if (len + sizeof(uint64_t) > sizeof(payload)){
+        return -1;
+    }
+    uint64_t be = htobe64(mtime);
+    memcpy(payload, &be, sizeof(be));
+    memcpy(payload + sizeof(be), path, len);
+    return frame_send(sock, OP_PUSH, FRAME_META, stream_id, payload, sizeof(be) + len);
+}
+
+//Pushes the file to the target nfs_client, then reports the outcome on the requesting connection
+static void *sendto_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Session *session = task->session;
+    char err[256] = "";
+    uint64_t size = 0;
+
+    char host[64];
+    int port = 0;
+    if (sscanf(cmd->arg2, "%63[^:]:%d", host, &port) != 2){
+        snprintf(err, sizeof(err), "bad target %s", cmd->arg2);
+    }
+
+    int file = -1;
+    struct stat st;
+    if (!err[0]){
+        file = open(cmd->arg1, O_RDONLY);
+        if (file < 0 || fstat(file, &st) < 0){
+            snprintf(err, sizeof(err), "%s", strerror(errno));
+        } else{
+            size = st.st_size;
+        }
+    }
+
+    Conn *dst = NULL;
+    if (!err[0] && !(dst = pool_acquire(host, port))){
+        snprintf(err, sizeof(err), "cannot reach %s", cmd->arg2);
+    }
+
+    int reusable = 0;
+    if (!err[0]){
+        uint32_t sid = cmd->stream_id;
+        FrameHeader ack;
+        if (send_push_request(dst->fd, sid, cmd->arg3, stat_mtime_ns(&st)) != 0 ||
+            send_file_frames(dst->fd, file, size, sid) != 0){
+            snprintf(err, sizeof(err), "transfer to %s failed", cmd->arg2);
+        } else if (conn_read_frame(dst, &ack) != 0 || ack.stream_id != sid){
+            snprintf(err, sizeof(err), "no reply from %s", cmd->arg2);
+        } else if (ack.opcode != OP_OK){
+            //Relay the target's own error message
+            size_t n = ack.length < sizeof(err) - 1 ? ack.length : sizeof(err) - 1;
+            if (conn_read_exact(dst, err, n) != 0 || n == 0){
+                snprintf(err, sizeof(err), "rejected by %s", cmd->arg2);
+            } else{
+                err[n] = '\0';
+                reusable = n == ack.length;
+            }
+        } else{
+            reusable = ack.length == 0;
+        }
+        pool_release(host, port, dst, reusable);
+    }
+    if (file >= 0){
+        close(file);
+    }
+
+    int fd = session->conn->fd;
+    if (err[0]){
+        reply_error(session->conn, cmd, err);
+    } else if (cmd->binary){
+        uint64_t sent = htobe64(size);
+        frame_send(fd, OP_OK, 0, cmd->stream_id, &sent, sizeof(sent));
+    } else{
+        char line[64];
+        int n = snprintf(line, sizeof(line), "OK %lu\n", (unsigned long)size);
+        write_all(fd, line, n);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Executes SENDTO command: the file goes straight to another nfs_client instead of through the manager
+//The transfer runs on its own thread; the session is parked until the reply is written
+static int exec_sendto(Session *session, Command *cmd){
+    return start_parked(session, cmd, sendto_task, STEP_LAST);
+}
+
+//Sends the signatures of the local copy so the source can compute a delta against it
+static void *sigs_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    int fd = task->session->conn->fd;
+
+    int file = open(cmd->arg1, O_RDONLY);
+    if (file < 0){
+        reply_error(task->session->conn, cmd, strerror(errno));
+    } else{
+        //A signature stream cut short cannot be repaired, the connection is dropped instead
+        if (delta_send_signatures(file, fd, cmd->stream_id) != 0){
+            shutdown(fd, SHUT_RDWR);
+        }
+        close(file);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Reads the target's signatures, then replies OK(size, mtime_ns) and streams the delta of the file
+static void *delta_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+
+    DeltaSigs *sigs = NULL;
+    int r = delta_read_signatures(conn, cmd->stream_id, &sigs);
+    if (r == -2){
+        shutdown(conn->fd, SHUT_RDWR);
+    } else if (r != 0){
+        reply_error(conn, cmd, "bad signatures");
+    } else{
+        struct stat st;
+        int file = open(cmd->arg1, O_RDONLY);
+        if (file < 0 || fstat(file, &st) < 0){
+            reply_error(conn, cmd, strerror(errno));
+        } else{
+            uint64_t info[2] = { htobe64(st.st_size), htobe64(stat_mtime_ns(&st)) };
+            if (frame_send(conn->fd, OP_OK, 0, cmd->stream_id, info, sizeof(info)) != 0 ||
+                delta_send_delta(sigs, file, conn->fd, cmd->stream_id) != 0){
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+        }
+        if (file >= 0){
+            close(file);
+        }
+        delta_free_signatures(sigs);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Rebuilds the file from its old blocks and the delta, then swaps it into place
+static void *patch_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+    char err[256] = "";
+
+    char tmp[sizeof(cmd->arg1) + 16];
+    snprintf(tmp, sizeof(tmp), "%s.nfs-delta", cmd->arg1);
+    struct stat st;
+    int out = -1;
+    int old = open(cmd->arg1, O_RDONLY);
+    if (old >= 0 && fstat(old, &st) == 0){
+        out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    }
+    if (out < 0){
+        snprintf(err, sizeof(err), "%s", strerror(errno));
+    }
+
+    //Without files the delta still has to be consumed; it then fails on the first record
+    uint64_t size = 0;
+    int r = delta_apply(conn, cmd->stream_id, old, out, &size);
+    if (r == 0 && cmd->mtime >= 0){
+        struct timespec times[2] = {
+            { 0, UTIME_OMIT },
+            { cmd->mtime / 1000000000LL, cmd->mtime % 1000000000LL }
+        };
+        futimens(out, times);
+    }
+    if (old >= 0){
+        close(old);
+    }
+    if (out >= 0 && close(out) != 0 && r == 0){
+        r = -1;
+        snprintf(err, sizeof(err), "%s", strerror(errno));
+    }
+    if (r == 0 && rename(tmp, cmd->arg1) != 0){
+        r = -1;
+        snprintf(err, sizeof(err), "%s", strerror(errno));
+    }
+    if (r != 0 && out >= 0){
+        unlink(tmp);
+    }
+
+    if (r == -2){
+        shutdown(conn->fd, SHUT_RDWR);
+    } else if (r != 0){
+        reply_error(conn, cmd, err[0] ? err : "cannot rebuild file");
+    } else{
+        uint64_t be = htobe64(size);
+        frame_send(conn->fd, OP_OK, 0, cmd->stream_id, &be, sizeof(be));
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Replies OK(size, mtime_ns), then negotiates with the target which chunks of the file it needs
+static void *chunks_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+
+    struct stat st;
+    int file = open(cmd->arg1, O_RDONLY | O_CLOEXEC);
+    if (file < 0 || fstat(file, &st) < 0){
+        reply_error(conn, cmd, strerror(errno));
+    } else{
+        uint64_t info[2] = { htobe64(st.st_size), htobe64(stat_mtime_ns(&st)) };
+        if (frame_send(conn->fd, OP_OK, 0, cmd->stream_id, info, sizeof(info)) != 0 ||
+            dedup_send(conn, file, cmd->stream_id) != 0){
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    if (file >= 0){
+        close(file);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Builds the file from indexed chunks plus the ones the source sends, then swaps it into place and indexes it
+//The copy it replaces is indexed first, so an updated file reuses its own unchanged chunks
+static void *dedup_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+    char err[256] = "";
+
+    char tmp[sizeof(cmd->arg1) + 16];
+    snprintf(tmp, sizeof(tmp), "%s.nfs-dedup", cmd->arg1);
+    int out = -1;
+    if (!chunk_index_enabled()){
+        snprintf(err, sizeof(err), "no chunk index");
+    } else{
+        dedup_index_file(cmd->arg1);
+        out = open_for_write(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0){
+            snprintf(err, sizeof(err), "%s", strerror(errno));
+        }
+    }
+
+    //Refused before the want list, the chunk list is still read so the connection stays usable
+    ChunkRef *refs = NULL;
+    size_t count = 0;
+    uint64_t size = 0;
+    uint64_t reused = 0;
+    int r = -1;
+    if (out < 0){
+        StreamIn in;
+        stream_in_init(&in, conn, cmd->stream_id);
+        r = stream_skip(&in) == 0 ? -1 : -2;
+    } else{
+        r = dedup_receive(conn, cmd->stream_id, out, &refs, &count, &size, &reused, err, sizeof(err));
+        if (r == 0 && cmd->mtime >= 0){
+            struct timespec times[2] = {
+                { 0, UTIME_OMIT },
+                { cmd->mtime / 1000000000LL, cmd->mtime % 1000000000LL }
+            };
+            futimens(out, times);
+        }
+        if (close(out) != 0 && r == 0){
+            r = -1;
+            snprintf(err, sizeof(err), "%s", strerror(errno));
+        }
+        if (r == 0 && rename(tmp, cmd->arg1) != 0){
+            r = -1;
+            snprintf(err, sizeof(err), "%s", strerror(errno));
+        }
+        if (r != 0){
+            unlink(tmp);
+        }
+    }
+
+    if (r == 0){
+        struct stat st;
+        if (stat(cmd->arg1, &st) == 0){
+            chunk_index_add(cmd->arg1, st.st_size, stat_mtime_ns(&st), refs, count);
+        }
+        uint64_t info[2] = { htobe64(size), htobe64(reused) };
+        frame_send(conn->fd, OP_OK, 0, cmd->stream_id, info, sizeof(info));
+    } else if (r == -2){
+        shutdown(conn->fd, SHUT_RDWR);
+    } else{
+        reply_error(conn, cmd, err[0] ? err : "cannot build file");
+    }
+    free(refs);
+
+    finish_task(task);
+    return NULL;
+}
+
+//Executes COMMIT command: moves the part file filled by ranged PUSHes over the real file
+static int exec_commit(Session *session, Command *cmd){
+    char part[sizeof(cmd->arg1) + 16];
+    snprintf(part, sizeof(part), "%s.nfs-part", cmd->arg1);
+    if (cmd->mtime >= 0){
+        struct timespec times[2] = {
+            { 0, UTIME_OMIT },
+            { cmd->mtime / 1000000000LL, cmd->mtime % 1000000000LL }
+        };
+        if (utimensat(AT_FDCWD, part, times, 0) != 0){
+            return reply_error(session->conn, cmd, strerror(errno));
+        }
+    }
+    if (rename(part, cmd->arg1) != 0){
+        return reply_error(session->conn, cmd, strerror(errno));
+    }
+    return frame_send(session->conn->fd, OP_OK, 0, cmd->stream_id, NULL, 0);
+}
+
+//Reads the requested names, then streams those files of the directory as one archive
+static void *pack_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+
+    char *names = NULL;
+    size_t len = 0;
+    int r = batch_read_names(conn, cmd->stream_id, &names, &len);
+    if (r == -2){
+        shutdown(conn->fd, SHUT_RDWR);
+    } else if (r != 0){
+        reply_error(conn, cmd, "name list too large");
+    } else{
+        int dir_fd = open(cmd->arg1, O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0){
+            reply_error(conn, cmd, strerror(errno));
+        } else{
+            if (batch_send_archive(dir_fd, names, len, conn->fd, cmd->stream_id) != 0){
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+            close(dir_fd);
+        }
+        free(names);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Unpacks an archive stream into the directory, all files are created relative to one directory handle
+static void *unpack_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+
+    int dir_fd = open(cmd->arg1, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 && errno == ENOENT && make_dirs(cmd->arg1) == 0){
+        dir_fd = open(cmd->arg1, O_RDONLY | O_DIRECTORY);
+    }
+    uint32_t counts[2];
+    if (batch_unpack(conn, cmd->stream_id, dir_fd, &counts[0], &counts[1]) != 0){
+        shutdown(conn->fd, SHUT_RDWR);
+    } else{
+        counts[0] = htobe32(counts[0]);
+        counts[1] = htobe32(counts[1]);
+        frame_send(conn->fd, OP_OK, 0, cmd->stream_id, counts, sizeof(counts));
+    }
+    if (dir_fd >= 0){
+        close(dir_fd);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Streams the changes below a directory until the peer closes the connection
+static void *watch_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+
+    if (watch_tree(cmd->arg1, conn, cmd->stream_id) != 0){
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock(&watch_lock);
+    watch_count--;
+    pthread_mutex_unlock(&watch_lock);
+    finish_task(task);
+    return NULL;
+}
+
+//Starts a WATCH stream on a thread of its own, unless MAX_WATCHES streams are already open
+static int start_watch(Session *session, Command *cmd){
+    pthread_mutex_lock(&watch_lock);
+    int full = watch_count >= MAX_WATCHES;
+    if (!full){
+        watch_count++;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    if (full){
+        return reply_error(session->conn, cmd, "too many watches");
+    }
+
+    ParkedTask *task = park_task(session, cmd, watch_task);
+    pthread_t tid;
+    if (!task || pthread_create(&tid, NULL, watch_task, task) != 0){
+        pthread_mutex_lock(&watch_lock);
+        watch_count--;
+        pthread_mutex_unlock(&watch_lock);
+        if (task){
+            session->park_holds = 0;
+            free(task);
+            return reply_error(session->conn, cmd, "cannot start task");
+        }
+        return 0;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+//Computes the digest of a whole file, returns 0 or an errno value
+static int hash_file(const char *path, uint64_t *digest_out, uint64_t *size_out){
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0){
+        return errno;
+    }
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char *buf = malloc(FRAME_CHUNK);
+    Digest *d = malloc(sizeof(Digest));
+    int err = buf && d ? 0 : ENOMEM;
+    uint64_t size = 0;
+    if (!err){
+        digest_init(d);
+        ssize_t r;
+        while ((r = read(file, buf, FRAME_CHUNK)) != 0){
+            if (r < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                err = errno;
+                break;
+            }
+            digest_update(d, buf, r);
+            size += r;
+        }
+        *digest_out = digest_final(d);
+        *size_out = size;
+    }
+    free(d);
+    free(buf);
     close(file);
+    return err;
+}
+
+//Hashes a file while the session is parked; text replies are "<digest hex> <size>"
+static void *hash_task(void *arg){
+    ParkedTask *task = arg;
+    Command *cmd = &task->cmd;
+    Conn *conn = task->session->conn;
+
+    uint64_t digest;
+    uint64_t size;
+    int err = hash_file(cmd->arg1, &digest, &size);
+    if (err){
+        reply_error(conn, cmd, strerror(err));
+    } else if (cmd->binary){
+        uint64_t info[2] = { htobe64(digest), htobe64(size) };
+        frame_send(conn->fd, OP_OK, 0, cmd->stream_id, info, sizeof(info));
+    } else{
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%016llx %llu\n", (unsigned long long)digest, (unsigned long long)size);
+        write_all(conn->fd, line, n);
+    }
+
+    finish_task(task);
+    return NULL;
+}
+
+//Executes PACK command: the request is followed by the names of the files to send
+static int exec_pack(Session *session, Command *cmd){
+    return start_parked(session, cmd, pack_task, STEP_FIRST);
+}
+
+//Executes UNPACK command: the request is followed by an archive of small files
+static int exec_unpack(Session *session, Command *cmd){
+    return start_parked(session, cmd, unpack_task, STEP_SECOND);
+}
+
+//Executes WATCH command: the connection then carries the change stream of the directory alone
+static int exec_watch(Session *session, Command *cmd){
+    return start_watch(session, cmd);
+}
+
+//Executes HASH command: replies with the digest of the file as it is on disk
+static int exec_hash(Session *session, Command *cmd){
+    return start_parked(session, cmd, hash_task, STEP_LAST);
+}
+
+//Executes SIGS command: sends block signatures of a file as DATA frames
+static int exec_sigs(Session *session, Command *cmd){
+    return start_parked(session, cmd, sigs_task, STEP_FIRST);
+}
+
+//Executes DELTA command: the request is followed by the target's signature stream
+static int exec_delta(Session *session, Command *cmd){
+    return start_parked(session, cmd, delta_task, STEP_SECOND);
+}
+
+//Executes PATCH command: the request is followed by a delta stream, replaces exec_push() for changed files
+static int exec_patch(Session *session, Command *cmd){
+    return start_parked(session, cmd, patch_task, STEP_LAST);
+}
+
+//Executes CHUNKS command: the chunk list goes out first, the data once the target said which chunks it wants
+static int exec_chunks(Session *session, Command *cmd){
+    return start_parked(session, cmd, chunks_task, STEP_FIRST);
+}
+
+//Executes DEDUP command: the request is followed by the source's chunk list
+static int exec_dedup(Session *session, Command *cmd){
+    return start_parked(session, cmd, dedup_task, STEP_SECOND);
 }
 
 //Executes PUSH command: receives data chunks and writes to file
-static void exec_push(int fd, const char *path, int len, const char *chunk){
-    static FILE *f = NULL;
+static int exec_push(Session *session, Command *cmd){
+    if (cmd->binary){
+        return exec_push_open(session, cmd);
+    }
 
+    const char *path = cmd->arg1;
+    int len = cmd->chunk_size;
+    int *f = &session->text_push;
+    session->in_text_push = len != 0;
     if (len == -1){
-        f = fopen(path, "w");
+        *f = open_for_write(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     } else if (len == 0){
-        if (f){
-            fclose(f);
+        if (*f >= 0){
+            close(*f);
         }
-        f = NULL;
+        *f = -1;
     } else{
-        if (!f){
-            f = fopen(path, "a"); //Append data if file wasn't open
+        if (*f < 0){
+            *f = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644); //Append data if file wasn't open
+        }
+        if (*f >= 0){
+            write_all(*f, cmd->data, len);
         }
-        fwrite(chunk, 1, len, f);
-        fflush(f);
     }
+    return 0;
 }
 
 //Defines available command handlers
 typedef struct{
     const char *name;
-    void (*handler)(int, Command *);
+    int opcode;
+    int (*handler)(Session *, Command *);
 } DispatchEntry;
 
-//Wrappers to match common signature
-static void wrap_list(int fd, Command *c)  { exec_list(fd, c->arg1); }
-static void wrap_pull(int fd, Command *c)  { exec_pull(fd, c->arg1); }
-static void wrap_push(int fd, Command *c)  { exec_push(fd, c->arg1, c->chunk_size, c->data); }
-
 //Command dispatch table
 static DispatchEntry dispatch_table[] = {
-    { "LIST", wrap_list },
-    { "PULL", wrap_pull },
-    { "PUSH", wrap_push },
-    { NULL, NULL }
+    { "LIST", OP_LIST, exec_list },
+    { "PULL", OP_PULL, exec_pull },
+    { "PUSH", OP_PUSH, exec_push },
+    { "DATA", OP_DATA, exec_data },
+    { "HELLO", OP_HELLO, exec_hello },
+    { "SENDTO", OP_SENDTO, exec_sendto },
+    { "SIGS", OP_SIGS, exec_sigs },
+    { "DELTA", OP_DELTA, exec_delta },
+    { "PATCH", OP_PATCH, exec_patch },
+    { "COMMIT", OP_COMMIT, exec_commit },
+    { "PACK", OP_PACK, exec_pack },
+    { "UNPACK", OP_UNPACK, exec_unpack },
+    { "WATCH", OP_WATCH, exec_watch },
+    { "HASH", OP_HASH, exec_hash },
+    { "CHUNKS", OP_CHUNKS, exec_chunks },
+    { "DEDUP", OP_DEDUP, exec_dedup },
+    { NULL, 0, NULL }
 };
 
+void session_init(Session *session, Conn *conn){
+    memset(session, 0, sizeof(Session));
+    session->conn = conn;
+    session->pull.file = -1;
+    session->text_push = -1;
+    session->pipe_fds[0] = -1;
+    session->pipe_fds[1] = -1;
+    for (int i = 0; i < SESSION_MAX_STREAMS; ++i){
+        session->streams[i].file = -1;
+    }
+}
+
+void session_cleanup(Session *session){
+    for (int i = 0; i < SESSION_MAX_STREAMS; ++i){
+        if (session->streams[i].in_use){
+            close_stream(session, &session->streams[i]);
+        }
+    }
+    if (session->pull.file >= 0){
+        close(session->pull.file);
+        session->pull.file = -1;
+    }
+    free(session->pull.digest);
+    free(session->pull.lz);
+    free(session->unpack);
+    session->pull.digest = NULL;
+    session->pull.lz = NULL;
+    session->unpack = NULL;
+    if (session->text_push >= 0){
+        close(session->text_push);
+        session->text_push = -1;
+    }
+    if (session->pipe_fds[0] >= 0){
+        close(session->pipe_fds[0]);
+        close(session->pipe_fds[1]);
+        session->pipe_fds[0] = -1;
+        session->pipe_fds[1] = -1;
+    }
+}
+
 //Finds and executes the appropriate handler for a parsed command
-void run_command(int fd, Command *cmd){
+int run_command(Session *session, Command *cmd){
     for (int i = 0; dispatch_table[i].name; ++i){
         if (strcmp(cmd->type, dispatch_table[i].name) == 0){
-            dispatch_table[i].handler(fd, cmd);
+            int rc = dispatch_table[i].handler(session, cmd);
             if (cmd->data){
                 free(cmd->data);
+                cmd->data = NULL;
             }
-            return;
+            return rc;
         }
     }
-    write(fd, "ERR: Unknown command\n", 22);
+    write_all(session->conn->fd, "ERR: Unknown command\n", 21);
+    return 0;
 }
 
-//Parses a raw text command into a Command struct
-int parse_command(char *text, Command *cmd){
-    cleanup_string(text);
-    memset(cmd, 0, sizeof(Command));
+//Without HELLO a connection carries one command, plus the DATA of a binary PUSH or the chunks of a text PUSH
+static int session_finished(Session *session){
+    return !session->persistent && session->served > 0 &&
+           session->open_streams == 0 && !session->in_text_push;
+}
 
-    if (strncmp(text, "LIST ", 5) == 0){
-        strcpy(cmd->type, "LIST");
-        sscanf(text + 5, "%511s", cmd->arg1);
-        return 1;
+int session_serve(Session *session){
+    Conn *conn = session->conn;
+    while (1){
+        //A background task owns the connection's output until it unparks the session
+        if (__atomic_load_n(&session->park_holds, __ATOMIC_ACQUIRE) > 0){
+            return SERVE_PARK;
+        }
+
+        if (session->pull.file >= 0){
+            int r = pump_pull(session);
+            if (r < 0){
+                return SERVE_CLOSE;
+            }
+            if (r == 0){
+                return SERVE_WRITE;
+            }
+            continue;
+        }
+
+        if (session->rx_active){
+            int r = drain_data(session);
+            if (r < 0){
+                return SERVE_CLOSE;
+            }
+            if (r == 0){
+                return SERVE_READ;
+            }
+            continue;
+        }
+
+        if (session_finished(session)){
+            return SERVE_CLOSE;
+        }
+
+        int avail = conn_has_input(conn);
+        if (avail < 0){
+            return SERVE_CLOSE;
+        }
+        if (avail == 0){
+            return SERVE_READ;
+        }
+
+        //A command has started arriving; the rest of it is read even if the peer is slow
+        Command cmd;
+        int r = read_command(conn, &cmd);
+        if (r < 0){
+            return SERVE_CLOSE;
+        }
+        session->served++;
+        if (r == 0){
+            if (cmd.binary){
+                frame_send(conn->fd, OP_ERR, 0, cmd.stream_id, "Invalid command", 15);
+            } else{
+                write_all(conn->fd, "ERROR: Invalid command\n", 23);
+            }
+            if (!session->persistent){
+                return SERVE_CLOSE;
+            }
+            continue;
+        }
+
+        if (strcmp(cmd.type, "DATA") != 0){
+            printf("Client command: %s %s\n", cmd.type, cmd.arg1);
+        }
+        if (run_command(session, &cmd) != 0){
+            return SERVE_CLOSE;
+        }
+    }
+}
+
+//Reads a space or newline terminated token, returns the delimiter or -1 on EOF
+static int read_token(Conn *conn, char *out, size_t max_len){
+    size_t i = 0;
+    while (1){
+        int c = conn_getc(conn);
+        if (c < 0){
+            out[i] = '\0';
+            return i > 0 ? '\n' : -1;
+        }
+        if (c == ' ' || c == '\n'){
+            out[i] = '\0';
+            return c;
+        }
+        if (c != '\r' && i < max_len - 1){
+            out[i++] = (char)c;
+        }
+    }
+}
+
+//Discards the rest of the current text line
+static void skip_line(Conn *conn){
+    int c;
+    while ((c = conn_getc(conn)) >= 0 && c != '\n'){
     }
+}
 
-    if (strncmp(text, "PULL ", 5) == 0){
-        strcpy(cmd->type, "PULL");
-        sscanf(text + 5, "%511s", cmd->arg1);
+//Parses a text command; PUSH chunks are read by their announced length so any byte may appear in them
+static int read_text_command(Conn *conn, Command *cmd){
+    char word[16];
+    int delim = read_token(conn, word, sizeof(word));
+    if (delim < 0){
+        return -1;
+    }
+    if (delim != ' '){
+        return 0;
+    }
+
+    if (strcmp(word, "LIST") == 0 || strcmp(word, "PULL") == 0 || strcmp(word, "HASH") == 0){
+        char line[BUF_SIZE];
+        if (conn_read_until(conn, line, sizeof(line), '\n') < 0){
+            return -1;
+        }
+        cleanup_string(line);
+        strcpy(cmd->type, word);
+        char *arg = line;
+        if (strcmp(word, "LIST") == 0 && strncmp(line, "-l ", 3) == 0){
+            cmd->flags |= FRAME_META;
+            arg += 3;
+        }
+        sscanf(arg, "%511s", cmd->arg1);
         return 1;
     }
 
-    if (strncmp(text, "PUSH ", 5) == 0){
-        strcpy(cmd->type, "PUSH");
-        char *sep = strchr(text + 5, ' ');
-        if (!sep){
+    if (strcmp(word, "SENDTO") == 0){
+        char line[BUF_SIZE];
+        if (conn_read_until(conn, line, sizeof(line), '\n') < 0){
+            return -1;
+        }
+        cleanup_string(line);
+        strcpy(cmd->type, word);
+        return sscanf(line, "%511s %127s %511s", cmd->arg1, cmd->arg2, cmd->arg3) == 3;
+    }
+
+    if (strcmp(word, "PUSH") == 0){
+        char len_str[32];
+        if (read_token(conn, cmd->arg1, sizeof(cmd->arg1)) != ' '){
             return 0;
         }
-        sscanf(text + 5, "%511s %d", cmd->arg1, &cmd->chunk_size);
-        sep = strchr(sep + 1, ' ');
-        if (!sep){
+        delim = read_token(conn, len_str, sizeof(len_str));
+        if (delim < 0){
+            return -1;
+        }
+        //The length comes from the peer: -1 starts the file, 0 ends it and a chunk fits in a DATA frame
+        char *end;
+        errno = 0;
+        long len = strtol(len_str, &end, 10);
+        if (end == len_str || *end != '\0' || errno != 0 || len < -1 || len > FRAME_CHUNK){
             return 0;
         }
-        cmd->data = strdup(sep + 1);
+        strcpy(cmd->type, "PUSH");
+        cmd->chunk_size = (int)len;
+
+        if (cmd->chunk_size > 0){
+            cmd->data = malloc(cmd->chunk_size);
+            if (!cmd->data || conn_read_exact(conn, cmd->data, cmd->chunk_size) != 0){
+                free(cmd->data);
+                cmd->data = NULL;
+                return -1;
+            }
+        } else if (delim == ' '){
+            skip_line(conn); //"start" / "done" marker
+        }
         return 1;
     }
 
+    skip_line(conn);
+    return 0;
+}
+
+//Consumes a big-endian u64 from the front of a request payload, returns 0 on success
+static int take_u64(char **p, size_t *len, uint64_t *out){
+    if (*len < sizeof(uint64_t)){
+        return -1;
+    }
+    uint64_t be;
+    memcpy(&be, *p, sizeof(be));
+    *out = be64toh(be);
+    *p += sizeof(be);
+    *len -= sizeof(be);
     return 0;
 }
+
+//Parses a binary request frame, its payload holds the arguments
+static int read_frame_command(Conn *conn, Command *cmd){
+    FrameHeader hdr;
+    if (conn_read_frame(conn, &hdr) != 0){
+        return -1;
+    }
+    cmd->binary = 1;
+    cmd->flags = hdr.flags;
+    cmd->stream_id = hdr.stream_id;
+    cmd->length = hdr.length;
+
+    //DATA payload is left in the connection for the handler to stream out
+    if (hdr.opcode == OP_DATA){
+        strcpy(cmd->type, "DATA");
+        return 1;
+    }
+
+    for (int i = 0; dispatch_table[i].name; ++i){
+        if (dispatch_table[i].opcode == hdr.opcode){
+            char payload[FRAME_MAX_REQUEST];
+            if (hdr.length >= sizeof(payload)){
+                return -1;
+            }
+            if (conn_read_exact(conn, payload, hdr.length) != 0){
+                return -1;
+            }
+            payload[hdr.length] = '\0';
+            strcpy(cmd->type, dispatch_table[i].name);
+
+            //SENDTO carries "<path> <host:port> <dst_path>", every other request a single path
+            if (hdr.opcode == OP_SENDTO){
+                return sscanf(payload, "%511s %127s %511s", cmd->arg1, cmd->arg2, cmd->arg3) == 3;
+            }
+            //Fixed-size fields announced by the flags precede the path
+            char *path = payload;
+            size_t path_len = hdr.length;
+            //A paged LIST carries u64 max_entries, then "<dir>\0<cursor>"
+            if (hdr.opcode == OP_LIST && (hdr.flags & FRAME_RANGE)){
+                if (take_u64(&path, &path_len, &cmd->range_len) != 0){
+                    return 0;
+                }
+                size_t dir_len = strnlen(path, path_len);
+                size_t cursor_len = dir_len < path_len ? path_len - dir_len - 1 : 0;
+                if (dir_len >= sizeof(cmd->arg1) || cursor_len >= sizeof(cmd->arg3)){
+                    return 0;
+                }
+                memcpy(cmd->arg1, path, dir_len);
+                cmd->arg1[dir_len] = '\0';
+                memcpy(cmd->arg3, path + dir_len + 1, cursor_len);
+                cmd->arg3[cursor_len] = '\0';
+                return 1;
+            }
+            int meta = hdr.opcode == OP_PUSH || hdr.opcode == OP_PATCH || hdr.opcode == OP_COMMIT ||
+                       hdr.opcode == OP_DEDUP;
+            int ranged = hdr.opcode == OP_PULL || hdr.opcode == OP_PUSH;
+            uint64_t mtime;
+            if (meta && (hdr.flags & FRAME_META)){
+                if (take_u64(&path, &path_len, &mtime) != 0){
+                    return 0;
+                }
+                cmd->mtime = (int64_t)mtime;
+            }
+            if (ranged && (hdr.flags & FRAME_RANGE)){
+                if (take_u64(&path, &path_len, &cmd->range_off) != 0 ||
+                    take_u64(&path, &path_len, &cmd->range_len) != 0){
+                    return 0;
+                }
+            }
+            if (path_len >= sizeof(cmd->arg1)){
+                return 0;
+            }
+            memcpy(cmd->arg1, path, path_len + 1);
+            return 1;
+        }
+    }
+
+    //Unknown opcode: skip its payload so the next frame can be read
+    return skip_payload(conn, hdr.length) == 0 ? 0 : -1;
+}
+
+//Reads the next command, binary frames are recognized by their magic byte
+int read_command(Conn *conn, Command *cmd){
+    memset(cmd, 0, sizeof(Command));
+    cmd->mtime = -1;
+
+    int first = conn_peek(conn);
+    if (first < 0){
+        return -1;
+    }
+    if (first == FRAME_MAGIC){
+        return read_frame_command(conn, cmd);
+    }
+    return read_text_command(conn, cmd);
+}
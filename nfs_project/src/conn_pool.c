@@ -0,0 +1,155 @@
+#include "conn_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <endian.h>
+#include <time.h>
+
+//Idle connections to one nfs_client
+typedef struct PoolEndpoint{
+    char host[64];
+    int port;
+    Conn *idle[POOL_MAX_IDLE];
+    int idle_count;
+    struct PoolEndpoint *next;
+} PoolEndpoint;
+
+static PoolEndpoint *buckets[POOL_BUCKETS];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void (*pool_connect_hook)(long long ns) = NULL;
+
+//FNV-1a over host and port
+static unsigned endpoint_hash(const char *host, int port){
+    unsigned h = 2166136261u;
+    for (const char *p = host; *p; ++p){
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    h = (h ^ (unsigned)port) * 16777619u;
+    return h % POOL_BUCKETS;
+}
+
+//Finds the endpoint entry, creating it if requested (pool_mutex must be held)
+static PoolEndpoint *find_endpoint(const char *host, int port, int create){
+    unsigned b = endpoint_hash(host, port);
+    for (PoolEndpoint *ep = buckets[b]; ep; ep = ep->next){
+        if (ep->port == port && strcmp(ep->host, host) == 0){
+            return ep;
+        }
+    }
+    if (!create){
+        return NULL;
+    }
+
+    PoolEndpoint *ep = calloc(1, sizeof(PoolEndpoint));
+    if (!ep){
+        return NULL;
+    }
+    strncpy(ep->host, host, sizeof(ep->host) - 1);
+    ep->port = port;
+    ep->next = buckets[b];
+    buckets[b] = ep;
+    return ep;
+}
+
+//An idle session must have nothing to read; data or EOF means the peer went away
+static int still_open(Conn *conn){
+    if (conn->start != conn->end){
+        return 0;
+    }
+    struct pollfd p = { conn->fd, POLLIN, 0 };
+    return poll(&p, 1, 0) == 0;
+}
+
+static long long monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//Connects and negotiates session mode with HELLO, the reply's capabilities are kept on the connection
+static Conn *open_session(const char *host, int port){
+    long long start = pool_connect_hook ? monotonic_ns() : 0;
+    int sock = connect_to(host, port);
+    if (sock < 0){
+        return NULL;
+    }
+    Conn *conn = conn_open(sock);
+    if (!conn){
+        close(sock);
+        return NULL;
+    }
+
+    uint32_t caps = htobe32(CAP_SESSION | CAP_COMPRESS);
+    FrameHeader hdr;
+    if (frame_send(sock, OP_HELLO, 0, 0, &caps, sizeof(caps)) != 0 ||
+        conn_read_frame(conn, &hdr) != 0 ||
+        hdr.opcode != OP_OK || hdr.length != sizeof(caps) ||
+        conn_read_exact(conn, &caps, sizeof(caps)) != 0 ||
+        !(be32toh(caps) & CAP_SESSION)){
+        conn_close(conn);
+        return NULL;
+    }
+    conn->caps = be32toh(caps);
+    if (pool_connect_hook){
+        pool_connect_hook(monotonic_ns() - start);
+    }
+    return conn;
+}
+
+Conn *pool_acquire(const char *host, int port){
+    while (1){
+        Conn *conn = NULL;
+        pthread_mutex_lock(&pool_mutex);
+        PoolEndpoint *ep = find_endpoint(host, port, 0);
+        if (ep && ep->idle_count > 0){
+            conn = ep->idle[--ep->idle_count];
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (!conn){
+            return open_session(host, port);
+        }
+        if (still_open(conn)){
+            return conn;
+        }
+        conn_close(conn);
+    }
+}
+
+void pool_release(const char *host, int port, Conn *conn, int reusable){
+    if (!conn){
+        return;
+    }
+    if (reusable){
+        pthread_mutex_lock(&pool_mutex);
+        PoolEndpoint *ep = find_endpoint(host, port, 1);
+        if (ep && ep->idle_count < POOL_MAX_IDLE){
+            ep->idle[ep->idle_count++] = conn;
+            conn = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    if (conn){
+        conn_close(conn);
+    }
+}
+
+void pool_destroy(void){
+    pthread_mutex_lock(&pool_mutex);
+    for (int b = 0; b < POOL_BUCKETS; ++b){
+        PoolEndpoint *ep = buckets[b];
+        while (ep){
+            PoolEndpoint *next = ep->next;
+            for (int i = 0; i < ep->idle_count; ++i){
+                conn_close(ep->idle[i]);
+            }
+            free(ep);
+            ep = next;
+        }
+        buckets[b] = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
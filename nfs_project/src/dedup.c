@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include "dedup.h"
+#include "digest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define DEDUP_MAX_CHUNKS (1 << 24)            //Longest chunk list accepted
+#define SCAN_BUFFER (4 * DEDUP_MAX_CHUNK)     //File bytes read ahead of the chunker
+#define CHUNK_RECORD 12                       //u64 key + u32 len
+
+//FastCDC cut masks: harder to hit before the average size and easier after it, which keeps chunk sizes
+//close to the average. The gear hash shifts left, so its top bits cover the last 64 bytes
+#define MASK_SMALL (((1ULL << 17) - 1) << 47)
+#define MASK_LARGE (((1ULL << 13) - 1) << 51)
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+//Fills the gear table from a fixed splitmix64 sequence, every host must cut at the same places
+static void init_gear(void){
+    uint64_t x = 0;
+    for (int i = 0; i < 256; ++i){
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t dedup_cut(const unsigned char *data, size_t len){
+    pthread_once(&gear_once, init_gear);
+    if (len <= DEDUP_MIN_CHUNK){
+        return len;
+    }
+    size_t end = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+    size_t normal = end < DEDUP_AVG_CHUNK ? end : DEDUP_AVG_CHUNK;
+    uint64_t h = 0;
+    size_t i = DEDUP_MIN_CHUNK;
+    for (; i < normal; ++i){
+        h = (h << 1) + gear[data[i]];
+        if (!(h & MASK_SMALL)){
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i){
+        h = (h << 1) + gear[data[i]];
+        if (!(h & MASK_LARGE)){
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+static void put_be32(unsigned char *p, uint32_t v){
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_be64(unsigned char *p, uint64_t v){
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_be32(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static uint64_t get_be64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+//Digest of one chunk
+static uint64_t chunk_key(Digest *d, const unsigned char *data, size_t len){
+    digest_init(d);
+    digest_update(d, data, len);
+    return digest_final(d);
+}
+
+//Reads exactly len bytes at off, returns 0 on success
+static int read_at(int file, void *buf, size_t len, uint64_t off){
+    size_t got = 0;
+    while (got < len){
+        ssize_t r = pread(file, (char *)buf + got, len - got, off + got);
+        if (r < 0 && errno == EINTR){
+            continue;
+        }
+        if (r <= 0){
+            return -1;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+//Writes exactly len bytes at off, returns 0 on success
+static int write_at(int file, const void *buf, size_t len, uint64_t off){
+    size_t done = 0;
+    while (done < len){
+        ssize_t r = pwrite(file, (const char *)buf + done, len - done, off + done);
+        if (r < 0 && errno == EINTR){
+            continue;
+        }
+        if (r <= 0){
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+//Appends a chunk to a growing list, returns 0 on success
+static int add_chunk(ChunkRef **list, size_t *count, size_t *cap, uint64_t key, uint64_t offset, uint32_t len){
+    if (*count == *cap){
+        size_t grown = *cap ? *cap * 2 : 1024;
+        ChunkRef *p = realloc(*list, grown * sizeof(ChunkRef));
+        if (!p){
+            return -1;
+        }
+        *list = p;
+        *cap = grown;
+    }
+    (*list)[(*count)++] = (ChunkRef){ key, offset, len };
+    return 0;
+}
+
+//Cuts a whole file into chunks, returns 0 with the chunks and the digest of the whole file
+static int scan_file(int file, ChunkRef **list, size_t *count, uint64_t *whole){
+    unsigned char *buf = malloc(SCAN_BUFFER);
+    Digest *chunk = malloc(sizeof(Digest));
+    Digest *all = malloc(sizeof(Digest));
+    size_t cap = 0;
+    int rc = buf && chunk && all ? 0 : -1;
+    *list = NULL;
+    *count = 0;
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (rc == 0){
+        digest_init(all);
+        size_t have = 0;
+        size_t pos = 0;
+        uint64_t off = 0;
+        int eof = 0;
+        while (rc == 0){
+            //Refill before the chunker could run out of bytes in the middle of a chunk
+            if (!eof && have - pos < DEDUP_MAX_CHUNK){
+                memmove(buf, buf + pos, have - pos);
+                have -= pos;
+                pos = 0;
+                while (have < SCAN_BUFFER){
+                    ssize_t r = read(file, buf + have, SCAN_BUFFER - have);
+                    if (r < 0 && errno == EINTR){
+                        continue;
+                    }
+                    if (r < 0){
+                        rc = -1;
+                    }
+                    if (r <= 0){
+                        eof = 1;
+                        break;
+                    }
+                    have += r;
+                }
+            }
+            if (rc != 0 || pos == have){
+                break;
+            }
+            size_t n = dedup_cut(buf + pos, have - pos);
+            digest_update(all, buf + pos, n);
+            rc = add_chunk(list, count, &cap, chunk_key(chunk, buf + pos, n), off, (uint32_t)n);
+            pos += n;
+            off += n;
+        }
+        *whole = digest_final(all);
+    }
+    free(all);
+    free(chunk);
+    free(buf);
+    if (rc != 0){
+        free(*list);
+        *list = NULL;
+    }
+    return rc;
+}
+
+//Writes the chunk list and its closing record
+static int send_list(StreamOut *out, const ChunkRef *list, size_t count, uint64_t whole){
+    unsigned char rec[CHUNK_RECORD];
+    for (size_t i = 0; i < count; ++i){
+        put_be64(rec, list[i].key);
+        put_be32(rec + 8, list[i].len);
+        if (stream_write(out, rec, sizeof(rec)) != 0){
+            return -1;
+        }
+    }
+    put_be64(rec, whole);
+    put_be32(rec + 8, 0);
+    return stream_write(out, rec, sizeof(rec)) == 0 ? stream_flush(out, 1) : -1;
+}
+
+int dedup_send(Conn *conn, int file, uint32_t stream_id){
+    ChunkRef *list;
+    size_t count;
+    uint64_t whole;
+    if (scan_file(file, &list, &count, &whole) != 0){
+        return -1;
+    }
+    StreamOut *out = stream_out_open(conn->fd, stream_id);
+    size_t want_len = (count + 7) / 8;
+    unsigned char *want = malloc(want_len ? want_len : 1);
+    unsigned char *buf = malloc(DEDUP_MAX_CHUNK);
+    int rc = out && want && buf ? send_list(out, list, count, whole) : -1;
+
+    //The want list ends the target's side of the negotiation
+    if (rc == 0){
+        StreamIn in;
+        stream_in_init(&in, conn, stream_id);
+        rc = (want_len == 0 || stream_read(&in, want, want_len) == 0) && stream_skip(&in) == 0 ? 0 : -1;
+    }
+    for (size_t i = 0; rc == 0 && i < count; ++i){
+        if (want[i / 8] & (0x80 >> (i % 8))){
+            rc = read_at(file, buf, list[i].len, list[i].offset) == 0 &&
+                 stream_write(out, buf, list[i].len) == 0 ? 0 : -1;
+        }
+    }
+    if (rc == 0){
+        rc = stream_flush(out, 1);
+    }
+    free(buf);
+    free(want);
+    free(out);
+    free(list);
+    return rc;
+}
+
+//Reads a chunk list up to its FIN
+//Returns 0 with the chunks (offsets filled in) and the digest of the whole file,
+//-1 if the list was malformed (it is still fully consumed) and -2 if the connection failed
+static int read_list(StreamIn *in, ChunkRef **list, size_t *count, uint64_t *whole){
+    unsigned char rec[CHUNK_RECORD];
+    size_t cap = 0;
+    uint64_t off = 0;
+    int bad = 0;
+    int closed = 0;
+    *list = NULL;
+    *count = 0;
+    *whole = 0;
+
+    int r;
+    while (!closed && (r = stream_read(in, rec, sizeof(rec))) == 0){
+        uint32_t len = get_be32(rec + 8);
+        if (len == 0){
+            *whole = get_be64(rec);
+            closed = 1;
+        } else if (bad || len > DEDUP_MAX_CHUNK || *count == DEDUP_MAX_CHUNKS ||
+                   add_chunk(list, count, &cap, get_be64(rec), off, len) != 0){
+            bad = 1;
+        }
+        off += len;
+    }
+    if (r < 0 || stream_skip(in) != 0){
+        free(*list);
+        return -2;
+    }
+    if (bad || !closed){
+        free(*list);
+        return -1;
+    }
+    return 0;
+}
+
+//Open-addressing table of the first chunk with each key, used to find repeats inside the new file
+typedef struct{
+    uint32_t *slots;  //1 + chunk index, 0 if empty
+    size_t mask;
+} FirstSeen;
+
+//Returns the index of the first chunk equal to chunk i, i itself when it is the first
+static uint32_t first_seen(FirstSeen *seen, const ChunkRef *list, uint32_t i){
+    for (size_t s = list[i].key & seen->mask; ; s = (s + 1) & seen->mask){
+        uint32_t j = seen->slots[s];
+        if (j == 0){
+            seen->slots[s] = i + 1;
+            return i;
+        }
+        if (list[j - 1].key == list[i].key && list[j - 1].len == list[i].len){
+            return j - 1;
+        }
+    }
+}
+
+//The file an indexed chunk was last read from, kept open for the chunks after it
+typedef struct{
+    char path[CHUNK_PATH_MAX];
+    int fd;
+} OpenSource;
+
+//Copies chunk into out from wherever the index saw it, after checking it still holds those bytes
+//Returns 1 if the chunk was reused, 0 if it has to be sent and -1 if out could not be written
+static int reuse_chunk(const ChunkRef *chunk, int out, OpenSource *src, unsigned char *buf, Digest *d){
+    ChunkLocation loc;
+    if (!chunk_index_find(chunk->key, chunk->len, &loc)){
+        return 0;
+    }
+    if (src->fd < 0 || strcmp(src->path, loc.path) != 0){
+        if (src->fd >= 0){
+            close(src->fd);
+        }
+        snprintf(src->path, sizeof(src->path), "%s", loc.path);
+        src->fd = open(loc.path, O_RDONLY | O_CLOEXEC);
+    }
+    if (src->fd < 0 || read_at(src->fd, buf, chunk->len, loc.offset) != 0 ||
+        chunk_key(d, buf, chunk->len) != chunk->key){
+        return 0;
+    }
+    return write_at(out, buf, chunk->len, chunk->offset) == 0 ? 1 : -1;
+}
+
+//Digest of the first size bytes of a file
+static int file_digest(int file, uint64_t size, unsigned char *buf, Digest *d, uint64_t *out){
+    digest_init(d);
+    for (uint64_t off = 0; off < size; ){
+        size_t n = size - off < DEDUP_MAX_CHUNK ? size - off : DEDUP_MAX_CHUNK;
+        if (read_at(file, buf, n, off) != 0){
+            return -1;
+        }
+        digest_update(d, buf, n);
+        off += n;
+    }
+    *out = digest_final(d);
+    return 0;
+}
+
+int dedup_receive(Conn *conn, uint32_t stream_id, int out_file, ChunkRef **refs, size_t *count,
+                  uint64_t *size, uint64_t *reused, char *err, size_t err_len){
+    StreamIn in;
+    stream_in_init(&in, conn, stream_id);
+    err[0] = '\0';
+    ChunkRef *list;
+    size_t n;
+    uint64_t whole;
+    int r = read_list(&in, &list, &n, &whole);
+    if (r != 0){
+        snprintf(err, err_len, "bad chunk list");
+        return r;
+    }
+    uint64_t total = n ? list[n - 1].offset + list[n - 1].len : 0;
+
+    size_t want_len = (n + 7) / 8;
+    size_t seen_size = 16;
+    while (seen_size < 2 * n){
+        seen_size *= 2;
+    }
+    FirstSeen seen = { calloc(seen_size, sizeof(uint32_t)), seen_size - 1 };
+    uint32_t *from = malloc((n ? n : 1) * sizeof(uint32_t));
+    unsigned char *want = calloc(want_len ? want_len : 1, 1);
+    unsigned char *buf = malloc(DEDUP_MAX_CHUNK);
+    Digest *d = malloc(sizeof(Digest));
+    int rc = seen.slots && from && want && buf && d ? 0 : -1;
+    if (rc != 0){
+        snprintf(err, err_len, "%s", strerror(ENOMEM));
+    } else if (ftruncate(out_file, total) != 0){
+        snprintf(err, err_len, "%s", strerror(errno));
+        rc = -1;
+    }
+
+    //Chunks the index knows are copied in now, repeats inside the file once their first copy is there
+    uint64_t have = 0;
+    OpenSource src = { "", -1 };
+    for (uint32_t i = 0; rc == 0 && i < n; ++i){
+        from[i] = first_seen(&seen, list, i);
+        if (from[i] != i){
+            have += list[i].len;
+            continue;
+        }
+        int got = reuse_chunk(&list[i], out_file, &src, buf, d);
+        if (got < 0){
+            snprintf(err, err_len, "%s", strerror(errno));
+            rc = -1;
+        } else if (got > 0){
+            have += list[i].len;
+        } else{
+            want[i / 8] |= 0x80 >> (i % 8);
+        }
+    }
+    if (src.fd >= 0){
+        close(src.fd);
+    }
+
+    StreamOut *out = rc == 0 ? stream_out_open(conn->fd, stream_id) : NULL;
+    if (rc == 0 && (!out || stream_write(out, want, want_len) != 0 || stream_flush(out, 1) != 0)){
+        free(out);
+        out = NULL;
+        rc = -2;
+    }
+    free(out);
+
+    //Every chunk sent must match its key; after a mismatch the rest is still read so the stream ends cleanly
+    stream_in_init(&in, conn, stream_id);
+    for (uint32_t i = 0; rc == 0 && i < n; ++i){
+        if (!(want[i / 8] & (0x80 >> (i % 8)))){
+            continue;
+        }
+        int got = stream_read(&in, buf, list[i].len);
+        if (got != 0){
+            rc = got < 0 ? -2 : -1;
+            snprintf(err, err_len, "chunk data cut short");
+        } else if (!err[0] && chunk_key(d, buf, list[i].len) != list[i].key){
+            snprintf(err, err_len, "chunk %u does not match its key", i);
+        } else if (!err[0] && write_at(out_file, buf, list[i].len, list[i].offset) != 0){
+            snprintf(err, err_len, "%s", strerror(errno));
+        }
+    }
+    if (rc == 0 && stream_skip(&in) != 0){
+        rc = -2;
+    }
+    if (rc == 0 && err[0]){
+        rc = -1;
+    }
+
+    for (uint32_t i = 0; rc == 0 && i < n; ++i){
+        if (from[i] != i && (read_at(out_file, buf, list[i].len, list[from[i]].offset) != 0 ||
+                             write_at(out_file, buf, list[i].len, list[i].offset) != 0)){
+            snprintf(err, err_len, "%s", strerror(errno));
+            rc = -1;
+        }
+    }
+
+    //Reused chunks were checked one by one, the whole file is checked once more as it is on disk
+    uint64_t digest;
+    if (rc == 0 && (file_digest(out_file, total, buf, d, &digest) != 0 || digest != whole)){
+        snprintf(err, err_len, "file digest mismatch");
+        rc = -1;
+    }
+
+    free(d);
+    free(buf);
+    free(want);
+    free(from);
+    free(seen.slots);
+    if (rc != 0){
+        free(list);
+        return rc;
+    }
+    *refs = list;
+    *count = n;
+    *size = total;
+    *reused = have;
+    return 0;
+}
+
+void dedup_index_file(const char *path){
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file < 0){
+        return;
+    }
+    if (fstat(file, &st) == 0 && S_ISREG(st.st_mode)){
+        int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        ChunkRef *list;
+        size_t count;
+        uint64_t whole;
+        if (!chunk_index_current(path, st.st_size, mtime) && scan_file(file, &list, &count, &whole) == 0){
+            chunk_index_add(path, st.st_size, mtime, list, count);
+            free(list);
+        }
+    }
+    close(file);
+}
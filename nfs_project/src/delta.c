@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include "delta.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DELTA_MAX_SIGS  (1 << 24)     //Largest signature table accepted
+#define DELTA_LITERAL   (1 << 20)     //Largest literal record
+
+#define SIG_RECORD 12  //u32 weak + u64 strong
+
+struct DeltaSigs{
+    uint32_t block_size;
+    uint32_t count;
+    uint32_t *weak;
+    uint64_t *strong;
+    int32_t *next;   //Next block in the same hash bucket, -1 ends the chain
+    int32_t *heads;  //First block of each bucket, -1 if empty
+    uint32_t mask;
+};
+
+uint32_t delta_block_size(uint64_t size){
+    uint64_t b = DELTA_MIN_BLOCK;
+    while (b < DELTA_MAX_BLOCK && b * b < size){
+        b += 1024;
+    }
+    return (uint32_t)b;
+}
+
+//rsync's rolling checksum: a = sum of bytes, b = sum of prefix sums, both mod 2^16
+static void weak_init(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b){
+    uint32_t sa = 0, sb = 0;
+    for (size_t i = 0; i < len; ++i){
+        sa += p[i];
+        sb += (uint32_t)(len - i) * p[i];
+    }
+    *a = sa & 0xffff;
+    *b = sb & 0xffff;
+}
+
+static uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+//64-bit block hash used to confirm weak sum matches
+static uint64_t strong_hash(const unsigned char *p, size_t len){
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t h = 0x27D4EB2F165667C5ULL + len * p1;
+    for (; len >= 8; p += 8, len -= 8){
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h ^= rotl64(w * p2, 31) * p1;
+        h = rotl64(h, 27) * p1 + 0x85EBCA77C2B2AE63ULL;
+    }
+    for (; len > 0; ++p, --len){
+        h ^= *p * 0x27D4EB2F165667C5ULL;
+        h = rotl64(h, 11) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= 0x165667B19E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint32_t bucket_of(const DeltaSigs *sigs, uint32_t weak){
+    return (weak * 2654435761U) & sigs->mask;
+}
+
+static void put_be32(unsigned char *p, uint32_t v){
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_be64(unsigned char *p, uint64_t v){
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get_be32(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static uint64_t get_be64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+//Reads exactly len bytes at off, returns 0 on success
+static int read_block(int file, unsigned char *data, size_t len, off_t off){
+    size_t got = 0;
+    while (got < len){
+        ssize_t r = pread(file, data + got, len - got, off + got);
+        if (r < 0 && errno == EINTR){
+            continue;
+        }
+        if (r <= 0){
+            return -1;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+//Writes the block size and one record per full block
+//A trailing partial block is never signed, it always travels as literal data
+static int sign_blocks(int file, off_t size, uint32_t block, unsigned char *data, StreamOut *out){
+    unsigned char rec[SIG_RECORD];
+    put_be32(rec, block);
+    if (stream_write(out, rec, sizeof(uint32_t)) != 0){
+        return -1;
+    }
+    for (off_t off = 0; off + (off_t)block <= size; off += block){
+        if (read_block(file, data, block, off) != 0){
+            return -1;
+        }
+        uint32_t a, b;
+        weak_init(data, block, &a, &b);
+        put_be32(rec, a | (b << 16));
+        put_be64(rec + 4, strong_hash(data, block));
+        if (stream_write(out, rec, sizeof(rec)) != 0){
+            return -1;
+        }
+    }
+    return stream_flush(out, 1);
+}
+
+int delta_send_signatures(int file, int sock, uint32_t stream_id){
+    struct stat st;
+    if (fstat(file, &st) < 0){
+        return -1;
+    }
+    uint32_t block = delta_block_size(st.st_size);
+    unsigned char *data = malloc(block);
+    StreamOut *out = stream_out_open(sock, stream_id);
+    int rc = data && out ? sign_blocks(file, st.st_size, block, data, out) : -1;
+    free(data);
+    free(out);
+    return rc;
+}
+
+void delta_free_signatures(DeltaSigs *sigs){
+    if (!sigs){
+        return;
+    }
+    free(sigs->weak);
+    free(sigs->strong);
+    free(sigs->next);
+    free(sigs->heads);
+    free(sigs);
+}
+
+//Appends one signature record, growing the arrays as needed
+static int sigs_add(DeltaSigs *sigs, uint32_t *cap, uint32_t weak, uint64_t strong){
+    if (sigs->count == *cap){
+        uint32_t n = *cap ? *cap * 2 : 1024;
+        uint32_t *w = realloc(sigs->weak, n * sizeof(uint32_t));
+        if (w){
+            sigs->weak = w;
+        }
+        uint64_t *s = realloc(sigs->strong, n * sizeof(uint64_t));
+        if (s){
+            sigs->strong = s;
+        }
+        if (!w || !s){
+            return -1;
+        }
+        *cap = n;
+    }
+    sigs->weak[sigs->count] = weak;
+    sigs->strong[sigs->count] = strong;
+    sigs->count++;
+    return 0;
+}
+
+//Chains every block into the bucket of its weak sum
+static int sigs_index(DeltaSigs *sigs){
+    uint32_t buckets = 1024;
+    while (buckets < sigs->count * 2){
+        buckets <<= 1;
+    }
+    sigs->mask = buckets - 1;
+    sigs->heads = malloc(buckets * sizeof(int32_t));
+    sigs->next = malloc((sigs->count ? sigs->count : 1) * sizeof(int32_t));
+    if (!sigs->heads || !sigs->next){
+        return -1;
+    }
+    memset(sigs->heads, 0xff, buckets * sizeof(int32_t));
+    for (uint32_t i = 0; i < sigs->count; ++i){
+        uint32_t bkt = bucket_of(sigs, sigs->weak[i]);
+        sigs->next[i] = sigs->heads[bkt];
+        sigs->heads[bkt] = (int32_t)i;
+    }
+    return 0;
+}
+
+int delta_read_signatures(Conn *conn, uint32_t stream_id, DeltaSigs **out){
+    StreamIn in;
+    stream_in_init(&in, conn, stream_id);
+    DeltaSigs *sigs = calloc(1, sizeof(DeltaSigs));
+    unsigned char rec[SIG_RECORD];
+    uint32_t cap = 0;
+    int bad = !sigs;
+
+    int r = stream_read(&in, rec, sizeof(uint32_t));
+    if (r < 0){
+        delta_free_signatures(sigs);
+        return -2;
+    }
+    if (r > 0){
+        delta_free_signatures(sigs);
+        return -1;
+    }
+    if (sigs){
+        sigs->block_size = get_be32(rec);
+    }
+    bad |= !sigs || sigs->block_size < DELTA_MIN_BLOCK || sigs->block_size > DELTA_MAX_BLOCK;
+
+    while (!bad){
+        r = stream_read(&in, rec, sizeof(rec));
+        if (r > 0){
+            break;
+        }
+        if (r < 0){
+            delta_free_signatures(sigs);
+            return -2;
+        }
+        if (sigs->count == DELTA_MAX_SIGS || sigs_add(sigs, &cap, get_be32(rec), get_be64(rec + 4)) != 0){
+            bad = 1;
+        }
+    }
+
+    if (bad || sigs_index(sigs) != 0){
+        delta_free_signatures(sigs);
+        return stream_skip(&in) == 0 ? -1 : -2;
+    }
+    *out = sigs;
+    return 0;
+}
+
+//Finds the block matching the window, -1 if none
+static int32_t find_block(const DeltaSigs *sigs, uint32_t weak, const unsigned char *p){
+    int32_t i = sigs->heads[bucket_of(sigs, weak)];
+    uint64_t strong = 0;
+    int hashed = 0;
+    for (; i >= 0; i = sigs->next[i]){
+        if (sigs->weak[i] != weak){
+            continue;
+        }
+        //The strong hash is only computed once some weak sum matches
+        if (!hashed){
+            strong = strong_hash(p, sigs->block_size);
+            hashed = 1;
+        }
+        if (sigs->strong[i] == strong){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int emit_copy(StreamOut *out, uint64_t first, uint32_t count){
+    unsigned char rec[13];
+    rec[0] = 'C';
+    put_be64(rec + 1, first);
+    put_be32(rec + 9, count);
+    return stream_write(out, rec, sizeof(rec));
+}
+
+static int emit_literal(StreamOut *out, const unsigned char *p, uint64_t len){
+    while (len > 0){
+        uint32_t n = len < DELTA_LITERAL ? (uint32_t)len : DELTA_LITERAL;
+        unsigned char rec[5];
+        rec[0] = 'L';
+        put_be32(rec + 1, n);
+        if (stream_write(out, rec, sizeof(rec)) != 0 || stream_write(out, p, n) != 0){
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int delta_send_delta(const DeltaSigs *sigs, int file, int sock, uint32_t stream_id){
+    struct stat st;
+    if (fstat(file, &st) < 0){
+        return -1;
+    }
+    uint64_t size = st.st_size;
+    const uint64_t block = sigs->block_size;
+
+    const unsigned char *data = NULL;
+    if (size > 0){
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data == MAP_FAILED){
+            return -1;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    StreamOut *out = stream_out_open(sock, stream_id);
+    if (!out){
+        if (data){
+            munmap((void *)data, size);
+        }
+        return -1;
+    }
+
+    unsigned char hdr[4];
+    put_be32(hdr, sigs->block_size);
+    int rc = stream_write(out, hdr, sizeof(hdr));
+
+    uint64_t pos = 0;
+    uint64_t lit = 0;          //Start of the literal run not yet sent
+    int64_t copy_first = -1;   //Pending run of matched blocks
+    uint32_t copy_count = 0;
+    uint32_t a = 0, b = 0;
+    if (sigs->count > 0 && size >= block){
+        weak_init(data, block, &a, &b);
+    }
+
+    while (rc == 0 && sigs->count > 0 && pos + block <= size){
+        int32_t idx = find_block(sigs, a | (b << 16), data + pos);
+        if (idx >= 0){
+            if (lit < pos){
+                if (copy_count > 0){
+                    rc = emit_copy(out, copy_first, copy_count);
+                    copy_count = 0;
+                }
+                if (rc == 0){
+                    rc = emit_literal(out, data + lit, pos - lit);
+                }
+            }
+            //Consecutive blocks merge into one copy record
+            if (copy_count > 0 && copy_first + copy_count == idx){
+                copy_count++;
+            } else{
+                if (copy_count > 0 && rc == 0){
+                    rc = emit_copy(out, copy_first, copy_count);
+                }
+                copy_first = idx;
+                copy_count = 1;
+            }
+            pos += block;
+            lit = pos;
+            if (pos + block <= size){
+                weak_init(data + pos, block, &a, &b);
+            }
+            continue;
+        }
+
+        //Roll the window one byte forward
+        if (pos + block < size){
+            uint32_t old = data[pos];
+            uint32_t add = data[pos + block];
+            a = (a - old + add) & 0xffff;
+            b = (b - (uint32_t)block * old + a) & 0xffff;
+        }
+        pos++;
+    }
+
+    if (rc == 0 && copy_count > 0){
+        rc = emit_copy(out, copy_first, copy_count);
+    }
+    if (rc == 0 && lit < size){
+        rc = emit_literal(out, data + lit, size - lit);
+    }
+    if (rc == 0){
+        rc = stream_flush(out, 1);
+    }
+
+    if (data){
+        munmap((void *)data, size);
+    }
+    free(out);
+    return rc;
+}
+
+//Copies a range of the old file to the end of the new one, in the kernel when possible
+static int copy_range(int old_file, uint64_t off, int new_file, uint64_t len, char *buf, size_t buf_len){
+    loff_t in_off = off;
+    while (len > 0){
+        ssize_t n = copy_file_range(old_file, &in_off, new_file, NULL, len, 0);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)){
+            break;
+        }
+        if (n <= 0){
+            return -1;
+        }
+        len -= n;
+    }
+
+    //Fallback for filesystems without copy_file_range()
+    while (len > 0){
+        ssize_t n = pread(old_file, buf, len < buf_len ? len : buf_len, in_off);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0 || write_all(new_file, buf, n) != 0){
+            return -1;
+        }
+        in_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int delta_apply(Conn *conn, uint32_t stream_id, int old_file, int new_file, uint64_t *size_out){
+    StreamIn in;
+    stream_in_init(&in, conn, stream_id);
+    unsigned char rec[12];
+    char *buf = malloc(CONN_BUF_SIZE);
+    uint64_t total = 0;
+    int failed = !buf;
+    int clean_end = 0;  //The stream ended between two records
+
+    int r = stream_read(&in, rec, sizeof(uint32_t));
+    uint64_t block = r == 0 ? get_be32(rec) : 0;
+    if (r != 0 || block < DELTA_MIN_BLOCK || block > DELTA_MAX_BLOCK){
+        failed = 1;
+    }
+
+    while (r == 0 && !failed){
+        unsigned char tag;
+        r = stream_read(&in, &tag, 1);
+        if (r != 0){
+            clean_end = r > 0;
+            break;
+        }
+
+        if (tag == 'C'){
+            if ((r = stream_read(&in, rec, 12)) != 0){
+                break;
+            }
+            uint64_t len = (uint64_t)get_be32(rec + 8) * block;
+            if (copy_range(old_file, get_be64(rec) * block, new_file, len, buf, CONN_BUF_SIZE) != 0){
+                failed = 1;
+            }
+            total += len;
+        } else if (tag == 'L'){
+            if ((r = stream_read(&in, rec, 4)) != 0){
+                break;
+            }
+            uint32_t left = get_be32(rec);
+            total += left;
+            while (left > 0 && r == 0){
+                uint32_t n = left < CONN_BUF_SIZE ? left : CONN_BUF_SIZE;
+                r = stream_read(&in, buf, n);
+                if (r == 0 && write_all(new_file, buf, n) != 0){
+                    failed = 1;
+                    break;
+                }
+                left -= n;
+            }
+        } else{
+            failed = 1;
+        }
+    }
+    free(buf);
+
+    if (r < 0){
+        return -2;
+    }
+    if (failed || !clean_end){
+        return stream_skip(&in) == 0 ? -1 : -2;
+    }
+    *size_out = total;
+    return 0;
+}
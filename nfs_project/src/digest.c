@@ -0,0 +1,346 @@
+#include "digest.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIGEST_X86 1
+#endif
+
+#define STRIPE_LEN 64
+#define SECRET_SIZE 192
+#define SECRET_LIMIT (SECRET_SIZE - STRIPE_LEN)       //Offset of the scramble key
+#define STRIPES_PER_BLOCK (SECRET_LIMIT / 8)           //Stripes mixed between two scrambles
+#define MIDSIZE_MAX 240                                //Longest input hashed without the stripe loop
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+//Default secret of XXH3
+static const unsigned char secret[SECRET_SIZE] __attribute__((aligned(64))) = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint64_t read64(const void *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t read32(const void *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+//Low and high halves of the 128-bit product, folded together
+static uint64_t mul_fold(uint64_t a, uint64_t b){
+    __uint128_t p = (__uint128_t)a * b;
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+static uint64_t avalanche64(uint64_t h){
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static uint64_t avalanche(uint64_t h){
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t len){
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static uint64_t mix16(const unsigned char *in, const unsigned char *key){
+    return mul_fold(read64(in) ^ read64(key), read64(in + 8) ^ read64(key + 8));
+}
+
+//Inputs of up to MIDSIZE_MAX bytes
+static uint64_t hash_short(const unsigned char *in, size_t len){
+    if (len == 0){
+        return avalanche64(read64(secret + 56) ^ read64(secret + 64));
+    }
+    if (len <= 3){
+        uint32_t combined = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) |
+                            (uint32_t)in[len - 1] | ((uint32_t)len << 8);
+        return avalanche64(combined ^ (uint64_t)(read32(secret) ^ read32(secret + 4)));
+    }
+    if (len <= 8){
+        uint64_t joined = read32(in + len - 4) + ((uint64_t)read32(in) << 32);
+        return rrmxmx(joined ^ (read64(secret + 8) ^ read64(secret + 16)), len);
+    }
+    if (len <= 16){
+        uint64_t lo = read64(in) ^ (read64(secret + 24) ^ read64(secret + 32));
+        uint64_t hi = read64(in + len - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+        return avalanche(len + __builtin_bswap64(lo) + hi + mul_fold(lo, hi));
+    }
+
+    uint64_t acc = len * PRIME64_1;
+    if (len <= 128){
+        if (len > 32){
+            if (len > 64){
+                if (len > 96){
+                    acc += mix16(in + 48, secret + 96);
+                    acc += mix16(in + len - 64, secret + 112);
+                }
+                acc += mix16(in + 32, secret + 64);
+                acc += mix16(in + len - 48, secret + 80);
+            }
+            acc += mix16(in + 16, secret + 32);
+            acc += mix16(in + len - 32, secret + 48);
+        }
+        acc += mix16(in, secret);
+        acc += mix16(in + len - 16, secret + 16);
+        return avalanche(acc);
+    }
+
+    size_t rounds = len / 16;
+    for (size_t i = 0; i < 8; ++i){
+        acc += mix16(in + 16 * i, secret + 16 * i);
+    }
+    acc = avalanche(acc);
+    for (size_t i = 8; i < rounds; ++i){
+        acc += mix16(in + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += mix16(in + len - 16, secret + 136 - 17);
+    return avalanche(acc);
+}
+
+//Mixes one 64-byte stripe into the accumulators
+static void accumulate_scalar(uint64_t *acc, const unsigned char *in, const unsigned char *key){
+    for (int i = 0; i < 8; ++i){
+        uint64_t data = read64(in + 8 * i);
+        uint64_t keyed = data ^ read64(key + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (uint64_t)(uint32_t)keyed * (keyed >> 32);
+    }
+}
+
+//Stirs the accumulators at the end of a block
+static void scramble_scalar(uint64_t *acc, const unsigned char *key){
+    for (int i = 0; i < 8; ++i){
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(key + 8 * i);
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+#ifdef DIGEST_X86
+//Accumulators are read and written unaligned, a Digest may come from malloc
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t *acc, const unsigned char *in, const unsigned char *key){
+    __m128i *a = (__m128i *)acc;
+    for (int i = 0; i < 4; ++i){
+        __m128i data = _mm_loadu_si128((const __m128i *)in + i);
+        __m128i keyed = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)key + i));
+        __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        _mm_storeu_si128(a + i, _mm_add_epi64(product, _mm_add_epi64(_mm_loadu_si128(a + i), swapped)));
+    }
+}
+
+__attribute__((target("sse2")))
+static void scramble_sse2(uint64_t *acc, const unsigned char *key){
+    __m128i *a = (__m128i *)acc;
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    for (int i = 0; i < 4; ++i){
+        __m128i v = _mm_loadu_si128(a + i);
+        v = _mm_xor_si128(v, _mm_srli_epi64(v, 47));
+        v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)key + i));
+        __m128i lo = _mm_mul_epu32(v, prime);
+        __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        _mm_storeu_si128(a + i, _mm_add_epi64(lo, _mm_slli_epi64(hi, 32)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const unsigned char *in, const unsigned char *key){
+    __m256i *a = (__m256i *)acc;
+    for (int i = 0; i < 2; ++i){
+        __m256i data = _mm256_loadu_si256((const __m256i *)in + i);
+        __m256i keyed = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i *)key + i));
+        __m256i product = _mm256_mul_epu32(keyed, _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        _mm256_storeu_si256(a + i, _mm256_add_epi64(product, _mm256_add_epi64(_mm256_loadu_si256(a + i), swapped)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t *acc, const unsigned char *key){
+    __m256i *a = (__m256i *)acc;
+    const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+    for (int i = 0; i < 2; ++i){
+        __m256i v = _mm256_loadu_si256(a + i);
+        v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 47));
+        v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)key + i));
+        __m256i lo = _mm256_mul_epu32(v, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        _mm256_storeu_si256(a + i, _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)));
+    }
+}
+#endif
+
+//Inner loop in use, chosen on first use
+typedef struct{
+    const char *name;
+    void (*accumulate)(uint64_t *acc, const unsigned char *in, const unsigned char *key);
+    void (*scramble)(uint64_t *acc, const unsigned char *key);
+} DigestImpl;
+
+static const DigestImpl impl_scalar = { "scalar", accumulate_scalar, scramble_scalar };
+#ifdef DIGEST_X86
+static const DigestImpl impl_sse2 = { "sse2", accumulate_sse2, scramble_sse2 };
+static const DigestImpl impl_avx2 = { "avx2", accumulate_avx2, scramble_avx2 };
+#endif
+
+static const DigestImpl *select_impl(void){
+    static const DigestImpl *chosen = NULL;
+    const DigestImpl *impl = __atomic_load_n(&chosen, __ATOMIC_ACQUIRE);
+    if (impl){
+        return impl;
+    }
+    impl = &impl_scalar;
+#ifdef DIGEST_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        impl = &impl_avx2;
+    } else if (__builtin_cpu_supports("sse2")){
+        impl = &impl_sse2;
+    }
+#endif
+    __atomic_store_n(&chosen, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+const char *digest_impl(void){
+    return select_impl()->name;
+}
+
+//Mixes whole stripes, scrambling whenever a block of STRIPES_PER_BLOCK is complete
+static void consume_stripes(const DigestImpl *impl, uint64_t *acc, size_t *done, const unsigned char *in, size_t count){
+    while (count > 0){
+        size_t n = STRIPES_PER_BLOCK - *done;
+        if (n > count){
+            n = count;
+        }
+        for (size_t i = 0; i < n; ++i){
+            impl->accumulate(acc, in + i * STRIPE_LEN, secret + (*done + i) * 8);
+        }
+        in += n * STRIPE_LEN;
+        count -= n;
+        *done += n;
+        if (*done == STRIPES_PER_BLOCK){
+            impl->scramble(acc, secret + SECRET_LIMIT);
+            *done = 0;
+        }
+    }
+}
+
+void digest_init(Digest *d){
+    static const uint64_t init[8] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+                                      PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+    memcpy(d->acc, init, sizeof(init));
+    d->buffered = 0;
+    d->stripes = 0;
+    d->total = 0;
+}
+
+void digest_update(Digest *d, const void *data, size_t len){
+    const unsigned char *in = data;
+    d->total += len;
+    //The buffer is only mixed once more input follows, so the final stripe is always still at hand
+    if (d->buffered + len <= DIGEST_BUFFER){
+        memcpy(d->buffer + d->buffered, in, len);
+        d->buffered += len;
+        return;
+    }
+
+    const DigestImpl *impl = select_impl();
+    if (d->buffered > 0){
+        size_t fill = DIGEST_BUFFER - d->buffered;
+        memcpy(d->buffer + d->buffered, in, fill);
+        in += fill;
+        len -= fill;
+        consume_stripes(impl, d->acc, &d->stripes, d->buffer, DIGEST_BUFFER / STRIPE_LEN);
+        d->buffered = 0;
+    }
+
+    //Large inputs are mixed in place, keeping at least one byte back
+    if (len > DIGEST_BUFFER){
+        size_t stripes = (len - 1) / STRIPE_LEN;
+        consume_stripes(impl, d->acc, &d->stripes, in, stripes);
+        in += stripes * STRIPE_LEN;
+        len -= stripes * STRIPE_LEN;
+        //The stripe before the kept bytes may be needed to complete the last stripe
+        memcpy(d->buffer + DIGEST_BUFFER - STRIPE_LEN, in - STRIPE_LEN, STRIPE_LEN);
+    }
+    memcpy(d->buffer, in, len);
+    d->buffered = len;
+}
+
+uint64_t digest_final(const Digest *d){
+    if (d->total <= MIDSIZE_MAX){
+        return hash_short(d->buffer, (size_t)d->total);
+    }
+
+    const DigestImpl *impl = select_impl();
+    uint64_t acc[8] __attribute__((aligned(64)));
+    memcpy(acc, d->acc, sizeof(acc));
+    size_t done = d->stripes;
+
+    //The last stripe always ends at the end of the input, overlapping what was mixed already
+    unsigned char last[STRIPE_LEN];
+    if (d->buffered >= STRIPE_LEN){
+        consume_stripes(impl, acc, &done, d->buffer, (d->buffered - 1) / STRIPE_LEN);
+        memcpy(last, d->buffer + d->buffered - STRIPE_LEN, STRIPE_LEN);
+    } else{
+        size_t catchup = STRIPE_LEN - d->buffered;
+        memcpy(last, d->buffer + DIGEST_BUFFER - catchup, catchup);
+        memcpy(last + catchup, d->buffer, d->buffered);
+    }
+    impl->accumulate(acc, last, secret + SECRET_LIMIT - 7);
+
+    uint64_t result = d->total * PRIME64_1;
+    for (int i = 0; i < 4; ++i){
+        result += mul_fold(acc[2 * i] ^ read64(secret + 11 + 16 * i), acc[2 * i + 1] ^ read64(secret + 11 + 16 * i + 8));
+    }
+    return avalanche(result);
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <endian.h>
+#include <pthread.h>
+#include "logger.h"
+#include "ring.h"
+
+#define LOG_OUT_BUF (256 * 1024)  //Formatted bytes collected before a write
+
+//One logged event as it waits in a ring, 128 bytes
+typedef struct{
+    int64_t time_ns;
+    const SyncMapping *map;  //Holds a reference
+    const char *name;        //PathArena string with a reference, NULL for a batch
+    char *spill;             //Heap copy of a message longer than msg, NULL if msg holds it
+    int batch_count;
+    int tid;
+    uint8_t op;
+    uint8_t result;
+    char msg[LOG_MSG_INLINE];
+} LogRecord;
+
+static const char *op_names[LOG_OPS] = LOG_OP_NAMES;
+
+//Rings are registered by the threads that log and drained only by the writer
+static Ring *rings[LOG_MAX_RINGS];
+static int ring_count = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread Ring *my_ring = NULL;
+
+static int log_fd = -1;
+static int log_format = LOG_TEXT;
+static pthread_t writer_thread;
+static int writer_running = 0;
+static int stopping = 0;
+
+//The writer sleeps on wake_seq once the rings are empty; producers only wake it while it sleeps
+static unsigned int wake_seq = 0;
+static int writer_sleeping = 0;
+
+//Output buffer and binary format state, touched only by the writer
+static char *out_buf;
+static size_t out_len;
+static uint64_t *announced;  //Pair hash last announced per mapping id
+static size_t announced_cap;
+
+//Cached text timestamp, redone only when the second changes
+static time_t stamp_sec = -1;
+static char stamp[32];
+
+const char *log_op_name(int op){
+    return op >= 0 && op < LOG_OPS ? op_names[op] : "?";
+}
+
+//Returns the calling thread's ring, registering one on first use
+static Ring *thread_ring(void){
+    if (my_ring){
+        return my_ring;
+    }
+    pthread_mutex_lock(&ring_mutex);
+    if (ring_count < LOG_MAX_RINGS){
+        Ring *ring = malloc(sizeof(Ring));
+        if (ring && ring_init(ring, LOG_RING_RECORDS, sizeof(LogRecord)) == 0){
+            rings[ring_count] = ring;
+            __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+            my_ring = ring;
+        } else{
+            free(ring);
+        }
+    }
+    //The rings take many producers, so late threads share the existing ones
+    if (!my_ring && ring_count > 0){
+        my_ring = rings[(size_t)pthread_self() % ring_count];
+    }
+    pthread_mutex_unlock(&ring_mutex);
+    return my_ring;
+}
+
+static void flush_out(void){
+    size_t off = 0;
+    while (off < out_len){
+        ssize_t n = write(log_fd, out_buf + off, out_len - off);
+        if (n <= 0){
+            break;
+        }
+        off += n;
+    }
+    out_len = 0;
+}
+
+//Makes sure len more bytes fit in the output buffer
+static void reserve_out(size_t len){
+    if (out_len + len > LOG_OUT_BUF){
+        flush_out();
+    }
+}
+
+static void put_bytes(const void *data, size_t len){
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+}
+
+static void put_u8(uint8_t v){
+    put_bytes(&v, sizeof(v));
+}
+
+static void put_u16(uint16_t v){
+    v = htole16(v);
+    put_bytes(&v, sizeof(v));
+}
+
+static void put_u32(uint32_t v){
+    v = htole32(v);
+    put_bytes(&v, sizeof(v));
+}
+
+static void put_str(const char *s, size_t max){
+    size_t len = strnlen(s, max);
+    put_u16((uint16_t)len);
+    put_bytes(s, len);
+}
+
+//Formats "path@host:port" of one side of a mapping
+static void put_spec(const char *path, const char *host, int port){
+    char spec[400];
+    snprintf(spec, sizeof(spec), "%s@%s:%d", path, host, port);
+    put_str(spec, sizeof(spec));
+}
+
+//Returns the message of a record, wherever it is kept
+static const char *record_msg(const LogRecord *rec){
+    return rec->spill ? rec->spill : rec->msg;
+}
+
+//Writes a record in the binary format, announcing its mapping first if needed
+static void write_binary(const LogRecord *rec){
+    const SyncMapping *map = rec->map;
+    if (map->id >= announced_cap){
+        size_t cap = announced_cap ? announced_cap : 1024;
+        while (cap <= map->id){
+            cap *= 2;
+        }
+        uint64_t *grown = realloc(announced, cap * sizeof(uint64_t));
+        if (grown){
+            memset(grown + announced_cap, 0, (cap - announced_cap) * sizeof(uint64_t));
+            announced = grown;
+            announced_cap = cap;
+        }
+    }
+    //An id reused by another pair must be announced again; without room to remember it, it is announced every time
+    int tracked = map->id < announced_cap;
+    if (!tracked || announced[map->id] != map->pair_hash){
+        reserve_out(1 + 4 + 2 * (2 + 400));
+        put_u8(LOG_REC_MAPPING);
+        put_u32(map->id);
+        put_spec(map->src_path, map->src_host, map->src_port);
+        put_spec(map->dst_path, map->dst_host, map->dst_port);
+        if (tracked){
+            announced[map->id] = map->pair_hash;
+        }
+    }
+
+    reserve_out(1 + 8 + 4 + 4 + 1 + 1 + 4 + 2 + PATH_BLOCK_SIZE + 2 + LOG_MSG_MAX);
+    put_u8(LOG_REC_EVENT);
+    uint64_t t = htole64((uint64_t)rec->time_ns);
+    put_bytes(&t, sizeof(t));
+    put_u32(map->id);
+    put_u32((uint32_t)rec->tid);
+    put_u8(rec->op);
+    put_u8(rec->result);
+    put_u32((uint32_t)rec->batch_count);
+    put_str(rec->name ? rec->name : "", PATH_BLOCK_SIZE);
+    put_str(record_msg(rec), LOG_MSG_MAX);
+}
+
+//Writes a record as a text line: [time] [source] [target] [thread] [op] [result] [message]
+static void write_text(const LogRecord *rec){
+    time_t sec = (time_t)(rec->time_ns / 1000000000);
+    if (sec != stamp_sec){
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        stamp_sec = sec;
+    }
+
+    char batch[32];
+    const char *name = rec->name;
+    if (!name){
+        snprintf(batch, sizeof(batch), "{%d files}", rec->batch_count);
+        name = batch;
+    }
+    const SyncMapping *map = rec->map;
+    const char *msg = record_msg(rec);
+    size_t room = 2 * strlen(name) + strlen(msg) + 1024;
+    reserve_out(room);
+    int n = snprintf(out_buf + out_len, LOG_OUT_BUF - out_len,
+                     "[%s] [%s/%s@%s:%d] [%s/%s@%s:%d] [%d] [%s] [%s] [%s]\n",
+                     stamp, map->src_path, name, map->src_host, map->src_port,
+                     map->dst_path, name, map->dst_host, map->dst_port,
+                     rec->tid, log_op_name(rec->op), rec->result == LOG_OK ? "OK" : "FAIL", msg);
+    if (n > 0){
+        out_len += (size_t)n < LOG_OUT_BUF - out_len ? (size_t)n : LOG_OUT_BUF - out_len - 1;
+    }
+}
+
+//Formats every waiting record, returns how many there were
+static long drain_rings(void){
+    long drained = 0;
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    LogRecord rec;
+    for (int i = 0; i < count; ++i){
+        while (ring_try_pop(rings[i], &rec) == 0){
+            if (log_format == LOG_BINARY){
+                write_binary(&rec);
+            } else{
+                write_text(&rec);
+            }
+            if (rec.name){
+                path_release(rec.name);
+            }
+            free(rec.spill);
+            mapping_unref((SyncMapping *)rec.map);
+            drained++;
+        }
+    }
+    return drained;
+}
+
+//Writer thread: formats records in batches and sleeps once every ring is empty
+static void *writer_loop(void *arg){
+    (void)arg;
+    while (1){
+        if (drain_rings() > 0){
+            continue;
+        }
+        flush_out();
+        if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+            break;
+        }
+
+        //Announcing the sleep before the last check means a record pushed after it wakes us
+        __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+        unsigned int seen = __atomic_load_n(&wake_seq, __ATOMIC_SEQ_CST);
+        if (drain_rings() == 0 && !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+            park_wait(&wake_seq, seen);
+        }
+        __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    drain_rings();
+    flush_out();
+    return NULL;
+}
+
+static void wake_writer(void){
+    if (__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST)){
+        __atomic_add_fetch(&wake_seq, 1, __ATOMIC_SEQ_CST);
+        park_wake(&wake_seq, 1);
+    }
+}
+
+int logger_start(const char *path, int format){
+    log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    out_buf = malloc(LOG_OUT_BUF);
+    if (log_fd < 0 || !out_buf){
+        return -1;
+    }
+    log_format = format;
+    if (format == LOG_BINARY){
+        put_bytes(LOG_MAGIC, 8);
+    }
+    if (pthread_create(&writer_thread, NULL, writer_loop, NULL) != 0){
+        return -1;
+    }
+    writer_running = 1;
+    return 0;
+}
+
+void logger_stop(void){
+    if (writer_running){
+        __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&wake_seq, 1, __ATOMIC_SEQ_CST);
+        park_wake(&wake_seq, 1);
+        pthread_join(writer_thread, NULL);
+        writer_running = 0;
+    }
+    for (int i = 0; i < ring_count; ++i){
+        ring_destroy(rings[i]);
+        free(rings[i]);
+    }
+    ring_count = 0;
+    if (log_fd >= 0){
+        close(log_fd);
+        log_fd = -1;
+    }
+    free(out_buf);
+    free(announced);
+    out_buf = NULL;
+    announced = NULL;
+    announced_cap = 0;
+}
+
+void log_transfer(const SyncMapping *map, const Job *job, long tid, int op, int result, const char *msg){
+    Ring *ring = thread_ring();
+    if (!ring || !writer_running){
+        return;
+    }
+
+    LogRecord rec;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec.time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec.map = map;
+    rec.name = job->filename;
+    rec.batch_count = job->batch_count;
+    rec.tid = (int)tid;
+    rec.op = (uint8_t)op;
+    rec.result = (uint8_t)result;
+    //Short messages travel in the record; a longer one is copied out and only cut if memory runs out
+    size_t len = strnlen(msg, LOG_MSG_MAX - 1);
+    rec.spill = len >= sizeof(rec.msg) ? strndup(msg, len) : NULL;
+    if (!rec.spill){
+        strncpy(rec.msg, msg, sizeof(rec.msg) - 1);
+        rec.msg[sizeof(rec.msg) - 1] = '\0';
+    }
+
+    mapping_ref((SyncMapping *)map);
+    if (rec.name){
+        path_retain(rec.name);
+    }
+    //A full ring means the writer is behind: let it run rather than drop the record
+    while (ring_try_push(ring, &rec) != 0){
+        wake_writer();
+        sched_yield();
+    }
+    wake_writer();
+}
@@ -0,0 +1,230 @@
+#include "lz.h"
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     //The block always ends with this many literals
+#define MATCH_LIMIT 12      //No match starts this close to the end of the block
+#define MAX_DISTANCE 65535
+#define HASH_BITS 13
+#define SKIP_TRIGGER 6      //Misses in a row before the search starts stepping faster
+
+static uint32_t read32(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v){
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+//Writes the 255-byte continuation of a length whose token nibble is saturated
+static unsigned char *put_length(unsigned char *op, size_t len){
+    for (; len >= 255; len -= 255){
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+//Emits literals and, unless it is the last sequence, a match; returns NULL if out would overflow
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend, const unsigned char *lit,
+                                   size_t lit_len, size_t offset, size_t match_len){
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (offset ? 2 + match_len / 255 + 1 : 0);
+    if (need > (size_t)(oend - op)){
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15){
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!offset){
+        return op;
+    }
+
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    size_t code = match_len - MIN_MATCH;
+    *token |= code < 15 ? code : 15;
+    if (code >= 15){
+        op = put_length(op, code - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const void *in, size_t len, void *out, size_t cap){
+    const unsigned char *base = in;
+    const unsigned char *end = base + len;
+    const unsigned char *anchor = base;
+    unsigned char *op = out;
+    const unsigned char *oend = op + cap;
+    uint32_t table[1 << HASH_BITS];
+
+    if (len > MATCH_LIMIT){
+        const unsigned char *mflimit = end - MATCH_LIMIT;
+        const unsigned char *matchlimit = end - LAST_LITERALS;
+        const unsigned char *ip = base + 1;
+        unsigned misses = 0;
+        memset(table, 0, sizeof(table));
+
+        while (ip < mflimit){
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != seq){
+                //Incompressible stretches are crossed with growing steps
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]){
+                --ip;
+                --ref;
+            }
+            const unsigned char *m = ip + MIN_MATCH;
+            const unsigned char *r = ref + MIN_MATCH;
+            while (m < matchlimit && *m == *r){
+                ++m;
+                ++r;
+            }
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if (!op){
+                return 0;
+            }
+            anchor = ip = m;
+            misses = 0;
+            if (ip < mflimit){
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char *)out) : 0;
+}
+
+//Reads the 255-byte continuation of a saturated length, returns -1 if the input ends first
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len){
+    unsigned b;
+    do{
+        if (*ip >= iend){
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+long lz_decompress(const void *in, size_t len, void *out, size_t cap){
+    const unsigned char *ip = in;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = out;
+    unsigned char *oend = op + cap;
+
+    while (ip < iend){
+        unsigned token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) != 0){
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)){
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend){
+            break;
+        }
+
+        if (iend - ip < 2){
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) != 0){
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)out) || match_len > (size_t)(oend - op)){
+            return -1;
+        }
+
+        //Overlapping matches repeat the bytes just written, so they are copied forwards one at a time
+        const unsigned char *ref = op - offset;
+        if (offset >= match_len){
+            memcpy(op, ref, match_len);
+        } else{
+            for (size_t i = 0; i < match_len; ++i){
+                op[i] = ref[i];
+            }
+        }
+        op += match_len;
+    }
+    return op - (unsigned char *)out;
+}
+
+static uint64_t monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void lz_stream_init(LzStream *z){
+    z->skip = 0;
+    z->backoff = 1;
+    z->bytes = 0;
+    z->ns = 0;
+}
+
+size_t lz_pack(LzStream *z, size_t len){
+    z->bytes += len;
+    if (z->skip > 0){
+        z->skip--;
+        return 0;
+    }
+
+    //A block must save an eighth of its size to be worth the unpacking on the other side
+    uint64_t start = monotonic_ns();
+    size_t room = len - len / 8;
+    size_t n = room > 4 ? lz_compress(z->raw, len, z->packed + 4, room - 4) : 0;
+    z->ns += monotonic_ns() - start;
+    if (n == 0){
+        //Incompressible data (media, archives) is probed again less and less often
+        z->skip = z->backoff;
+        z->backoff = z->backoff * 2 < LZ_SKIP_MAX ? z->backoff * 2 : LZ_SKIP_MAX;
+        return 0;
+    }
+    z->backoff = 1;
+
+    uint32_t raw_len = htobe32((uint32_t)len);
+    memcpy(z->packed, &raw_len, sizeof(raw_len));
+    return n + 4;
+}
+
+long lz_unpack(LzStream *z, size_t len){
+    uint32_t raw_len;
+    if (len < 4){
+        return -1;
+    }
+    memcpy(&raw_len, z->packed, sizeof(raw_len));
+    raw_len = be32toh(raw_len);
+    if (raw_len > LZ_BLOCK){
+        return -1;
+    }
+    long n = lz_decompress(z->packed + 4, len - 4, z->raw, raw_len);
+    if (n != (long)raw_len){
+        return -1;
+    }
+    z->bytes += n;
+    return n;
+}
@@ -7,14 +7,16 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include "worker_jobs.h"
 #include "manager_core.h"
 #include "utils.h"
+#include "protocol.h"
+#include "conn_pool.h"
+#include "metrics.h"
+#include "timer_wheel.h"
 
-//Global linked list for active sync mappings
-SyncMapping *mapping_list_head = NULL;
-//Mutex to protect access to the mapping list
-pthread_mutex_t mapping_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 extern Queue job_queue;
 extern volatile sig_atomic_t is_terminating;
 
@@ -23,13 +25,17 @@ typedef enum{
     CMD_UNKNOWN,
     CMD_ADD,
     CMD_CANCEL,
+    CMD_STATS,
     CMD_SHUTDOWN
 } CommandType;
 
+#define ADD_OPTIONS 4  //Most options after the specs of an add
+
 typedef struct{
     CommandType type;
     char arg1[256];
     char arg2[256];
+    char opts[ADD_OPTIONS][16];  //add: optional priority class, resync interval, "compress" and "dedup", in any order
 } Command;
 
 //Generates current timestamp string
@@ -39,89 +45,340 @@ static void current_timestamp(char *buf, size_t len){
 }
 
 void show_usage(const char *program_name){
-    fprintf(stderr, "Usage: %s -l <logfile> -c <config> -n <workers> -p <port> -b <buffer>\n", program_name);
+    fprintf(stderr, "Usage: %s -l <logfile> -c <config> -n <workers> -p <port> -b <buffer> [-m relay|direct] [-s <stripe_mb>] [-f <batch_files>] [-z <batch_kb>] [-d <discovery_threads>] [-q sjf|fifo] [-a <aging_ms>] [-o text|binary] [-x <metrics_port>] [-w <debounce_ms>] [-i <resync_interval>] [-v <verify_retries>]\n", program_name);
     exit(EXIT_FAILURE);
 }
 
 //Parses raw input line into a Command structure
 static Command parse_command(const char *line){
-    Command cmd = {CMD_UNKNOWN, "", ""};
+    Command cmd = {CMD_UNKNOWN, "", "", {""}};
     char word[16];
     sscanf(line, "%15s", word);
 
     if (strcmp(word, "add") == 0){
         cmd.type = CMD_ADD;
-        sscanf(line + 4, "%255s %255s", cmd.arg1, cmd.arg2);
+        sscanf(line + 4, "%255s %255s %15s %15s %15s %15s", cmd.arg1, cmd.arg2,
+               cmd.opts[0], cmd.opts[1], cmd.opts[2], cmd.opts[3]);
     } else if (strcmp(word, "cancel") == 0){
         cmd.type = CMD_CANCEL;
         sscanf(line + 7, "%255s", cmd.arg1);
+    } else if (strcmp(word, "stats") == 0){
+        cmd.type = CMD_STATS;
     } else if (strcmp(word, "shutdown") == 0){
         cmd.type = CMD_SHUTDOWN;
     }
     return cmd;
 }
 
+//A mapping waiting for its scan
+typedef struct ScanRequest{
+    SyncMapping *entry;  //Holds a reference for the scan
+    struct ScanRequest *next;
+} ScanRequest;
+
+//Discovery pool: a fixed set of threads scanning mappings in the order they were added
+static ScanRequest *scan_head = NULL;
+static ScanRequest *scan_tail = NULL;
+static int scan_closed = 0;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t *scan_threads = NULL;
+static int scan_thread_count = 0;
+
+//Hands a mapping to the discovery pool, taking over the caller's reference
+//The mapping counts its pending scans until init_sync_request() returns
+static void schedule_scan(SyncMapping *entry){
+    ScanRequest *req = malloc(sizeof(ScanRequest));
+    if (!req){
+        mapping_unref(entry);
+        return;
+    }
+    __atomic_add_fetch(&entry->scans, 1, __ATOMIC_ACQ_REL);
+    req->entry = entry;
+    req->next = NULL;
+
+    pthread_mutex_lock(&scan_mutex);
+    if (scan_closed){
+        pthread_mutex_unlock(&scan_mutex);
+        __atomic_sub_fetch(&entry->scans, 1, __ATOMIC_ACQ_REL);
+        mapping_unref(entry);
+        free(req);
+        return;
+    }
+    if (scan_tail){
+        scan_tail->next = req;
+    } else{
+        scan_head = req;
+    }
+    scan_tail = req;
+    pthread_cond_signal(&scan_ready);
+    pthread_mutex_unlock(&scan_mutex);
+}
+
+//Main loop of a discovery thread
+static void *discovery_loop(void *arg){
+    (void)arg;
+    while (1){
+        pthread_mutex_lock(&scan_mutex);
+        while (!scan_head && !scan_closed){
+            pthread_cond_wait(&scan_ready, &scan_mutex);
+        }
+        ScanRequest *req = scan_closed ? NULL : scan_head;
+        if (req){
+            scan_head = req->next;
+            if (!scan_head){
+                scan_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&scan_mutex);
+        if (!req){
+            break;
+        }
+
+        init_sync_request(req->entry);
+        free(req);
+    }
+    return NULL;
+}
+
+void discovery_start(int threads){
+    scan_threads = malloc(sizeof(pthread_t) * threads);
+    if (!scan_threads){
+        return;
+    }
+    for (int i = 0; i < threads; ++i){
+        if (pthread_create(&scan_threads[scan_thread_count], NULL, discovery_loop, NULL) == 0){
+            scan_thread_count++;
+        }
+    }
+}
+
+void discovery_stop(void){
+    pthread_mutex_lock(&scan_mutex);
+    scan_closed = 1;
+    pthread_cond_broadcast(&scan_ready);
+    pthread_mutex_unlock(&scan_mutex);
+
+    for (int i = 0; i < scan_thread_count; ++i){
+        pthread_join(scan_threads[i], NULL);
+    }
+    free(scan_threads);
+    scan_threads = NULL;
+    scan_thread_count = 0;
+
+    //Mappings that never got their turn
+    while (scan_head){
+        ScanRequest *next = scan_head->next;
+        mapping_unref(scan_head->entry);
+        free(scan_head);
+        scan_head = next;
+    }
+    scan_tail = NULL;
+}
+
+//Periodic resync: a mapping with an interval is rescanned that often, catching whatever its change stream
+//could not report. One thread drives a timer wheel holding every such mapping; each firing is moved by up
+//to RESYNC_JITTER_PCT of the interval, and at most RESYNC_RATE rescans start per second (the rest wait
+//for the next tick), so mappings added together do not hit their clients at the same instant
+//Intervals longer than WHEEL_SPAN ticks (about 19 days) are shortened to it
+#define RESYNC_TICK_MS 100     //Resolution of the wheel
+#define RESYNC_JITTER_PCT 10   //Largest shift of a firing, as a share of the interval
+#define RESYNC_RATE 20         //Rescans started per second, also the largest burst
+
+static TimerWheel resync_wheel;
+static int resync_default = 0;  //Interval of mappings added without one
+static int resync_running = 0;
+static int resync_closed = 0;
+static long long resync_epoch_ms;  //Time of tick 0
+static unsigned int resync_seed;
+static pthread_t resync_thread;
+static pthread_mutex_t resync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resync_wake = PTHREAD_COND_INITIALIZER;
+
+//Ticks until a mapping's next rescan, the interval shifted at random (resync_mutex must be held)
+static uint64_t resync_delay(const SyncMapping *entry){
+    uint64_t ticks = (uint64_t)entry->interval * 1000 / RESYNC_TICK_MS;
+    uint64_t spread = ticks * RESYNC_JITTER_PCT / 100;
+    if (spread > 0){
+        ticks = ticks - spread + (uint64_t)rand_r(&resync_seed) % (2 * spread + 1);
+    }
+    return ticks;
+}
+
+//Arms the periodic rescan of a newly registered mapping, the timer holds its own reference
+static void resync_add(SyncMapping *entry){
+    TimerNode *node = malloc(sizeof(TimerNode));
+    if (!node){
+        return;
+    }
+    mapping_ref(entry);
+    node->arg = entry;
+
+    pthread_mutex_lock(&resync_mutex);
+    if (!resync_running || resync_closed){
+        pthread_mutex_unlock(&resync_mutex);
+        mapping_unref(entry);
+        free(node);
+        return;
+    }
+    wheel_add(&resync_wheel, node, resync_wheel.now + resync_delay(entry));
+    pthread_mutex_unlock(&resync_mutex);
+}
+
+//Main loop of the resync thread: advances the wheel every tick and starts the rescans that came due
+static void *resync_loop(void *arg){
+    (void)arg;
+    //Budget in thousandths of a rescan, refilled as ticks pass
+    long long budget = RESYNC_RATE * 1000LL;
+    pthread_mutex_lock(&resync_mutex);
+    while (!resync_closed && !is_terminating){
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += RESYNC_TICK_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L){
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&resync_wake, &resync_mutex, &until);
+        if (resync_closed){
+            break;
+        }
+
+        uint64_t tick = (uint64_t)(metrics_now() / 1000000 - resync_epoch_ms) / RESYNC_TICK_MS;
+        if (tick <= resync_wheel.now){
+            continue;
+        }
+        budget += (long long)(tick - resync_wheel.now) * RESYNC_RATE * RESYNC_TICK_MS;
+        if (budget > RESYNC_RATE * 1000LL){
+            budget = RESYNC_RATE * 1000LL;
+        }
+
+        TimerNode *fired = wheel_advance(&resync_wheel, tick);
+        while (fired){
+            TimerNode *node = fired;
+            fired = node->next;
+            SyncMapping *entry = node->arg;
+            if (mapping_cancelled(entry)){
+                mapping_unref(entry);
+                free(node);
+                continue;
+            }
+            if (budget < 1000){
+                //Over the rate limit: tried again on the next tick
+                wheel_add(&resync_wheel, node, tick + 1);
+                continue;
+            }
+            //A scan still queued or running covers this round
+            if (__atomic_load_n(&entry->scans, __ATOMIC_ACQUIRE) == 0){
+                budget -= 1000;
+                mapping_ref(entry);
+                schedule_scan(entry);
+            }
+            wheel_add(&resync_wheel, node, tick + resync_delay(entry));
+        }
+    }
+    pthread_mutex_unlock(&resync_mutex);
+    return NULL;
+}
+
+void resync_start(int default_interval){
+    pthread_mutex_lock(&resync_mutex);
+    resync_default = default_interval;
+    resync_epoch_ms = metrics_now() / 1000000;
+    resync_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    wheel_init(&resync_wheel, 0);
+    resync_running = pthread_create(&resync_thread, NULL, resync_loop, NULL) == 0;
+    pthread_mutex_unlock(&resync_mutex);
+}
+
+void resync_stop(void){
+    pthread_mutex_lock(&resync_mutex);
+    int running = resync_running;
+    resync_closed = 1;
+    pthread_cond_signal(&resync_wake);
+    pthread_mutex_unlock(&resync_mutex);
+    if (!running){
+        return;
+    }
+    pthread_join(resync_thread, NULL);
+
+    TimerNode *node = wheel_take_all(&resync_wheel);
+    while (node){
+        TimerNode *next = node->next;
+        mapping_unref(node->arg);
+        free(node);
+        node = next;
+    }
+    resync_running = 0;
+}
+
+//Registers a mapping, queues its initial sync on the discovery pool and arms its periodic rescan
+//Each option ("" if absent) is a priority class (default normal), a resync interval (default -i),
+//"compress" to compress the mapping's relayed data or "dedup" to send large files as chunks the target lacks
+//Returns the result of mapping_add(), or -2 if a spec or an option is malformed
+static int add_mapping(const char *src, const char *dst, char opts[ADD_OPTIONS][16]){
+    int priority = PRIO_NORMAL;
+    int interval = resync_default;
+    int compress = 0;
+    int dedup = 0;
+    for (int i = 0; i < ADD_OPTIONS; ++i){
+        if (!opts[i][0]){
+            continue;
+        }
+        int value = mapping_priority(opts[i]);
+        if (value >= 0){
+            priority = value;
+        } else if ((value = mapping_interval(opts[i])) >= 0){
+            interval = value;
+        } else if (strcmp(opts[i], "compress") == 0){
+            compress = 1;
+        } else if (strcmp(opts[i], "dedup") == 0){
+            dedup = 1;
+        } else{
+            return -2;
+        }
+    }
+    SyncMapping *entry = mapping_parse(src, dst);
+    if (!entry){
+        return -2;
+    }
+    entry->priority = priority;
+    entry->interval = interval;
+    entry->compress = compress;
+    entry->dedup = dedup;
+    int rc = mapping_add(entry);
+    if (rc != 0){
+        return rc;
+    }
+
+    if (interval > 0){
+        resync_add(entry);
+    }
+    //The reference mapping_add() left with us goes to the scan
+    schedule_scan(entry);
+    return 0;
+}
+
 //Handles 'add' command: creates and registers a new sync mapping
-static void respond_add(int client_fd, const char *src, const char *dst){
-    SyncMapping *entry = calloc(1, sizeof(SyncMapping));
-    sscanf(src, "%[^@]@%[^:]:%d", entry->src_path, entry->src_host, &entry->src_port);
-    sscanf(dst, "%[^@]@%[^:]:%d", entry->dst_path, entry->dst_host, &entry->dst_port);
-
-    pthread_mutex_lock(&mapping_list_mutex);
-
-    //Check for duplicate entry
-    SyncMapping *cur = mapping_list_head;
-    while (cur){
-        if (strcmp(cur->src_path, entry->src_path) == 0 &&
-            strcmp(cur->src_host, entry->src_host) == 0 &&
-            cur->src_port == entry->src_port &&
-            strcmp(cur->dst_path, entry->dst_path) == 0 &&
-            strcmp(cur->dst_host, entry->dst_host) == 0 &&
-            cur->dst_port == entry->dst_port){
-            
-            pthread_mutex_unlock(&mapping_list_mutex);
-            free(entry);
-
-            char ts[32];
-            current_timestamp(ts, sizeof(ts));
-            dprintf(client_fd, "[%s] Sync task already exists: %s => %s\n", ts, src, dst);
-            return;
-        }
-        cur = cur->next;
-    }
-
-    //Add to the head of the list
-    entry->next = mapping_list_head;
-    mapping_list_head = entry;
-    pthread_mutex_unlock(&mapping_list_mutex);
-    //Start background sync thread for this mapping
-    pthread_t tid;
-    pthread_create(&tid, NULL, init_sync_request, entry);
-    pthread_detach(tid);
+static void respond_add(int client_fd, const char *src, const char *dst, char opts[ADD_OPTIONS][16]){
+    int rc = add_mapping(src, dst, opts);
 
     char ts[32];
     current_timestamp(ts, sizeof(ts));
-    dprintf(client_fd, "[%s] Sync task registered: %s => %s\n", ts, src, dst);
+    if (rc == 0){
+        dprintf(client_fd, "[%s] Sync task registered: %s => %s\n", ts, src, dst);
+    } else if (rc == 1){
+        dprintf(client_fd, "[%s] Sync task already exists: %s => %s\n", ts, src, dst);
+    } else if (rc == -1){
+        dprintf(client_fd, "[%s] Too many sync tasks: %s => %s\n", ts, src, dst);
+    } else{
+        dprintf(client_fd, "[%s] Invalid sync task: %s => %s\n", ts, src, dst);
+    }
 }
 
-//Handles 'cancel' command
+//Handles 'cancel' command: stops every mapping of the given source
 static void respond_cancel(int client_fd, const char *src_spec){
-    int removed = 0;
-    pthread_mutex_lock(&mapping_list_mutex);
-    SyncMapping **cur = &mapping_list_head;
-    while (*cur){
-        char full[512];
-        snprintf(full, sizeof(full), "%s@%s:%d", (*cur)->src_path, (*cur)->src_host, (*cur)->src_port);
-        if (strcmp(full, src_spec) == 0){
-            SyncMapping *tmp = *cur;
-            *cur = tmp->next;
-            free(tmp);
-            removed = 1;
-            break;
-        }
-        cur = &(*cur)->next;
-    }
-    pthread_mutex_unlock(&mapping_list_mutex);
+    int removed = mapping_cancel(src_spec);
 
     time_t now = time(NULL);
     if (removed){
@@ -142,7 +399,7 @@ static void respond_shutdown(int client_fd, int server_fd){
     dprintf(client_fd, "[%s] Shutdown will complete shortly. Closing control channel.\n", ts);
 
     is_terminating = 1;
-    pthread_cond_broadcast(&job_queue.not_empty);
+    queue_close(&job_queue);
 
     close(client_fd);
     close(server_fd);
@@ -154,11 +411,14 @@ static void handle_client_command(int client_fd, const char *buffer, int server_
     Command cmd = parse_command(buffer);
     switch (cmd.type) {
         case CMD_ADD:
-            respond_add(client_fd, cmd.arg1, cmd.arg2);
+            respond_add(client_fd, cmd.arg1, cmd.arg2, cmd.opts);
             break;
         case CMD_CANCEL:
             respond_cancel(client_fd, cmd.arg1);
             break;
+        case CMD_STATS:
+            metrics_report(client_fd);
+            break;
         case CMD_SHUTDOWN:
             respond_shutdown(client_fd, server_fd);
             break;
@@ -202,51 +462,758 @@ void *monitor_console_input(void *arg){
     return NULL;
 }
 
-//Starts synchronization for a given SyncMapping by issuing LIST and queuing jobs
-void *init_sync_request(void *arg) {
-    SyncMapping *entry = (SyncMapping *)arg;
-    if (!entry) return NULL;
+//A file seen in a metadata LIST reply
+typedef struct{
+    char *name;
+    long size;
+    long long mtime;
+} FileEntry;
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in src = {0};
-    src.sin_family = AF_INET;
-    src.sin_port = htons(entry->src_port);
-    inet_pton(AF_INET, entry->src_host, &src.sin_addr);
+//Open-addressing index of a directory listing, keyed by file name
+typedef struct{
+    FileEntry *slots;
+    size_t capacity;  //Always a power of two
+    size_t count;
+} FileIndex;
 
-    if (connect(sock, (struct sockaddr *)&src, sizeof(src)) < 0){
-        close(sock);
+//FNV-1a hash of a file name
+static size_t name_hash(const char *name){
+    size_t h = 1469598103934665603ULL;
+    for (const char *p = name; *p; ++p){
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+//Returns the slot holding name, or the empty slot where it belongs
+static FileEntry *index_slot(const FileIndex *idx, const char *name){
+    size_t mask = idx->capacity - 1;
+    size_t i = name_hash(name) & mask;
+    while (idx->slots[i].name && strcmp(idx->slots[i].name, name) != 0){
+        i = (i + 1) & mask;
+    }
+    return &idx->slots[i];
+}
+
+//Adds a file to the index, growing it to keep the load factor under 3/4
+static int index_add(FileIndex *idx, const char *name, long size, long long mtime){
+    if ((idx->count + 1) * 4 > idx->capacity * 3){
+        FileIndex grown = { calloc(idx->capacity ? idx->capacity * 2 : 1024, sizeof(FileEntry)),
+                            idx->capacity ? idx->capacity * 2 : 1024, idx->count };
+        if (!grown.slots){
+            return -1;
+        }
+        for (size_t i = 0; i < idx->capacity; ++i){
+            if (idx->slots[i].name){
+                *index_slot(&grown, idx->slots[i].name) = idx->slots[i];
+            }
+        }
+        free(idx->slots);
+        *idx = grown;
+    }
+
+    FileEntry *slot = index_slot(idx, name);
+    if (!slot->name){
+        slot->name = strdup(name);
+        if (!slot->name){
+            return -1;
+        }
+        idx->count++;
+    }
+    slot->size = size;
+    slot->mtime = mtime;
+    return 0;
+}
+
+static const FileEntry *index_find(const FileIndex *idx, const char *name){
+    if (idx->capacity == 0){
         return NULL;
     }
+    FileEntry *slot = index_slot(idx, name);
+    return slot->name ? slot : NULL;
+}
 
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "LIST %s\n", entry->src_path);
-    send(sock, cmd, strlen(cmd), 0);
+static void index_free(FileIndex *idx){
+    for (size_t i = 0; i < idx->capacity; ++i){
+        free(idx->slots[i].name);
+    }
+    free(idx->slots);
+    memset(idx, 0, sizeof(FileIndex));
+}
 
-    FILE *fp = fdopen(sock, "r");
-    char line[4096];
-    while (fgets(line, sizeof(line), fp)){
-        line[strcspn(line, "\r\n")] = 0;
-        if (strcmp(line, ".") == 0){
+//Called for every entry of a listing, a non-zero return stops the listing
+typedef int (*EntryFn)(void *arg, const char *name, long size, long long mtime);
+
+//Parses the "<size> <mtime_ns> <inode> <name>" lines of a metadata listing
+//Returns 0 once all were handled, -1 if fn stopped the listing
+static int parse_entries(char *data, size_t len, EntryFn fn, void *arg){
+    char *line = data;
+    char *end = data + len;
+    while (line < end){
+        char *nl = memchr(line, '\n', end - line);
+        if (!nl){
             break;
         }
+        *nl = '\0';
+
+        long long size, mtime;
+        unsigned long long ino;
+        int off = 0;
+        if (sscanf(line, "%lld %lld %llu %n", &size, &mtime, &ino, &off) == 3 && off > 0 && line[off] &&
+            fn(arg, line + off, (long)size, mtime) != 0){
+            return -1;
+        }
+        line = nl + 1;
+    }
+    return 0;
+}
 
-        Job job = {0};
-        strncpy(job.filename, line, sizeof(job.filename) - 1);
-        strncpy(job.src_dir, entry->src_path, sizeof(job.src_dir) - 1);
-        strncpy(job.src_ip, entry->src_host, sizeof(job.src_ip) - 1);
-        job.src_port = entry->src_port;
-        strncpy(job.dst_dir, entry->dst_path, sizeof(job.dst_dir) - 1);
-        strncpy(job.dst_ip, entry->dst_host, sizeof(job.dst_ip) - 1);
-        job.dst_port = entry->dst_port;
+#define LIST_PAGE_ENTRIES 65536  //Entries asked for per LIST page
+#define LIST_RETRIES 3           //Reconnects allowed for one page
+#define LIST_LINE_MAX 8192       //Longest entry carried over from one DATA frame to the next
 
-        queue_push(&job_queue, &job);
+//Progress of a paged listing, kept across pages and the retries of a page
+typedef struct{
+    EntryFn fn;
+    void *arg;
+    uint64_t skip;  //Entries of the current page handled before it had to be retried
+    uint64_t seen;  //Entries of the current page received on this attempt
+} PageFeed;
+
+//Passes a page's entries on, except those a previous attempt already delivered
+static int page_entry(void *arg, const char *name, long size, long long mtime){
+    PageFeed *feed = arg;
+    if (feed->seen++ < feed->skip){
+        return 0;
     }
+    return feed->fn(feed->arg, name, size, mtime);
+}
 
-    fclose(fp);
-    free(entry);
+//Requests one page of the recursive metadata listing of dir and feeds its entries to the feed
+//Without a cursor the whole tree is requested at once, which the client lists on parallel threads
+//buf holds FRAME_CHUNK + LIST_LINE_MAX bytes; entries may span DATA frames
+//Returns 0 with next set, -1 if the connection failed, -2 if the client refused and -3 if the feed stopped
+static int list_page(Conn *conn, const char *dir, const char *cursor, PageFeed *feed, char *buf,
+                     char *next, int *reusable){
+    *reusable = 0;
+    uint32_t sid = next_stream_id();
+    if (!cursor){
+        if (frame_send(conn->fd, OP_LIST, FRAME_META | FRAME_RECURSIVE, sid, dir, strlen(dir)) != 0){
+            return -1;
+        }
+    } else{
+        char payload[FRAME_MAX_REQUEST];
+        uint64_t max = htobe64(LIST_PAGE_ENTRIES);
+        size_t dir_len = strlen(dir) + 1;
+        size_t cursor_len = strlen(cursor);
+        if (sizeof(max) + dir_len + cursor_len > sizeof(payload)){
+            return -2;
+        }
+        memcpy(payload, &max, sizeof(max));
+        memcpy(payload + sizeof(max), dir, dir_len);
+        memcpy(payload + sizeof(max) + dir_len, cursor, cursor_len);
+        if (frame_send(conn->fd, OP_LIST, FRAME_META | FRAME_RECURSIVE | FRAME_RANGE, sid,
+                       payload, sizeof(max) + dir_len + cursor_len) != 0){
+            return -1;
+        }
+    }
+
+    size_t carry = 0;
+    while (1){
+        FrameHeader hdr;
+        if (conn_read_frame(conn, &hdr) != 0 || hdr.stream_id != sid || hdr.length > FRAME_CHUNK){
+            return -1;
+        }
+        if (hdr.opcode == OP_ERR){
+            *reusable = conn_read_exact(conn, buf, hdr.length) == 0;
+            return -2;
+        }
+        if (hdr.opcode != OP_DATA || conn_read_exact(conn, buf + carry, hdr.length) != 0){
+            return -1;
+        }
+
+        //Complete lines are handed on, a partial one waits for the next frame
+        size_t len = carry + hdr.length;
+        size_t whole = len;
+        while (whole > 0 && buf[whole - 1] != '\n'){
+            whole--;
+        }
+        if (parse_entries(buf, whole, page_entry, feed) != 0){
+            return -3;
+        }
+        carry = len - whole;
+        if (carry > LIST_LINE_MAX){
+            return -1;
+        }
+        memmove(buf, buf + whole, carry);
+        if (hdr.flags & FRAME_FIN){
+            break;
+        }
+    }
+    if (!cursor){
+        next[0] = '\0';
+        *reusable = 1;
+        return 0;
+    }
+
+    FrameHeader ok;
+    if (conn_read_frame(conn, &ok) != 0 || ok.stream_id != sid || ok.opcode != OP_OK ||
+        ok.length >= LIST_CURSOR_MAX || conn_read_exact(conn, next, ok.length) != 0){
+        return -1;
+    }
+    next[ok.length] = '\0';
+    *reusable = 1;
+    return 0;
+}
+
+//Lists the tree below dir on host:port and feeds every entry to fn as it arrives
+//Paged, a page cut short by a broken connection is requested again from its cursor on a new one;
+//otherwise the client walks the tree on parallel threads in no fixed order, and a broken listing
+//starts over, handing fn the entries it already had again
+//Returns 0 on success, -1 if the directory could not be listed or fn stopped the listing
+static int list_remote(const char *host, int port, const char *dir, int paged, EntryFn fn, void *arg){
+    char *buf = malloc(FRAME_CHUNK + LIST_LINE_MAX);
+    if (!buf){
+        return -1;
+    }
+    char cursor[LIST_CURSOR_MAX] = "";
+    char next[LIST_CURSOR_MAX];
+    PageFeed feed = { fn, arg, 0, 0 };
+    int failures = 0;
+    int rc = -1;
+
+    while (1){
+        Conn *conn = pool_acquire(host, port);
+        int reusable = 0;
+        int r = -1;
+        feed.seen = 0;
+        if (conn){
+            r = list_page(conn, dir, paged ? cursor : NULL, &feed, buf, next, &reusable);
+            pool_release(host, port, conn, reusable);
+        }
+        if (r == 0){
+            if (!next[0]){
+                rc = 0;
+                break;
+            }
+            strcpy(cursor, next);
+            feed.skip = 0;
+            failures = 0;
+            continue;
+        }
+        if (r != -1 || ++failures > LIST_RETRIES){
+            break;
+        }
+        if (paged && feed.seen > feed.skip){
+            feed.skip = feed.seen;
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+//State of one incremental scan
+typedef struct{
+    SyncMapping *entry;
+    FileIndex *existing;  //Files already present on the target
+    PathArena names;      //Names of the queued jobs
+
+    //Small files collected for the next batch job
+    char *batch;          //Newline-separated names
+    size_t batch_len;
+    size_t batch_cap;
+    int batch_count;
+    long batch_bytes;
+} SyncScan;
+
+//A scan stops once the manager shuts down or its mapping was cancelled
+static int scan_stopped(const SyncScan *scan){
+    return is_terminating || mapping_cancelled(scan->entry);
+}
+
+//Records a target file in the scan's index
+static int index_entry(void *arg, const char *name, long size, long long mtime){
+    SyncScan *scan = arg;
+    index_add(scan->existing, name, size, mtime);
+    return scan_stopped(scan) ? -1 : 0;
+}
+
+//Starts a job of the scanned mapping, the job carries its own reference to it
+static void fill_job(const SyncMapping *entry, Job *job){
+    memset(job, 0, sizeof(Job));
+    job->mapping = entry->id;
+    job->dest = entry->dest;
+    job->priority = entry->priority;
+    mapping_ref((SyncMapping *)entry);
+}
+
+//Queues a job, blocking while its shard is full so a fast listing cannot outrun the workers
+//A job refused by the closed queue gives back what it holds; returns 0 if it was queued
+static int push_job(Job *job){
+    if (queue_push(&job_queue, job) == 0){
+        return 0;
+    }
+    if (job->filename){
+        path_release(job->filename);
+    }
+    free(job->batch);
+    mapping_unref(mapping_get(job->mapping));
+    return -1;
+}
+
+//Queues the collected small files as one batch job, the worker takes ownership of the name list
+static int flush_batch(SyncScan *scan){
+    if (scan->batch_count == 0){
+        return 0;
+    }
+    Job job;
+    fill_job(scan->entry, &job);
+    job.size = scan->batch_bytes;
+    job.batch = scan->batch;
+    job.batch_count = scan->batch_count;
+
+    scan->batch = NULL;
+    scan->batch_len = 0;
+    scan->batch_cap = 0;
+    scan->batch_count = 0;
+    scan->batch_bytes = 0;
+    return push_job(&job);
+}
+
+//Adds a small file to the pending batch
+//Returns 0 on success, 1 if the file must go on its own and -1 once the queue is closed
+static int add_to_batch(SyncScan *scan, const char *name, long size){
+    size_t len = strlen(name);
+    //Room for the name, its newline and the terminating NUL
+    if (scan->batch_len + len + 2 > scan->batch_cap){
+        size_t cap = scan->batch_cap ? scan->batch_cap * 2 : 4096;
+        while (cap < scan->batch_len + len + 2){
+            cap *= 2;
+        }
+        char *grown = realloc(scan->batch, cap);
+        if (!grown){
+            return 1;
+        }
+        scan->batch = grown;
+        scan->batch_cap = cap;
+    }
+    memcpy(scan->batch + scan->batch_len, name, len);
+    scan->batch_len += len;
+    scan->batch[scan->batch_len++] = '\n';
+    scan->batch[scan->batch_len] = '\0';
+    scan->batch_count++;
+    scan->batch_bytes += size;
+
+    if (scan->batch_count >= batch_files || scan->batch_bytes >= batch_bytes){
+        return flush_batch(scan);
+    }
+    return 0;
+}
+
+//Queues a source file unless the target already has it with the same size and mtime
+//Returns -1 to stop the scan once the manager shuts down or the mapping is cancelled
+static int queue_if_changed(void *arg, const char *name, long size, long long mtime){
+    SyncScan *scan = arg;
+    if (scan_stopped(scan)){
+        return -1;
+    }
+    const FileEntry *old = index_find(scan->existing, name);
+    if (old && old->size == size && old->mtime == mtime){
+        return 0;
+    }
+
+    //Small files share one archive stream instead of paying for a PULL/PUSH pair each
+    if (batch_files > 1 && size <= BATCH_FILE_MAX){
+        int r = add_to_batch(scan, name, size);
+        if (r <= 0){
+            return r;
+        }
+    }
+
+    const char *path = path_store(&scan->names, name);
+    if (!path){
+        return 0;
+    }
+    Job job;
+    fill_job(scan->entry, &job);
+    job.filename = path;
+    job.size = size;
+    job.mtime = mtime;
+    job.dst_size = old ? old->size : 0;
+
+    //Large new files are split into stripes that several workers move at once
+    //A target copy that delta transfer can patch is cheaper to update as a whole, and so is a file the
+    //target may assemble from chunks it already holds
+    int delta = job.dst_size >= DELTA_MIN_SIZE && size >= DELTA_MIN_SIZE;
+    int dedup = scan->entry->dedup && size >= DEDUP_MIN_SIZE;
+    if (stripe_size > 0 && size > stripe_size && !delta && !dedup){
+        StripeGroup *group = malloc(sizeof(StripeGroup));
+        if (group){
+            group->remaining = (int)((size + stripe_size - 1) / stripe_size);
+            group->failed = 0;
+            job.stripes = group;
+            for (long off = 0; off < size; off += stripe_size){
+                //Every stripe is a job of its own holding the name and the mapping
+                if (off > 0){
+                    path_retain(path);
+                    mapping_ref(scan->entry);
+                }
+                job.offset = off;
+                job.length = size - off < stripe_size ? size - off : stripe_size;
+                if (push_job(&job) != 0){
+                    //Stripes that were never queued cannot finish, the group goes with the last queued one
+                    int unsent = (int)((size - off + stripe_size - 1) / stripe_size);
+                    if (__atomic_sub_fetch(&group->remaining, unsent, __ATOMIC_ACQ_REL) == 0){
+                        free(group);
+                    }
+                    return -1;
+                }
+            }
+            return 0;
+        }
+    }
+
+    return push_job(&job);
+}
+
+//Change streams: the first scan of a mapping opens a WATCH connection to its source client
+//Changed files arriving on it are collected per mapping and queued once the mapping was quiet for the
+//debounce time (at most WATCH_DEBOUNCE_MAX_MS after the first change), so a file written in many steps
+//is sent once. One thread follows every stream with epoll; the sockets are non-blocking and a frame that
+//arrives in pieces is kept until it is whole, so a stalled client never holds up the other streams
+#define WATCH_DEBOUNCE_MAX_MS 1000  //Longest a change waits while its mapping keeps changing
+#define WATCH_RETRY_MS 5000         //Wait before a broken stream is reopened by a rescan
+#define WATCH_TICK_MS 100           //Longest sleep of the watch thread, bounds how late a cancel is noticed
+#define WATCH_EVENTS 64             //Events fetched per epoll_wait call
+#define WATCH_BUF (FRAME_HDR_SIZE + STREAM_OUT_BUF)  //Room for the largest frame of a stream
+
+//The change stream of one mapping
+typedef struct WatchLink{
+    SyncMapping *entry;  //Holds a reference
+    Conn *conn;          //NULL once the stream broke
+    FileIndex changed;   //Latest metadata of every file changed since the last flush
+    long long first_ms;  //First change not queued yet, 0 if there is none
+    long long last_ms;   //Latest change
+    long long retry_ms;  //Broken stream: when the rescan that reopens it is due
+    char *partial;       //Start of a frame that is not complete yet, NULL if there is none
+    size_t partial_len;
+    struct WatchLink *next;
+} WatchLink;
+
+static int watch_debounce_ms = 0;  //0 while change streams are off
+static int watch_epoll = -1;
+static int watch_closed = 0;
+static pthread_t watch_thread;
+static WatchLink *watch_links = NULL;  //Followed by the watch thread, touched by it alone
+static WatchLink *watch_added = NULL;  //Opened by scans and not picked up yet, guarded by watch_mutex
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static long long watch_now_ms(void){
+    return metrics_now() / 1000000;
+}
+
+//Opens the change stream of a mapping's source and hands it to the watch thread
+//A source that cannot be reached is tried again later; one that refuses the directory is not watched
+static void watch_begin(SyncMapping *entry){
+    WatchLink *link = calloc(1, sizeof(WatchLink));
+    if (!link){
+        return;
+    }
+    link->entry = entry;
+    mapping_ref(entry);
+
+    int sock = connect_to(entry->src_host, entry->src_port);
+    Conn *conn = sock >= 0 ? conn_open(sock) : NULL;
+    if (sock >= 0 && !conn){
+        close(sock);
+    }
+    uint32_t sid = next_stream_id();
+    FrameHeader hdr;
+    if (conn && (frame_send(sock, OP_WATCH, 0, sid, entry->src_path, strlen(entry->src_path)) != 0 ||
+                 conn_read_frame(conn, &hdr) != 0 || hdr.stream_id != sid)){
+        conn_close(conn);
+        conn = NULL;
+    } else if (conn && (hdr.opcode != OP_OK || hdr.length != 0)){
+        conn_close(conn);
+        mapping_unref(entry);
+        free(link);
+        return;
+    }
+    //The watch thread only reads what already arrived
+    if (conn && fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != 0){
+        conn_close(conn);
+        conn = NULL;
+    }
+    link->conn = conn;
+    if (!conn){
+        link->retry_ms = watch_now_ms() + WATCH_RETRY_MS;
+    }
+
+    pthread_mutex_lock(&watch_mutex);
+    link->next = watch_added;
+    watch_added = link;
+    pthread_mutex_unlock(&watch_mutex);
+}
+
+//Records a changed file, a later change of the same file replaces the earlier one
+static int watch_entry(void *arg, const char *name, long size, long long mtime){
+    WatchLink *link = arg;
+    index_add(&link->changed, name, size, mtime);
+    link->last_ms = watch_now_ms();
+    if (link->first_ms == 0){
+        link->first_ms = link->last_ms;
+    }
+    return 0;
+}
+
+//Handles the whole frames at the front of buf, returns the bytes they took or -1 on a bad frame
+static ssize_t watch_frames(WatchLink *link, char *buf, size_t len){
+    size_t off = 0;
+    FrameHeader hdr;
+    while (len - off >= FRAME_HDR_SIZE){
+        if (frame_decode((unsigned char *)buf + off, &hdr) != 0 || hdr.opcode != OP_DATA ||
+            hdr.length > STREAM_OUT_BUF){
+            return -1;
+        }
+        if (len - off - FRAME_HDR_SIZE < hdr.length){
+            break;
+        }
+        char *payload = buf + off + FRAME_HDR_SIZE;
+        //The client lost events: only listing the tree again can tell what changed
+        if (hdr.flags & FRAME_RESCAN){
+            index_free(&link->changed);
+            link->first_ms = 0;
+            mapping_ref(link->entry);
+            schedule_scan(link->entry);
+        } else{
+            parse_entries(payload, hdr.length, watch_entry, link);
+        }
+        off += FRAME_HDR_SIZE + hdr.length;
+    }
+    return off;
+}
+
+//Reads what arrived on a stream without waiting for the rest of a frame, buf holds WATCH_BUF bytes
+//Returns 0 on success and -1 if the stream broke
+static int watch_read(WatchLink *link, char *buf){
+    Conn *conn = link->conn;
+    size_t len = link->partial_len;
+    memcpy(buf, link->partial, len);
+    free(link->partial);
+    link->partial = NULL;
+    link->partial_len = 0;
+
+    //Bytes buffered by the handshake are taken first, then the socket is read once
+    int direct = 0;
+    while (!direct){
+        direct = conn->start == conn->end;
+        ssize_t r = conn_try_read(conn, buf + len, WATCH_BUF - len);
+        if (r < 0){
+            return -1;
+        }
+        len += r;
+        ssize_t used = watch_frames(link, buf, len);
+        if (used < 0){
+            return -1;
+        }
+        len -= used;
+        memmove(buf, buf + used, len);
+    }
+    if (len > 0){
+        link->partial = malloc(len);
+        if (!link->partial){
+            return -1;
+        }
+        memcpy(link->partial, buf, len);
+        link->partial_len = len;
+    }
+    return 0;
+}
+
+//Queues the collected changes like the entries of a scan; the target is not listed, so every file is sent
+static void watch_flush(WatchLink *link){
+    FileIndex none = {0};
+    SyncScan scan = { link->entry, &none, { NULL }, NULL, 0, 0, 0, 0 };
+    for (size_t i = 0; i < link->changed.capacity; ++i){
+        FileEntry *file = &link->changed.slots[i];
+        if (file->name && queue_if_changed(&scan, file->name, file->size, file->mtime) != 0){
+            break;
+        }
+    }
+    if (!scan_stopped(&scan)){
+        flush_batch(&scan);
+    }
+    free(scan.batch);
+    path_arena_close(&scan.names);
+    index_free(&link->changed);
+    link->first_ms = 0;
+}
+
+//Closes a stream and drops what it holds, the mapping reference unless keep_ref is set
+static void watch_drop(WatchLink *link, int keep_ref){
+    if (link->conn){
+        epoll_ctl(watch_epoll, EPOLL_CTL_DEL, link->conn->fd, NULL);
+        conn_close(link->conn);
+    }
+    free(link->partial);
+    index_free(&link->changed);
+    if (!keep_ref){
+        mapping_unref(link->entry);
+    }
+    free(link);
+}
+
+//Main loop of the watch thread
+static void *watch_loop(void *arg){
+    (void)arg;
+    char *buf = malloc(WATCH_BUF);
+    struct epoll_event events[WATCH_EVENTS];
+    while (buf && !is_terminating){
+        pthread_mutex_lock(&watch_mutex);
+        int closed = watch_closed;
+        WatchLink *added = watch_added;
+        watch_added = NULL;
+        pthread_mutex_unlock(&watch_mutex);
+        if (closed){
+            break;
+        }
+        while (added){
+            WatchLink *next = added->next;
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN;
+            ev.data.ptr = added;
+            if (added->conn && epoll_ctl(watch_epoll, EPOLL_CTL_ADD, added->conn->fd, &ev) != 0){
+                conn_close(added->conn);
+                added->conn = NULL;
+                added->retry_ms = watch_now_ms() + WATCH_RETRY_MS;
+            }
+            added->next = watch_links;
+            watch_links = added;
+            added = next;
+        }
+
+        //Sleep until the earliest pending batch is due
+        long long now = watch_now_ms();
+        long long timeout = WATCH_TICK_MS;
+        for (WatchLink *link = watch_links; link; link = link->next){
+            if (link->first_ms){
+                long long due = link->last_ms + watch_debounce_ms;
+                if (due > link->first_ms + WATCH_DEBOUNCE_MAX_MS){
+                    due = link->first_ms + WATCH_DEBOUNCE_MAX_MS;
+                }
+                if (due - now < timeout){
+                    timeout = due > now ? due - now : 0;
+                }
+            }
+        }
+        int n = epoll_wait(watch_epoll, events, WATCH_EVENTS, (int)timeout);
+        for (int i = 0; i < n; ++i){
+            WatchLink *link = events[i].data.ptr;
+            if (watch_read(link, buf) != 0){
+                epoll_ctl(watch_epoll, EPOLL_CTL_DEL, link->conn->fd, NULL);
+                conn_close(link->conn);
+                link->conn = NULL;
+                link->retry_ms = watch_now_ms() + WATCH_RETRY_MS;
+            }
+        }
+
+        now = watch_now_ms();
+        WatchLink **prev = &watch_links;
+        while (*prev){
+            WatchLink *link = *prev;
+            if (mapping_cancelled(link->entry)){
+                *prev = link->next;
+                watch_drop(link, 0);
+                continue;
+            }
+            if (link->first_ms && (now - link->last_ms >= watch_debounce_ms ||
+                                   now - link->first_ms >= WATCH_DEBOUNCE_MAX_MS)){
+                watch_flush(link);
+            }
+            //A broken stream is reopened by a rescan, which also picks up the changes it missed
+            if (!link->conn && now >= link->retry_ms){
+                *prev = link->next;
+                __atomic_store_n(&link->entry->watching, 0, __ATOMIC_RELEASE);
+                schedule_scan(link->entry);
+                watch_drop(link, 1);
+                continue;
+            }
+            prev = &link->next;
+        }
+    }
+    free(buf);
     return NULL;
 }
 
+void watch_start(int debounce_ms){
+    watch_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (watch_epoll < 0){
+        return;
+    }
+    if (pthread_create(&watch_thread, NULL, watch_loop, NULL) != 0){
+        close(watch_epoll);
+        watch_epoll = -1;
+        return;
+    }
+    watch_debounce_ms = debounce_ms;
+}
+
+void watch_stop(void){
+    if (watch_debounce_ms == 0){
+        return;
+    }
+    pthread_mutex_lock(&watch_mutex);
+    watch_closed = 1;
+    pthread_mutex_unlock(&watch_mutex);
+    pthread_join(watch_thread, NULL);
+    watch_debounce_ms = 0;
+
+    //Closing the connections tells the clients to stop watching
+    WatchLink *lists[2] = { watch_links, watch_added };
+    for (int i = 0; i < 2; ++i){
+        while (lists[i]){
+            WatchLink *next = lists[i]->next;
+            watch_drop(lists[i], 0);
+            lists[i] = next;
+        }
+    }
+    watch_links = NULL;
+    watch_added = NULL;
+    close(watch_epoll);
+    watch_epoll = -1;
+}
+
+//Starts synchronization for a given SyncMapping: lists both trees and queues new or changed files
+//Source entries are queued while the listing streams in, so transfers start before it ends
+void init_sync_request(SyncMapping *entry){
+    //The change stream is opened before the source is listed, so nothing changed meanwhile is missed
+    if (watch_debounce_ms > 0 && !__atomic_exchange_n(&entry->watching, 1, __ATOMIC_ACQ_REL)){
+        watch_begin(entry);
+    }
+
+    FileIndex existing = {0};
+    SyncScan scan = { entry, &existing, { NULL }, NULL, 0, 0, 0, 0 };
+    //The target's listing only fills the index, which holds the whole tree anyway and takes an entry
+    //twice without harm, so it comes from the parallel walker in one stream. The source's entries become
+    //jobs as they arrive and are listed in pages from a single-threaded walk: slower on wide trees, but a
+    //broken connection resumes at the page's cursor instead of listing everything again and queueing
+    //files twice. While the job queue is full the source stream is not read, which holds the client's walk back
+    //A missing target directory simply means every file is new
+    list_remote(entry->dst_host, entry->dst_port, entry->dst_path, 0, index_entry, &scan);
+
+    if (!scan_stopped(&scan) &&
+        list_remote(entry->src_host, entry->src_port, entry->src_path, 1, queue_if_changed, &scan) == 0){
+        flush_batch(&scan);
+    }
+
+    free(scan.batch);
+    path_arena_close(&scan.names);
+    index_free(&existing);
+    __atomic_sub_fetch(&entry->scans, 1, __ATOMIC_ACQ_REL);
+    mapping_unref(entry);
+}
+
 //Loads initial sync mappings from a config file and starts them
 void load_sync_config(const char *filename){
     FILE *f = fopen(filename, "r");
@@ -257,43 +1224,11 @@ void load_sync_config(const char *filename){
     char line[512];
     while (fgets(line, sizeof(line), f)){
         char src[256], dst[256];
-        if (sscanf(line, "%255s %255s", src, dst) != 2){
-            continue;
-        }
-
-        SyncMapping *entry = calloc(1, sizeof(SyncMapping));
-        sscanf(src, "%[^@]@%[^:]:%d", entry->src_path, entry->src_host, &entry->src_port);
-        sscanf(dst, "%[^@]@%[^:]:%d", entry->dst_path, entry->dst_host, &entry->dst_port);
-
-        pthread_mutex_lock(&mapping_list_mutex);
-        int exists = 0;
-        SyncMapping *cur = mapping_list_head;
-        while (cur){
-            if (strcmp(cur->src_path, entry->src_path) == 0 &&
-                strcmp(cur->src_host, entry->src_host) == 0 &&
-                cur->src_port == entry->src_port &&
-                strcmp(cur->dst_path, entry->dst_path) == 0 &&
-                strcmp(cur->dst_host, entry->dst_host) == 0 &&
-                cur->dst_port == entry->dst_port){
-                exists = 1;
-                break;
-            }
-            cur = cur->next;
-        }
-
-        if (exists){
-            pthread_mutex_unlock(&mapping_list_mutex);
-            free(entry);
+        char opts[ADD_OPTIONS][16] = {""};
+        if (sscanf(line, "%255s %255s %15s %15s %15s %15s", src, dst, opts[0], opts[1], opts[2], opts[3]) < 2){
             continue;
         }
-
-        entry->next = mapping_list_head;
-        mapping_list_head = entry;
-        pthread_mutex_unlock(&mapping_list_mutex);
-
-        pthread_t tid;
-        pthread_create(&tid, NULL, init_sync_request, entry);
-        pthread_detach(tid);
+        add_mapping(src, dst, opts);
     }
     fclose(f);
 }
\ No newline at end of file
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include "mapping.h"
+#include "utils.h"
+
+//Id table: two levels whose chunks never move once allocated, so lookups need no lock
+static SyncMapping **chunks[MAPPING_MAX_CHUNKS];
+static uint32_t next_id;
+
+//Ids of freed mappings, reused before the table grows
+static uint32_t *free_ids;
+static size_t free_count;
+static size_t free_cap;
+static pthread_mutex_t ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Registry: chained hash indexes on the whole pair and on the source spec
+//Only add and cancel touch them, workers reach mappings through the id table
+static SyncMapping **pair_buckets;
+static SyncMapping **source_buckets;
+static size_t bucket_count;  //Always zero or a power of two
+static size_t registered;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define FNV_OFFSET 1469598103934665603ULL
+#define FNV_PRIME  1099511628211ULL
+
+//FNV-1a over a string and its terminator, so adjacent fields cannot run together
+static uint64_t hash_str(uint64_t h, const char *s){
+    do{
+        h = (h ^ (unsigned char)*s) * FNV_PRIME;
+    } while (*s++);
+    return h;
+}
+
+static uint64_t hash_endpoint(uint64_t h, const char *path, const char *host, int port){
+    h = hash_str(hash_str(h, path), host);
+    return (h ^ (uint32_t)port) * FNV_PRIME;
+}
+
+//Collapses repeated slashes and drops a trailing one ("/a//b/" -> "/a/b")
+static void normalize_path(char *path){
+    char *out = path;
+    for (const char *p = path; *p; ++p){
+        if (*p != '/' || out == path || out[-1] != '/'){
+            *out++ = *p;
+        }
+    }
+    if (out > path + 1 && out[-1] == '/'){
+        out--;
+    }
+    *out = '\0';
+}
+
+//Splits "<path>@<host>:<port>" into normalized parts, returns 0 on success
+static int parse_spec(const char *spec, char *path, char *host, int *port){
+    char rest;
+    if (sscanf(spec, "%255[^@]@%63[^:]:%d%c", path, host, port, &rest) != 3 || *port <= 0 || *port > 65535){
+        return -1;
+    }
+    normalize_path(path);
+    for (char *p = host; *p; ++p){
+        *p = tolower((unsigned char)*p);
+    }
+    return 0;
+}
+
+SyncMapping *mapping_parse(const char *src, const char *dst){
+    SyncMapping *mapping = calloc(1, sizeof(SyncMapping));
+    if (!mapping){
+        return NULL;
+    }
+    if (parse_spec(src, mapping->src_path, mapping->src_host, &mapping->src_port) != 0 ||
+        parse_spec(dst, mapping->dst_path, mapping->dst_host, &mapping->dst_port) != 0){
+        free(mapping);
+        return NULL;
+    }
+    mapping->source_hash = hash_endpoint(FNV_OFFSET, mapping->src_path, mapping->src_host, mapping->src_port);
+    mapping->pair_hash = hash_endpoint(mapping->source_hash, mapping->dst_path, mapping->dst_host, mapping->dst_port);
+    mapping->dest = (uint32_t)hash_endpoint(FNV_OFFSET, "", mapping->dst_host, mapping->dst_port);
+    mapping->priority = PRIO_NORMAL;
+    return mapping;
+}
+
+int mapping_priority(const char *name){
+    static const char *names[PRIO_CLASSES] = { "high", "normal", "low" };
+    for (int i = 0; i < PRIO_CLASSES; ++i){
+        if (strcmp(name, names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int mapping_interval(const char *text){
+    long value;
+    char unit = 's';
+    char rest;
+    int n = sscanf(text, "%ld%c%c", &value, &unit, &rest);
+    if (n < 1 || n > 2 || value < 0){
+        return -1;
+    }
+    long scale = unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600 : unit == 'd' ? 86400 : 0;
+    if (scale == 0 || value > INT_MAX / scale){
+        return -1;
+    }
+    return (int)(value * scale);
+}
+
+static int same_source(const SyncMapping *a, const char *path, const char *host, int port){
+    return a->src_port == port && strcmp(a->src_path, path) == 0 && strcmp(a->src_host, host) == 0;
+}
+
+static int same_pair(const SyncMapping *a, const SyncMapping *b){
+    return same_source(a, b->src_path, b->src_host, b->src_port) && a->dst_port == b->dst_port &&
+           strcmp(a->dst_path, b->dst_path) == 0 && strcmp(a->dst_host, b->dst_host) == 0;
+}
+
+//Doubles both indexes once they hold as many mappings as buckets
+static int grow_buckets(void){
+    size_t count = bucket_count ? bucket_count * 2 : 1024;
+    SyncMapping **pairs = calloc(count, sizeof(SyncMapping *));
+    SyncMapping **sources = calloc(count, sizeof(SyncMapping *));
+    if (!pairs || !sources){
+        free(pairs);
+        free(sources);
+        return -1;
+    }
+    for (size_t i = 0; i < bucket_count; ++i){
+        for (SyncMapping *m = pair_buckets[i], *next; m; m = next){
+            next = m->next_pair;
+            m->next_pair = pairs[m->pair_hash & (count - 1)];
+            pairs[m->pair_hash & (count - 1)] = m;
+        }
+        for (SyncMapping *m = source_buckets[i], *next; m; m = next){
+            next = m->next_source;
+            m->next_source = sources[m->source_hash & (count - 1)];
+            sources[m->source_hash & (count - 1)] = m;
+        }
+    }
+    free(pair_buckets);
+    free(source_buckets);
+    pair_buckets = pairs;
+    source_buckets = sources;
+    bucket_count = count;
+    return 0;
+}
+
+//Gives the mapping a slot in the id table, returns 0 on success
+static int assign_id(SyncMapping *mapping){
+    pthread_mutex_lock(&ids_mutex);
+    uint32_t id;
+    if (free_count > 0){
+        id = free_ids[--free_count];
+    } else if (next_id < (uint32_t)MAPPING_CHUNK * MAPPING_MAX_CHUNKS){
+        id = next_id;
+        if (!chunks[id / MAPPING_CHUNK]){
+            chunks[id / MAPPING_CHUNK] = calloc(MAPPING_CHUNK, sizeof(SyncMapping *));
+            if (!chunks[id / MAPPING_CHUNK]){
+                pthread_mutex_unlock(&ids_mutex);
+                return -1;
+            }
+        }
+        next_id++;
+    } else{
+        pthread_mutex_unlock(&ids_mutex);
+        return -1;
+    }
+
+    mapping->id = id;
+    __atomic_store_n(&chunks[id / MAPPING_CHUNK][id % MAPPING_CHUNK], mapping, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ids_mutex);
+    return 0;
+}
+
+int mapping_add(SyncMapping *mapping){
+    pthread_mutex_lock(&registry_mutex);
+    if (bucket_count > 0){
+        for (SyncMapping *m = pair_buckets[mapping->pair_hash & (bucket_count - 1)]; m; m = m->next_pair){
+            if (m->pair_hash == mapping->pair_hash && same_pair(m, mapping)){
+                pthread_mutex_unlock(&registry_mutex);
+                free(mapping);
+                return 1;
+            }
+        }
+    }
+    if ((registered >= bucket_count && grow_buckets() != 0) || assign_id(mapping) != 0){
+        pthread_mutex_unlock(&registry_mutex);
+        free(mapping);
+        return -1;
+    }
+
+    mapping->refs = 2;
+    size_t mask = bucket_count - 1;
+    mapping->next_pair = pair_buckets[mapping->pair_hash & mask];
+    pair_buckets[mapping->pair_hash & mask] = mapping;
+    mapping->next_source = source_buckets[mapping->source_hash & mask];
+    source_buckets[mapping->source_hash & mask] = mapping;
+    registered++;
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+//Unlinks a mapping from its pair chain
+static void unlink_pair(SyncMapping *mapping){
+    SyncMapping **link = &pair_buckets[mapping->pair_hash & (bucket_count - 1)];
+    while (*link != mapping){
+        link = &(*link)->next_pair;
+    }
+    *link = mapping->next_pair;
+}
+
+int mapping_cancel(const char *src){
+    char path[256], host[64];
+    int port;
+    if (parse_spec(src, path, host, &port) != 0){
+        return 0;
+    }
+    uint64_t hash = hash_endpoint(FNV_OFFSET, path, host, port);
+
+    //Removed mappings are released after the lock, the last release takes the id lock
+    SyncMapping *removed = NULL;
+    int count = 0;
+    pthread_mutex_lock(&registry_mutex);
+    if (bucket_count > 0){
+        SyncMapping **link = &source_buckets[hash & (bucket_count - 1)];
+        while (*link){
+            SyncMapping *m = *link;
+            if (m->source_hash != hash || !same_source(m, path, host, port)){
+                link = &m->next_source;
+                continue;
+            }
+            *link = m->next_source;
+            unlink_pair(m);
+            m->next_source = removed;
+            removed = m;
+            registered--;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    while (removed){
+        SyncMapping *next = removed->next_source;
+        __atomic_store_n(&removed->cancelled, 1, __ATOMIC_RELEASE);
+        mapping_unref(removed);
+        removed = next;
+    }
+    return count;
+}
+
+void mapping_foreach(void (*fn)(SyncMapping *mapping, void *arg), void *arg){
+    pthread_mutex_lock(&registry_mutex);
+    for (size_t i = 0; i < bucket_count; ++i){
+        for (SyncMapping *m = pair_buckets[i]; m; m = m->next_pair){
+            fn(m, arg);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+int mapping_cancelled(const SyncMapping *mapping){
+    return __atomic_load_n(&mapping->cancelled, __ATOMIC_ACQUIRE);
+}
+
+SyncMapping *mapping_get(uint32_t id){
+    return __atomic_load_n(&chunks[id / MAPPING_CHUNK][id % MAPPING_CHUNK], __ATOMIC_ACQUIRE);
+}
+
+void mapping_ref(SyncMapping *mapping){
+    __atomic_add_fetch(&mapping->refs, 1, __ATOMIC_RELAXED);
+}
+
+void mapping_unref(SyncMapping *mapping){
+    if (__atomic_sub_fetch(&mapping->refs, 1, __ATOMIC_ACQ_REL) > 0){
+        return;
+    }
+
+    pthread_mutex_lock(&ids_mutex);
+    chunks[mapping->id / MAPPING_CHUNK][mapping->id % MAPPING_CHUNK] = NULL;
+    if (free_count == free_cap){
+        size_t cap = free_cap ? free_cap * 2 : 256;
+        uint32_t *grown = realloc(free_ids, cap * sizeof(uint32_t));
+        if (grown){
+            free_ids = grown;
+            free_cap = cap;
+        }
+    }
+    //An id that cannot be recorded is simply never reused
+    if (free_count < free_cap){
+        free_ids[free_count++] = mapping->id;
+    }
+    pthread_mutex_unlock(&ids_mutex);
+    free(mapping);
+}
@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "utils.h"
+#include "protocol.h"
+#include "conn_pool.h"
+
+extern Queue job_queue;
+
+static ThreadMetrics *slots[METRICS_MAX_THREADS];
+static int slot_count = 0;
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadMetrics *my_slot = NULL;
+static __thread int my_slot_tried = 0;
+
+//State of the previous 'stats' report, rates are measured against it
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long long reported_at = 0;
+static uint64_t reported_jobs = 0;
+static uint64_t reported_bytes = 0;
+static uint64_t reported_busy[METRICS_MAX_THREADS];
+
+static const char *latency_names[LAT_KINDS] = { "connect", "first_byte", "transfer" };
+
+long long metrics_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//Returns the calling thread's slot, registering one on first use (NULL once all are taken)
+static ThreadMetrics *thread_slot(void){
+    if (my_slot || my_slot_tried){
+        return my_slot;
+    }
+    my_slot_tried = 1;
+    ThreadMetrics *slot = calloc(1, sizeof(ThreadMetrics));
+    if (!slot){
+        return NULL;
+    }
+    slot->worker = -1;
+    pthread_mutex_lock(&slot_mutex);
+    if (slot_count < METRICS_MAX_THREADS){
+        slots[slot_count] = slot;
+        __atomic_store_n(&slot_count, slot_count + 1, __ATOMIC_RELEASE);
+        my_slot = slot;
+    }
+    pthread_mutex_unlock(&slot_mutex);
+    if (!my_slot){
+        free(slot);
+    }
+    return my_slot;
+}
+
+//Adds to a counter that only the calling thread writes: a plain load and store, no locked instruction
+static void bump(uint64_t *counter, uint64_t v){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *counter){
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int hist_index(uint64_t v){
+    if (v < (1u << HIST_SUB_BITS)){
+        return (int)v;
+    }
+    int exp = 63 - __builtin_clzll(v);
+    int idx = ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((v >> (exp - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+//Smallest value counted by a bucket
+static uint64_t hist_lower(int idx){
+    if (idx < (1 << HIST_SUB_BITS)){
+        return (uint64_t)idx;
+    }
+    int exp = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(idx & ((1 << HIST_SUB_BITS) - 1));
+    return (((uint64_t)1 << HIST_SUB_BITS) + sub) << (exp - HIST_SUB_BITS);
+}
+
+static void hist_record(Histogram *h, uint64_t ns){
+    bump(&h->counts[hist_index(ns)], 1);
+    bump(&h->total, 1);
+    bump(&h->sum_ns, ns);
+    if (ns > load(&h->max_ns)){
+        __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+//Value below which the fraction q of the samples lies, reported as the middle of its bucket
+static uint64_t hist_quantile(const Histogram *h, double q){
+    if (h->total == 0){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * h->total + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i){
+        seen += h->counts[i];
+        if (seen >= rank && h->counts[i] > 0){
+            uint64_t lo = hist_lower(i);
+            uint64_t hi = i + 1 < HIST_BUCKETS ? hist_lower(i + 1) : lo;
+            uint64_t mid = lo + (hi - lo) / 2;
+            return mid < h->max_ns ? mid : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+static void record_connect(long long ns){
+    metrics_latency(LAT_CONNECT, ns);
+}
+
+void metrics_init(void){
+    reported_at = metrics_now();
+    pool_connect_hook = record_connect;
+}
+
+void metrics_worker(long worker){
+    ThreadMetrics *slot = thread_slot();
+    if (slot){
+        slot->worker = worker;
+    }
+}
+
+void metrics_latency(int kind, long long ns){
+    ThreadMetrics *slot = thread_slot();
+    if (slot && ns >= 0){
+        hist_record(&slot->latency[kind], (uint64_t)ns);
+    }
+}
+
+//Updates the busy time and running job of a slot as one step for busy_at()
+static void set_busy(ThreadMetrics *slot, uint64_t add_ns, int64_t start_ns){
+    __atomic_add_fetch(&slot->job_seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->busy_ns, slot->busy_ns + add_ns, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->job_start_ns, start_ns, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&slot->job_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+//Busy time of a slot up to now, including the elapsed part of its running job
+static uint64_t busy_at(ThreadMetrics *slot, long long now){
+    while (1){
+        uint64_t seq = __atomic_load_n(&slot->job_seq, __ATOMIC_SEQ_CST);
+        uint64_t busy = __atomic_load_n(&slot->busy_ns, __ATOMIC_SEQ_CST);
+        int64_t start = __atomic_load_n(&slot->job_start_ns, __ATOMIC_SEQ_CST);
+        if (!(seq & 1) && __atomic_load_n(&slot->job_seq, __ATOMIC_SEQ_CST) == seq){
+            return busy + (start > 0 && now > start ? (uint64_t)(now - start) : 0);
+        }
+        sched_yield();
+    }
+}
+
+long long metrics_job_start(void){
+    long long now = metrics_now();
+    ThreadMetrics *slot = thread_slot();
+    if (slot){
+        set_busy(slot, 0, now);
+    }
+    return now;
+}
+
+void metrics_job(SyncMapping *map, uint64_t bytes, int ok, long long ns){
+    ThreadMetrics *slot = thread_slot();
+    if (slot){
+        bump(ok ? &slot->jobs_done : &slot->jobs_failed, 1);
+        bump(&slot->bytes, bytes);
+        //Reports counted the elapsed part through busy_at(), so the whole job lands as its start is cleared
+        set_busy(slot, (uint64_t)ns, 0);
+        hist_record(&slot->latency[LAT_TRANSFER], (uint64_t)ns);
+    }
+    //Mapping totals are shared by its workers, but change only once per job
+    __atomic_add_fetch(ok ? &map->jobs_done : &map->jobs_failed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&map->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+//Sum of every slot
+typedef struct{
+    uint64_t jobs_done;
+    uint64_t jobs_failed;
+    uint64_t bytes;
+    Histogram latency[LAT_KINDS];
+} Totals;
+
+static void sum_slots(Totals *t){
+    memset(t, 0, sizeof(Totals));
+    int count = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i){
+        ThreadMetrics *s = slots[i];
+        t->jobs_done += load(&s->jobs_done);
+        t->jobs_failed += load(&s->jobs_failed);
+        t->bytes += load(&s->bytes);
+        for (int k = 0; k < LAT_KINDS; ++k){
+            Histogram *h = &t->latency[k];
+            for (int b = 0; b < HIST_BUCKETS; ++b){
+                h->counts[b] += load(&s->latency[k].counts[b]);
+            }
+            h->total += load(&s->latency[k].total);
+            h->sum_ns += load(&s->latency[k].sum_ns);
+            uint64_t max = load(&s->latency[k].max_ns);
+            h->max_ns = max > h->max_ns ? max : h->max_ns;
+        }
+    }
+}
+
+//Bytes moved from (source) and to (target) one client
+typedef struct{
+    char name[80];
+    uint64_t sent;
+    uint64_t received;
+    uint64_t sent_delta;
+    uint64_t received_delta;
+} HostTotal;
+
+//One listed mapping
+typedef struct{
+    char src[340];
+    char dst[340];
+    uint64_t bytes;
+    uint64_t delta;
+    uint64_t jobs_done;
+    uint64_t jobs_failed;
+} MappingTotal;
+
+//Collected while walking the registry
+typedef struct{
+    HostTotal *hosts;
+    int host_count;
+    int host_cap;
+    MappingTotal top[METRICS_TOP_MAPPINGS];
+    int top_count;
+    int mapping_count;
+    int advance;  //Moves each mapping's reported_bytes on ('stats' only)
+    FILE *prom;   //Prometheus output, per-mapping series are written while walking
+    FILE *prom_jobs;  //Job series, kept apart since a metric's samples must be contiguous
+} Walk;
+
+static void add_host(Walk *w, const char *host, int port, uint64_t bytes, uint64_t delta, int is_src){
+    char name[80];
+    snprintf(name, sizeof(name), "%s:%d", host, port);
+    HostTotal *h = NULL;
+    for (int i = 0; i < w->host_count; ++i){
+        if (strcmp(w->hosts[i].name, name) == 0){
+            h = &w->hosts[i];
+            break;
+        }
+    }
+    if (!h){
+        if (w->host_count == w->host_cap){
+            int cap = w->host_cap ? w->host_cap * 2 : 16;
+            HostTotal *grown = realloc(w->hosts, cap * sizeof(HostTotal));
+            if (!grown){
+                return;
+            }
+            w->hosts = grown;
+            w->host_cap = cap;
+        }
+        h = &w->hosts[w->host_count++];
+        memset(h, 0, sizeof(HostTotal));
+        strcpy(h->name, name);
+    }
+    if (is_src){
+        h->sent += bytes;
+        h->sent_delta += delta;
+    } else{
+        h->received += bytes;
+        h->received_delta += delta;
+    }
+}
+
+//Copies a Prometheus label value, escaping backslash, double quote and newline
+static void prom_escape(char *out, size_t len, const char *s){
+    size_t n = 0;
+    for (; *s && n + 2 < len; ++s){
+        if (*s == '\\' || *s == '"'){
+            out[n++] = '\\';
+            out[n++] = *s;
+        } else if (*s == '\n'){
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else{
+            out[n++] = *s;
+        }
+    }
+    out[n] = '\0';
+}
+
+static void walk_mapping(SyncMapping *m, void *arg){
+    Walk *w = arg;
+    uint64_t bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+    uint64_t delta = bytes - m->reported_bytes;
+    if (w->advance){
+        m->reported_bytes = bytes;
+    }
+    w->mapping_count++;
+    add_host(w, m->src_host, m->src_port, bytes, delta, 1);
+    add_host(w, m->dst_host, m->dst_port, bytes, delta, 0);
+
+    MappingTotal t;
+    snprintf(t.src, sizeof(t.src), "%s@%s:%d", m->src_path, m->src_host, m->src_port);
+    snprintf(t.dst, sizeof(t.dst), "%s@%s:%d", m->dst_path, m->dst_host, m->dst_port);
+    t.bytes = bytes;
+    t.delta = delta;
+    t.jobs_done = __atomic_load_n(&m->jobs_done, __ATOMIC_RELAXED);
+    t.jobs_failed = __atomic_load_n(&m->jobs_failed, __ATOMIC_RELAXED);
+
+    if (w->prom){
+        char src[2 * sizeof(t.src)], dst[2 * sizeof(t.dst)];
+        prom_escape(src, sizeof(src), t.src);
+        prom_escape(dst, sizeof(dst), t.dst);
+        fprintf(w->prom, "nfs_mapping_bytes_total{source=\"%s\",target=\"%s\"} %llu\n",
+                src, dst, (unsigned long long)t.bytes);
+        fprintf(w->prom_jobs, "nfs_mapping_jobs_total{source=\"%s\",target=\"%s\",result=\"ok\"} %llu\n",
+                src, dst, (unsigned long long)t.jobs_done);
+        fprintf(w->prom_jobs, "nfs_mapping_jobs_total{source=\"%s\",target=\"%s\",result=\"failed\"} %llu\n",
+                src, dst, (unsigned long long)t.jobs_failed);
+        return;
+    }
+
+    //Keep the busiest mappings of this interval, sorted by bytes moved
+    int pos = w->top_count;
+    while (pos > 0 && w->top[pos - 1].delta < t.delta){
+        pos--;
+    }
+    if (pos >= METRICS_TOP_MAPPINGS){
+        return;
+    }
+    int last = w->top_count < METRICS_TOP_MAPPINGS ? w->top_count : METRICS_TOP_MAPPINGS - 1;
+    memmove(&w->top[pos + 1], &w->top[pos], (last - pos) * sizeof(MappingTotal));
+    w->top[pos] = t;
+    if (w->top_count < METRICS_TOP_MAPPINGS){
+        w->top_count++;
+    }
+}
+
+static double mb(uint64_t bytes){
+    return bytes / (1024.0 * 1024.0);
+}
+
+static double ms(uint64_t ns){
+    return ns / 1e6;
+}
+
+//Writes a memory stream's contents to the socket and frees it
+//The buffer and length are only final once the stream is closed
+static void send_stream(int fd, FILE *out, char **buf, size_t *len){
+    fclose(out);
+    write_all(fd, *buf, *len);
+    free(*buf);
+}
+
+void metrics_report(int fd){
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (!out){
+        return;
+    }
+
+    pthread_mutex_lock(&report_mutex);
+    long long now = metrics_now();
+    double secs = now > reported_at ? (now - reported_at) / 1e9 : 1e-9;
+    Totals *t = malloc(sizeof(Totals));
+    if (!t){
+        pthread_mutex_unlock(&report_mutex);
+        fclose(out);
+        free(buf);
+        return;
+    }
+    sum_slots(t);
+
+    long waiting, running;
+    queue_stats(&job_queue, &waiting, &running);
+    fprintf(out, "Queue: %ld waiting, %ld running\n", waiting, running);
+    uint64_t jobs = t->jobs_done + t->jobs_failed;
+    fprintf(out, "Rates over the last %.1f s\n", secs);
+    fprintf(out, "Jobs: %llu done, %llu failed, %.1f jobs/s\n", (unsigned long long)t->jobs_done,
+            (unsigned long long)t->jobs_failed, (jobs - reported_jobs) / secs);
+    fprintf(out, "Bytes: %.1f MB, %.2f MB/s\n", mb(t->bytes), mb(t->bytes - reported_bytes) / secs);
+
+    //Busy ratio of every worker since the previous report
+    int count = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+    int shown = 0;
+    for (int i = 0; i < count; ++i){
+        if (slots[i]->worker < 0){
+            continue;
+        }
+        uint64_t busy = busy_at(slots[i], now);
+        if (shown++ == 0){
+            fprintf(out, "Workers busy:");
+        }
+        fprintf(out, " [%ld] %.0f%%", slots[i]->worker, 100.0 * (busy - reported_busy[i]) / (secs * 1e9));
+        reported_busy[i] = busy;
+    }
+    if (shown){
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "Latency (ms)   %10s %10s %10s %10s %10s\n", "count", "p50", "p90", "p99", "max");
+    for (int k = 0; k < LAT_KINDS; ++k){
+        Histogram *h = &t->latency[k];
+        fprintf(out, "  %-12s %10llu %10.3f %10.3f %10.3f %10.3f\n", latency_names[k], (unsigned long long)h->total,
+                ms(hist_quantile(h, 0.5)), ms(hist_quantile(h, 0.9)), ms(hist_quantile(h, 0.99)), ms(h->max_ns));
+    }
+
+    Walk w = {0};
+    w.advance = 1;
+    mapping_foreach(walk_mapping, &w);
+    fprintf(out, "Mappings: %d, busiest:\n", w.mapping_count);
+    for (int i = 0; i < w.top_count; ++i){
+        MappingTotal *m = &w.top[i];
+        fprintf(out, "  %s => %s: %llu jobs, %llu failed, %.1f MB, %.2f MB/s\n", m->src, m->dst,
+                (unsigned long long)m->jobs_done, (unsigned long long)m->jobs_failed, mb(m->bytes), mb(m->delta) / secs);
+    }
+    fprintf(out, "Hosts:\n");
+    for (int i = 0; i < w.host_count; ++i){
+        HostTotal *h = &w.hosts[i];
+        fprintf(out, "  %s: sent %.1f MB (%.2f MB/s), received %.1f MB (%.2f MB/s)\n", h->name,
+                mb(h->sent), mb(h->sent_delta) / secs, mb(h->received), mb(h->received_delta) / secs);
+    }
+    free(w.hosts);
+
+    reported_at = now;
+    reported_jobs = jobs;
+    reported_bytes = t->bytes;
+    pthread_mutex_unlock(&report_mutex);
+    free(t);
+    send_stream(fd, out, &buf, &len);
+}
+
+//Writes one latency histogram as a Prometheus summary in seconds
+static void prom_summary(FILE *out, const char *name, const Histogram *h){
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    fprintf(out, "# TYPE nfs_%s_seconds summary\n", name);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i){
+        fprintf(out, "nfs_%s_seconds{quantile=\"%g\"} %.9f\n", name, quantiles[i], hist_quantile(h, quantiles[i]) / 1e9);
+    }
+    fprintf(out, "nfs_%s_seconds_sum %.9f\n", name, h->sum_ns / 1e9);
+    fprintf(out, "nfs_%s_seconds_count %llu\n", name, (unsigned long long)h->total);
+}
+
+void metrics_prometheus(int fd){
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    Totals *t = malloc(sizeof(Totals));
+    if (!out || !t){
+        if (out){
+            fclose(out);
+            free(buf);
+        }
+        free(t);
+        return;
+    }
+    sum_slots(t);
+
+    long waiting, running;
+    queue_stats(&job_queue, &waiting, &running);
+    fprintf(out, "# TYPE nfs_queue_jobs gauge\n");
+    fprintf(out, "nfs_queue_jobs{state=\"waiting\"} %ld\n", waiting);
+    fprintf(out, "nfs_queue_jobs{state=\"running\"} %ld\n", running);
+    fprintf(out, "# TYPE nfs_jobs_total counter\n");
+    fprintf(out, "nfs_jobs_total{result=\"ok\"} %llu\n", (unsigned long long)t->jobs_done);
+    fprintf(out, "nfs_jobs_total{result=\"failed\"} %llu\n", (unsigned long long)t->jobs_failed);
+    fprintf(out, "# TYPE nfs_bytes_total counter\n");
+    fprintf(out, "nfs_bytes_total %llu\n", (unsigned long long)t->bytes);
+
+    fprintf(out, "# TYPE nfs_worker_busy_seconds_total counter\n");
+    long long now = metrics_now();
+    int count = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i){
+        if (slots[i]->worker >= 0){
+            fprintf(out, "nfs_worker_busy_seconds_total{worker=\"%ld\"} %.6f\n", slots[i]->worker,
+                    busy_at(slots[i], now) / 1e9);
+        }
+    }
+    for (int k = 0; k < LAT_KINDS; ++k){
+        prom_summary(out, latency_names[k], &t->latency[k]);
+    }
+
+    char *jobs_buf = NULL;
+    size_t jobs_len = 0;
+    Walk w = {0};
+    w.prom = out;
+    w.prom_jobs = open_memstream(&jobs_buf, &jobs_len);
+    if (w.prom_jobs){
+        fprintf(out, "# TYPE nfs_mapping_bytes_total counter\n");
+        mapping_foreach(walk_mapping, &w);
+        fclose(w.prom_jobs);
+        fprintf(out, "# TYPE nfs_mapping_jobs_total counter\n");
+        fwrite(jobs_buf, 1, jobs_len, out);
+        free(jobs_buf);
+    }
+    fprintf(out, "# TYPE nfs_host_bytes_total counter\n");
+    for (int i = 0; i < w.host_count; ++i){
+        char host[2 * sizeof(w.hosts[i].name)];
+        prom_escape(host, sizeof(host), w.hosts[i].name);
+        fprintf(out, "nfs_host_bytes_total{host=\"%s\",direction=\"sent\"} %llu\n", host,
+                (unsigned long long)w.hosts[i].sent);
+        fprintf(out, "nfs_host_bytes_total{host=\"%s\",direction=\"received\"} %llu\n", host,
+                (unsigned long long)w.hosts[i].received);
+    }
+    free(w.hosts);
+    free(t);
+    send_stream(fd, out, &buf, &len);
+}
+
+//Answers HTTP requests with the Prometheus format until the process exits
+static void *serve_loop(void *arg){
+    int server = (int)(long)arg;
+    while (1){
+        int client = accept(server, NULL, NULL);
+        if (client < 0){
+            continue;
+        }
+        char req[1024];
+        ssize_t n = read(client, req, sizeof(req) - 1);
+        if (n > 0){
+            req[n] = '\0';
+            if (strncmp(req, "GET /metrics", 12) == 0 || strncmp(req, "GET / ", 6) == 0){
+                const char *hdr = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+                write_all(client, hdr, strlen(hdr));
+                metrics_prometheus(client);
+            } else{
+                const char *hdr = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
+                write_all(client, hdr, strlen(hdr));
+            }
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+int metrics_serve(int port){
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0){
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    pthread_t thread;
+    if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server, 8) != 0 ||
+        pthread_create(&thread, NULL, serve_loop, (void *)(long)server) != 0){
+        close(server);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
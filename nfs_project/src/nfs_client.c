@@ -1,23 +1,47 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include "command_exec.h"
+#include "chunk_index.h"
 
-#define BACKLOG 20  //Maximum number of pending connections in the queue
+#define BACKLOG 128           //Maximum number of pending connections in the queue
+#define DEFAULT_IO_THREADS 8  //I/O threads when -t is not given
+#define DEFAULT_TASK_THREADS 16  //Task threads per exchange step when -T is not given
+#define MAX_EVENTS 64         //Events fetched per epoll_wait call
+
+//A connection waiting for an I/O thread
+typedef struct ReadyConn{
+    Session *session;
+    struct ReadyConn *next;
+} ReadyConn;
+
+//Connections whose socket became ready, handed from the event loop to the I/O threads
+static ReadyConn *ready_head = NULL;
+static ReadyConn *ready_tail = NULL;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+static int epoll_fd = -1;
 
 //Prints usage information and exits the program
 static void print_usage(const char *progname){
-    fprintf(stderr, "Usage: %s -p <port>\n", progname);
+    fprintf(stderr, "Usage: %s -p <port> [-t <io_threads>] [-T <task_threads>] [-d <chunk_index_dir>]\n", progname);
     exit(EXIT_FAILURE);
 }
 
 //Initialize TCP server socket
 static int create_server_socket(int port){
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server_fd < 0){
         perror("socket");
         exit(EXIT_FAILURE);
@@ -49,48 +73,204 @@ static int create_server_socket(int port){
     return server_fd;
 }
 
-//Processes a single client connection
-static void handle_client(int client_fd){
-    char input_buf[BUF_SIZE];
-    Command cmd = {0};
-
-    //Read a full line from the client
-    if (socket_read_line(client_fd, input_buf, sizeof(input_buf)) > 0){
-        printf("Client command: %s\n", input_buf);
-        if (parse_command(input_buf, &cmd)){
-            run_command(client_fd, &cmd);
-        } else{
-            write(client_fd, "ERROR: Invalid command\n", 24);
-        }
+//Queues a ready connection for the I/O threads
+static void ready_push(Session *session){
+    ReadyConn *item = malloc(sizeof(ReadyConn));
+    if (!item){
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
+    item->session = session;
+    item->next = NULL;
 
-    close(client_fd);
+    pthread_mutex_lock(&ready_mutex);
+    if (ready_tail){
+        ready_tail->next = item;
+    } else{
+        ready_head = item;
+    }
+    ready_tail = item;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_mutex);
 }
 
-
-int main(int argc, char *argv[]){
-    if (argc != 3 || strcmp(argv[1], "-p") != 0){
-        print_usage(argv[0]);
+//Waits for the next ready connection
+static Session *ready_pop(void){
+    pthread_mutex_lock(&ready_mutex);
+    while (!ready_head){
+        pthread_cond_wait(&ready_cond, &ready_mutex);
+    }
+    ReadyConn *item = ready_head;
+    ready_head = item->next;
+    if (!ready_head){
+        ready_tail = NULL;
     }
+    pthread_mutex_unlock(&ready_mutex);
 
-    int port = atoi(argv[2]);
-    int server_fd = create_server_socket(port);
+    Session *session = item->session;
+    free(item);
+    return session;
+}
+
+//Tears down a finished connection
+static void release_session(Session *session){
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->conn->fd, NULL);
+    session_cleanup(session);
+    conn_close(session->conn);
+    free(session);
+}
 
-    printf("nfs_client running on port %d\n", port);
+//I/O thread: serves ready connections until they would block, then re-arms them in epoll
+//EPOLLONESHOT guarantees a connection is only ever handled by one thread at a time
+static void *io_thread(void *arg){
+    (void)arg;
+    while (1){
+        Session *session = ready_pop();
+        int state = session_serve(session);
+        if (state == SERVE_CLOSE){
+            release_session(session);
+            continue;
+        }
+        if (state == SERVE_PARK){
+            session_unpark(session);
+            continue;
+        }
 
-    //Accept and handle incoming client connections
+        struct epoll_event ev = {0};
+        ev.events = (state == SERVE_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+        ev.data.ptr = session;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->conn->fd, &ev) < 0){
+            release_session(session);
+        }
+    }
+    return NULL;
+}
+
+//Accepts every pending connection and registers it with epoll
+static void accept_clients(int server_fd){
     while (1){
         struct sockaddr_in client_addr;
         socklen_t len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &len);
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &len, SOCK_NONBLOCK);
         if (client_fd < 0){
-            perror("accept");
+            if (errno != EAGAIN && errno != EINTR){
+                perror("accept");
+            }
+            return;
+        }
+
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Conn *conn = conn_open(client_fd);
+        Session *session = conn ? malloc(sizeof(Session)) : NULL;
+        if (!session){
+            if (conn){
+                conn_close(conn);
+            } else{
+                close(client_fd);
+            }
             continue;
         }
+        session_init(session, conn);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = session;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0){
+            perror("epoll_ctl");
+            session_cleanup(session);
+            conn_close(conn);
+            free(session);
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+    int port = 0;
+    int io_threads = DEFAULT_IO_THREADS;
+    int task_threads = DEFAULT_TASK_THREADS;
+    const char *index_dir = NULL;
+    if (argc < 3 || argc > 9 || argc % 2 == 0){
+        print_usage(argv[0]);
+    }
+    for (int i = 1; i < argc; i += 2){
+        if (strcmp(argv[i], "-p") == 0){
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0){
+            io_threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-T") == 0){
+            task_threads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-d") == 0){
+            index_dir = argv[i + 1];
+        } else{
+            print_usage(argv[0]);
+        }
+    }
+    if (port <= 0 || io_threads <= 0 || task_threads <= 0){
+        print_usage(argv[0]);
+    }
+
+    //With a chunk index the client accepts DEDUP and reuses chunks it already holds
+    if (index_dir && chunk_index_open(index_dir) != 0){
+        perror("chunk_index_open");
+        exit(EXIT_FAILURE);
+    }
+
+    session_set_resume_hook(ready_push);
+    if (session_tasks_start(task_threads) != 0){
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    //A peer that disconnects mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    int server_fd = create_server_socket(port);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0){
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    //The listening socket is identified by a NULL data pointer
+    struct epoll_event lev = {0};
+    lev.events = EPOLLIN;
+    lev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &lev) < 0){
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < io_threads; ++i){
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, io_thread, NULL) != 0){
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
 
-        handle_client(client_fd);
+    printf("nfs_client running on port %d with %d I/O threads\n", port, io_threads);
+
+    //Event loop: accept new clients and hand ready connections to the I/O threads
+    struct epoll_event events[MAX_EVENTS];
+    while (1){
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i){
+            if (!events[i].data.ptr){
+                accept_clients(server_fd);
+            } else{
+                ready_push(events[i].data.ptr);
+            }
+        }
     }
 
     close(server_fd);
+    close(epoll_fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -113,6 +113,13 @@ void handle_session(int sockfd, FILE *log_file){
         }
         response[received] = '\0';
         printf("%s", response);
+        //The stats report can span several writes, the manager closes the connection after it
+        if (strncmp(command, "stats", 5) == 0){
+            while ((received = read(sockfd, response, sizeof(response) - 1)) > 0){
+                response[received] = '\0';
+                printf("%s", response);
+            }
+        }
 
         if (strncmp(command, "shutdown", 8) == 0){
             break;
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <endian.h>
+#include "logger.h"
+
+//Decodes a binary manager log (nfs_manager -o binary) into the text log format
+//Usage: nfs_logdump <logfile>
+
+static const char *op_names[LOG_OPS] = LOG_OP_NAMES;
+
+//Source and target spec of a mapping id, as last announced
+typedef struct{
+    char *src;
+    char *dst;
+} MappingSpec;
+
+static MappingSpec *specs = NULL;
+static size_t spec_cap = 0;
+
+static int read_u8(FILE *f, uint8_t *v){
+    return fread(v, 1, 1, f) == 1 ? 0 : -1;
+}
+
+static int read_u16(FILE *f, uint16_t *v){
+    if (fread(v, sizeof(*v), 1, f) != 1){
+        return -1;
+    }
+    *v = le16toh(*v);
+    return 0;
+}
+
+static int read_u32(FILE *f, uint32_t *v){
+    if (fread(v, sizeof(*v), 1, f) != 1){
+        return -1;
+    }
+    *v = le32toh(*v);
+    return 0;
+}
+
+static int read_u64(FILE *f, uint64_t *v){
+    if (fread(v, sizeof(*v), 1, f) != 1){
+        return -1;
+    }
+    *v = le64toh(*v);
+    return 0;
+}
+
+//Reads a u16-prefixed string into a new buffer, returns NULL on a truncated file
+static char *read_str(FILE *f){
+    uint16_t len;
+    if (read_u16(f, &len) != 0){
+        return NULL;
+    }
+    char *s = malloc(len + 1);
+    if (!s || (len > 0 && fread(s, 1, len, f) != len)){
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+static int read_mapping(FILE *f){
+    uint32_t id;
+    if (read_u32(f, &id) != 0){
+        return -1;
+    }
+    char *src = read_str(f);
+    char *dst = src ? read_str(f) : NULL;
+    if (!dst){
+        free(src);
+        return -1;
+    }
+    if (id >= spec_cap){
+        size_t cap = spec_cap ? spec_cap : 1024;
+        while (cap <= id){
+            cap *= 2;
+        }
+        MappingSpec *grown = realloc(specs, cap * sizeof(MappingSpec));
+        if (!grown){
+            free(src);
+            free(dst);
+            return -1;
+        }
+        memset(grown + spec_cap, 0, (cap - spec_cap) * sizeof(MappingSpec));
+        specs = grown;
+        spec_cap = cap;
+    }
+    free(specs[id].src);
+    free(specs[id].dst);
+    specs[id].src = src;
+    specs[id].dst = dst;
+    return 0;
+}
+
+//Prints one side of an event as "path/name@host:port", the spec is "path@host:port"
+static void print_side(const char *spec, const char *name){
+    const char *at = spec ? strrchr(spec, '@') : NULL;
+    if (!at){
+        printf("[?/%s]", name);
+        return;
+    }
+    printf("[%.*s/%s%s]", (int)(at - spec), spec, name, at);
+}
+
+static int read_event(FILE *f){
+    uint64_t time_ns;
+    uint32_t id, tid, batch_count;
+    uint8_t op, result;
+    if (read_u64(f, &time_ns) != 0 || read_u32(f, &id) != 0 || read_u32(f, &tid) != 0 ||
+        read_u8(f, &op) != 0 || read_u8(f, &result) != 0 || read_u32(f, &batch_count) != 0){
+        return -1;
+    }
+    char *name = read_str(f);
+    char *msg = name ? read_str(f) : NULL;
+    if (!msg){
+        free(name);
+        return -1;
+    }
+
+    char batch[32];
+    const char *shown = name;
+    if (!name[0]){
+        snprintf(batch, sizeof(batch), "{%u files}", batch_count);
+        shown = batch;
+    }
+    time_t sec = (time_t)(time_ns / 1000000000);
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+    const MappingSpec *spec = id < spec_cap ? &specs[id] : NULL;
+    printf("[%s] ", stamp);
+    print_side(spec ? spec->src : NULL, shown);
+    printf(" ");
+    print_side(spec ? spec->dst : NULL, shown);
+    printf(" [%u] [%s] [%s] [%s]\n", tid, op < LOG_OPS ? op_names[op] : "?",
+           result == LOG_OK ? "OK" : "FAIL", msg);
+    free(name);
+    free(msg);
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    if (argc != 2){
+        fprintf(stderr, "Usage: %s <logfile>\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f){
+        perror("Error opening log file");
+        return 1;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0){
+        fprintf(stderr, "%s: not a binary manager log\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    int rc = 0;
+    uint8_t type;
+    while (read_u8(f, &type) == 0){
+        int r = type == LOG_REC_MAPPING ? read_mapping(f) : type == LOG_REC_EVENT ? read_event(f) : -1;
+        if (r != 0){
+            fprintf(stderr, "%s: truncated or corrupt record\n", argv[1]);
+            rc = 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < spec_cap; ++i){
+        free(specs[i].src);
+        free(specs[i].dst);
+    }
+    free(specs);
+    fclose(f);
+    return rc;
+}
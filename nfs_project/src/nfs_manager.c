@@ -3,17 +3,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
 
 #include "manager_core.h"
 #include "worker_jobs.h"
 #include "utils.h"
+#include "conn_pool.h"
+#include "logger.h"
+#include "metrics.h"
 
 //Global job queue
 Queue job_queue;
 
-//Global log file pointer
-FILE *log_file = NULL;
-
 //Structure to map command-line flags to config fields
 typedef struct{
     const char *flag;
@@ -28,6 +29,18 @@ typedef struct{
     int worker_limit;
     int port;
     int buffer_size;
+    char *transfer_mode;  //"relay" (default) or "direct"
+    int stripe_mb;        //Stripe size in MB, 0 disables striping
+    int batch_files;      //Most small files per batch, 1 disables batching
+    int batch_kb;         //Most bytes per batch in KB
+    int discovery;        //Threads scanning mappings
+    char *policy;         //Job queue order: "sjf" (default) or "fifo"
+    int aging_ms;         //Longest wait of a non-empty queue lane before it is served, 0 disables aging
+    char *log_format;     //"text" (default) or "binary" (read with nfs_logdump)
+    int metrics_port;     //Port of the Prometheus endpoint, 0 disables it
+    int watch_ms;         //Quiet time before watched changes are queued, 0 disables change streams
+    char *resync;         //Default interval of periodic rescans ("0" for none), see mapping_interval()
+    int verify;           //Copies of a file made before a digest mismatch fails it, 0 disables verification
 } Config;
 
 //Print parsed configuration values
@@ -38,13 +51,44 @@ static void print_banner(const Config *cfg){
     printf("  Worker count : %d\n", cfg->worker_limit);
     printf("  Port         : %d\n", cfg->port);
     printf("  Buffer size  : %d\n", cfg->buffer_size);
+    printf("  Transfer mode: %s\n", cfg->transfer_mode);
+    printf("  Stripe size  : %d MB\n", cfg->stripe_mb);
+    printf("  Batch limits : %d files / %d KB\n", cfg->batch_files, cfg->batch_kb);
+    printf("  Discovery    : %d threads\n", cfg->discovery);
+    printf("  Queue policy : %s, aging %d ms\n", cfg->policy, cfg->aging_ms);
+    printf("  Log format   : %s\n", cfg->log_format);
+    if (cfg->metrics_port > 0){
+        printf("  Metrics port : %d\n", cfg->metrics_port);
+    }
+    if (cfg->verify > 0){
+        printf("  Verify       : on, %d retries\n", cfg->verify);
+    } else{
+        printf("  Verify       : off\n");
+    }
+    printf("  Resync       : %s\n", strcmp(cfg->resync, "0") == 0 ? "off" : cfg->resync);
+    if (cfg->watch_ms > 0){
+        printf("  Watch        : %d ms debounce\n", cfg->watch_ms);
+    } else{
+        printf("  Watch        : off\n");
+    }
 }
 
 //Parse CLI arguments and populate the config struct
 static Config parse_args(int argc, char *argv[]){
-    if (argc != 11) show_usage(argv[0]);
+    //Five required flag/value pairs, optional ones may follow
+    if (argc < 11 || argc % 2 == 0) show_usage(argv[0]);
 
     Config cfg = {0};
+    cfg.transfer_mode = "relay";
+    cfg.stripe_mb = 64;
+    cfg.batch_files = 256;
+    cfg.batch_kb = 4096;
+    cfg.discovery = 4;
+    cfg.policy = "sjf";
+    cfg.aging_ms = 2000;
+    cfg.log_format = "text";
+    cfg.watch_ms = 100;
+    cfg.resync = "0";
 
     ArgMap args[] = {
         {"-l", &cfg.logfile,      0},
@@ -52,6 +96,18 @@ static Config parse_args(int argc, char *argv[]){
         {"-n", &cfg.worker_limit, 1},
         {"-p", &cfg.port,         1},
         {"-b", &cfg.buffer_size,  1},
+        {"-m", &cfg.transfer_mode, 0},
+        {"-s", &cfg.stripe_mb,    1},
+        {"-f", &cfg.batch_files,  1},
+        {"-z", &cfg.batch_kb,     1},
+        {"-d", &cfg.discovery,    1},
+        {"-q", &cfg.policy,       0},
+        {"-a", &cfg.aging_ms,     1},
+        {"-o", &cfg.log_format,   0},
+        {"-x", &cfg.metrics_port, 1},
+        {"-w", &cfg.watch_ms,     1},
+        {"-i", &cfg.resync,       0},
+        {"-v", &cfg.verify,       1},
     };
 
     int arg_count = sizeof(args) / sizeof(args[0]);
@@ -82,10 +138,28 @@ static Config parse_args(int argc, char *argv[]){
     }
 
     //Check for required and valid arguments
-    if (!cfg.logfile || !cfg.config_file || cfg.worker_limit <= 0 || cfg.port <= 0 || cfg.buffer_size <= 0){
+    if (!cfg.logfile || !cfg.config_file || cfg.worker_limit <= 0 || cfg.port <= 0 || cfg.buffer_size <= 0 || cfg.stripe_mb < 0 ||
+        cfg.batch_files <= 0 || cfg.batch_kb <= 0 || cfg.discovery <= 0 || cfg.aging_ms < 0 ||
+        cfg.metrics_port < 0 || cfg.watch_ms < 0 || cfg.verify < 0){
         fprintf(stderr, "Missing or invalid arguments.\n");
         show_usage(argv[0]);
     }
+    if (strcmp(cfg.transfer_mode, "relay") != 0 && strcmp(cfg.transfer_mode, "direct") != 0){
+        fprintf(stderr, "Unknown transfer mode: %s\n", cfg.transfer_mode);
+        show_usage(argv[0]);
+    }
+    if (strcmp(cfg.policy, "sjf") != 0 && strcmp(cfg.policy, "fifo") != 0){
+        fprintf(stderr, "Unknown queue policy: %s\n", cfg.policy);
+        show_usage(argv[0]);
+    }
+    if (mapping_interval(cfg.resync) < 0){
+        fprintf(stderr, "Invalid resync interval: %s\n", cfg.resync);
+        show_usage(argv[0]);
+    }
+    if (strcmp(cfg.log_format, "text") != 0 && strcmp(cfg.log_format, "binary") != 0){
+        fprintf(stderr, "Unknown log format: %s\n", cfg.log_format);
+        show_usage(argv[0]);
+    }
 
     return cfg;
 }
@@ -93,17 +167,35 @@ static Config parse_args(int argc, char *argv[]){
 int main(int argc, char *argv[]){
     //Parse arguments into config
     Config cfg = parse_args(argc, argv);
+    //Broken client connections are reported through write errors instead
+    signal(SIGPIPE, SIG_IGN);
 
-    log_file = fopen(cfg.logfile, "w");
-    if (!log_file){
+    if (logger_start(cfg.logfile, strcmp(cfg.log_format, "binary") == 0 ? LOG_BINARY : LOG_TEXT) != 0){
         perror("Error opening log file");
         exit(EXIT_FAILURE);
     }
 
     print_banner(&cfg);
+    direct_transfer = strcmp(cfg.transfer_mode, "direct") == 0;
+    stripe_size = (long)cfg.stripe_mb << 20;
+    batch_files = cfg.batch_files;
+    verify_retries = cfg.verify;
+    batch_bytes = (long)cfg.batch_kb << 10;
+
+    queue_init(&job_queue, cfg.buffer_size, cfg.worker_limit,
+               strcmp(cfg.policy, "fifo") == 0 ? QUEUE_FIFO : QUEUE_SJF, cfg.aging_ms);
+
+    metrics_init();
+    if (cfg.metrics_port > 0 && metrics_serve(cfg.metrics_port) != 0){
+        perror("Error starting metrics endpoint");
+        exit(EXIT_FAILURE);
+    }
 
-    queue_init(&job_queue, cfg.buffer_size);
-
+    discovery_start(cfg.discovery);
+    resync_start(mapping_interval(cfg.resync));
+    if (cfg.watch_ms > 0){
+        watch_start(cfg.watch_ms);
+    }
     load_sync_config(cfg.config_file);
 
     pthread_t console_thread;
@@ -114,12 +206,16 @@ int main(int argc, char *argv[]){
         pthread_create(&workers[i], NULL, sync_worker_loop, (void *)i);
     }
     pthread_join(console_thread, NULL);
+    discovery_stop();
+    watch_stop();
+    resync_stop();
 
     for (int i = 0; i < cfg.worker_limit; ++i){
         pthread_join(workers[i], NULL);
     }
 
+    pool_destroy();
     queue_destroy(&job_queue);
-    fclose(log_file);
+    logger_stop();
     return 0;
 }
@@ -0,0 +1,395 @@
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+int wait_ready(int fd, short events){
+    struct pollfd p = { fd, events, 0 };
+    int r;
+    do{
+        r = poll(&p, 1, -1);
+    } while (r < 0 && errno == EINTR);
+    return r > 0 ? 0 : -1;
+}
+
+Conn *conn_open(int fd){
+    Conn *conn = malloc(sizeof(Conn));
+    if (!conn){
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->caps = 0;
+    conn->start = 0;
+    conn->end = 0;
+    return conn;
+}
+
+void conn_close(Conn *conn){
+    if (!conn){
+        return;
+    }
+    close(conn->fd);
+    free(conn);
+}
+
+//Refills the buffer with one read from the socket, returns bytes read (0 on EOF, -1 on error)
+static ssize_t conn_fill(Conn *conn){
+    if (conn->start == conn->end){
+        conn->start = 0;
+        conn->end = 0;
+    }
+    ssize_t r;
+    while (1){
+        r = read(conn->fd, conn->buf + conn->end, sizeof(conn->buf) - conn->end);
+        if (r >= 0 || (errno != EINTR && errno != EAGAIN)){
+            break;
+        }
+        if (errno == EAGAIN && wait_ready(conn->fd, POLLIN) != 0){
+            break;
+        }
+    }
+    if (r > 0){
+        conn->end += r;
+    }
+    return r;
+}
+
+int conn_peek(Conn *conn){
+    if (conn->start == conn->end && conn_fill(conn) <= 0){
+        return -1;
+    }
+    return (unsigned char)conn->buf[conn->start];
+}
+
+int conn_getc(Conn *conn){
+    int c = conn_peek(conn);
+    if (c >= 0){
+        conn->start++;
+    }
+    return c;
+}
+
+int conn_read_until(Conn *conn, char *buf, size_t max_len, char delim){
+    size_t i = 0;
+    while (i < max_len - 1){
+        if (conn->start == conn->end && conn_fill(conn) <= 0){
+            if (i == 0){
+                return -1;
+            }
+            break;
+        }
+        char c = conn->buf[conn->start++];
+        buf[i++] = c;
+        if (c == delim){
+            break;
+        }
+    }
+    buf[i] = '\0';
+    return (int)i;
+}
+
+ssize_t conn_read_some(Conn *conn, void *buf, size_t len){
+    size_t avail = conn->end - conn->start;
+    if (avail > 0){
+        size_t n = avail < len ? avail : len;
+        memcpy(buf, conn->buf + conn->start, n);
+        conn->start += n;
+        return n;
+    }
+
+    //Nothing buffered: large reads go straight into the caller's buffer
+    ssize_t r;
+    while (1){
+        r = read(conn->fd, buf, len);
+        if (r >= 0 || (errno != EINTR && errno != EAGAIN)){
+            break;
+        }
+        if (errno == EAGAIN && wait_ready(conn->fd, POLLIN) != 0){
+            break;
+        }
+    }
+    return r;
+}
+
+ssize_t conn_try_read(Conn *conn, void *buf, size_t len){
+    size_t avail = conn->end - conn->start;
+    if (avail > 0){
+        size_t n = avail < len ? avail : len;
+        memcpy(buf, conn->buf + conn->start, n);
+        conn->start += n;
+        return n;
+    }
+
+    ssize_t r;
+    do{
+        r = read(conn->fd, buf, len);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0 && errno == EAGAIN){
+        return 0;
+    }
+    return r > 0 ? r : -1;
+}
+
+int conn_has_input(Conn *conn){
+    if (conn->start != conn->end){
+        return 1;
+    }
+    conn->start = 0;
+    conn->end = 0;
+    ssize_t r;
+    do{
+        r = read(conn->fd, conn->buf, sizeof(conn->buf));
+    } while (r < 0 && errno == EINTR);
+    if (r < 0 && errno == EAGAIN){
+        return 0;
+    }
+    if (r <= 0){
+        return -1;
+    }
+    conn->end = r;
+    return 1;
+}
+
+int conn_read_exact(Conn *conn, void *buf, size_t len){
+    char *p = buf;
+    while (len > 0){
+        ssize_t r = conn_read_some(conn, p, len);
+        if (r <= 0){
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+int conn_read_frame(Conn *conn, FrameHeader *hdr){
+    unsigned char raw[FRAME_HDR_SIZE];
+    if (conn_read_exact(conn, raw, sizeof(raw)) != 0){
+        return -1;
+    }
+    return frame_decode(raw, hdr);
+}
+
+int frame_decode(const unsigned char raw[FRAME_HDR_SIZE], FrameHeader *hdr){
+    if (raw[0] != FRAME_MAGIC || raw[1] != FRAME_VERSION){
+        return -1;
+    }
+
+    uint32_t sid;
+    uint64_t len;
+    memcpy(&sid, raw + 4, sizeof(sid));
+    memcpy(&len, raw + 8, sizeof(len));
+
+    hdr->version = raw[1];
+    hdr->opcode = raw[2];
+    hdr->flags = raw[3];
+    hdr->stream_id = be32toh(sid);
+    hdr->length = be64toh(len);
+    return 0;
+}
+
+void frame_encode(unsigned char out[FRAME_HDR_SIZE], int opcode, int flags, uint32_t stream_id, uint64_t length){
+    uint32_t sid = htobe32(stream_id);
+    uint64_t len = htobe64(length);
+    out[0] = FRAME_MAGIC;
+    out[1] = FRAME_VERSION;
+    out[2] = (unsigned char)opcode;
+    out[3] = (unsigned char)flags;
+    memcpy(out + 4, &sid, sizeof(sid));
+    memcpy(out + 8, &len, sizeof(len));
+}
+
+int frame_send(int fd, int opcode, int flags, uint32_t stream_id, const void *payload, size_t len){
+    unsigned char hdr[FRAME_HDR_SIZE];
+    frame_encode(hdr, opcode, flags, stream_id, len);
+
+    struct iovec iov[2] = {
+        { hdr, sizeof(hdr) },
+        { (void *)payload, len }
+    };
+    int cnt = len > 0 ? 2 : 1;
+    size_t total = sizeof(hdr) + len;
+
+    ssize_t w;
+    do{
+        w = writev(fd, iov, cnt);
+    } while (w < 0 && errno == EINTR);
+    if (w < 0 && errno == EAGAIN){
+        w = 0;
+    }
+    if (w < 0){
+        return -1;
+    }
+    if ((size_t)w == total){
+        return 0;
+    }
+
+    //Short write: finish the remainder piece by piece
+    if ((size_t)w < sizeof(hdr)){
+        if (write_all(fd, hdr + w, sizeof(hdr) - w) != 0){
+            return -1;
+        }
+        return write_all(fd, payload, len);
+    }
+    size_t done = w - sizeof(hdr);
+    return write_all(fd, (const char *)payload + done, len - done);
+}
+
+int write_all(int fd, const void *buf, size_t len){
+    const char *p = buf;
+    while (len > 0){
+        ssize_t w = write(fd, p, len);
+        if (w < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN && wait_ready(fd, POLLOUT) == 0){
+                continue;
+            }
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int connect_to(const char *ip, int port){
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0){
+        return -1;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0){
+        close(s);
+        return -1;
+    }
+
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        close(s);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+//Source of per-request stream ids
+static uint32_t stream_id_counter = 0;
+
+uint32_t next_stream_id(void){
+    return __atomic_add_fetch(&stream_id_counter, 1, __ATOMIC_RELAXED);
+}
+
+void stream_in_init(StreamIn *in, Conn *conn, uint32_t stream_id){
+    in->conn = conn;
+    in->stream_id = stream_id;
+    in->frame_left = 0;
+    in->last = 0;
+}
+
+//Moves on to the next DATA frame once the current one is used up
+//Returns 0 when payload is available, 1 at the end of the stream and -1 on error
+static int stream_next(StreamIn *in){
+    while (in->frame_left == 0){
+        if (in->last){
+            return 1;
+        }
+        FrameHeader hdr;
+        if (conn_read_frame(in->conn, &hdr) != 0 || hdr.opcode != OP_DATA || hdr.stream_id != in->stream_id){
+            return -1;
+        }
+        in->frame_left = hdr.length;
+        in->last = hdr.flags & FRAME_FIN;
+    }
+    return 0;
+}
+
+int stream_read(StreamIn *in, void *buf, size_t len){
+    char *p = buf;
+    size_t got = 0;
+    while (got < len){
+        int r = stream_next(in);
+        if (r != 0){
+            return r > 0 && got == 0 ? 1 : -1;
+        }
+        size_t n = len - got < in->frame_left ? len - got : in->frame_left;
+        if (conn_read_exact(in->conn, p + got, n) != 0){
+            return -1;
+        }
+        got += n;
+        in->frame_left -= n;
+    }
+    return 0;
+}
+
+ssize_t stream_read_some(StreamIn *in, void *buf, size_t len){
+    int r = stream_next(in);
+    if (r != 0){
+        return r > 0 ? 0 : -1;
+    }
+    size_t n = len < in->frame_left ? len : in->frame_left;
+    ssize_t got = conn_read_some(in->conn, buf, n);
+    if (got <= 0){
+        return -1;
+    }
+    in->frame_left -= got;
+    return got;
+}
+
+int stream_skip(StreamIn *in){
+    char temp[4096];
+    ssize_t r;
+    while ((r = stream_read_some(in, temp, sizeof(temp))) > 0){
+    }
+    return r == 0 ? 0 : -1;
+}
+
+StreamOut *stream_out_open(int sock, uint32_t stream_id){
+    StreamOut *out = malloc(sizeof(StreamOut));
+    if (out){
+        out->sock = sock;
+        out->stream_id = stream_id;
+        out->len = 0;
+    }
+    return out;
+}
+
+int stream_flush(StreamOut *out, int fin){
+    if (out->len == 0 && !fin){
+        return 0;
+    }
+    int r = frame_send(out->sock, OP_DATA, fin ? FRAME_FIN : 0, out->stream_id, out->buf, out->len);
+    out->len = 0;
+    return r;
+}
+
+int stream_write(StreamOut *out, const void *data, size_t len){
+    const unsigned char *p = data;
+    while (len > 0){
+        if (out->len == sizeof(out->buf) && stream_flush(out, 0) != 0){
+            return -1;
+        }
+        size_t n = sizeof(out->buf) - out->len;
+        if (n > len){
+            n = len;
+        }
+        memcpy(out->buf + out->len, p, n);
+        out->len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
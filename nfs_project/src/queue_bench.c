@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "utils.h"
+#include "ring.h"
+
+//Microbenchmark: enqueue/dequeue throughput of the job queues with 1..64 producer and consumer threads
+//  mutex: the previous bounded buffer, one mutex and two condvars
+//  ring : a bare lock-free ring, consumers yield while it is empty
+//  queue: the manager's Queue (sharded rings with futex parking)
+//Usage: queue_bench [jobs_per_run] [capacity]
+
+//The bounded buffer the manager used before the lock-free ring
+typedef struct{
+    Job *items;
+    int capacity;
+    int size;
+    int head;
+    int tail;
+    int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} LockedQueue;
+
+static void locked_init(LockedQueue *q, int capacity){
+    q->items = malloc(sizeof(Job) * capacity);
+    q->capacity = capacity;
+    q->size = q->head = q->tail = q->closed = 0;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void locked_push(LockedQueue *q, const Job *job){
+    pthread_mutex_lock(&q->mutex);
+    while (q->size == q->capacity){
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+    memcpy(&q->items[q->tail], job, sizeof(Job));
+    q->tail = (q->tail + 1) % q->capacity;
+    q->size++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static int locked_pop(LockedQueue *q, Job *job){
+    pthread_mutex_lock(&q->mutex);
+    while (q->size == 0 && !q->closed){
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+    if (q->size == 0){
+        pthread_mutex_unlock(&q->mutex);
+        return -1;
+    }
+    memcpy(job, &q->items[q->head], sizeof(Job));
+    q->head = (q->head + 1) % q->capacity;
+    q->size--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+static void locked_close(LockedQueue *q){
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void locked_destroy(LockedQueue *q){
+    free(q->items);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+enum{ KIND_MUTEX, KIND_RING, KIND_QUEUE };
+
+//Shared state of one run
+typedef struct{
+    int kind;
+    LockedQueue locked;
+    Ring ring;
+    Queue queue;
+    long per_producer;
+    long total;
+    long consumed;  //Jobs popped so far (ring runs stop on it)
+} Bench;
+
+typedef struct{
+    Bench *bench;
+    int id;
+} BenchThread;
+
+static void *producer(void *arg){
+    BenchThread *t = arg;
+    Bench *b = t->bench;
+    Job job;
+    memset(&job, 0, sizeof(job));
+    //Each producer stands for one mapping, so in the sharded queue it fills its own shard
+    job.dest = t->id;
+
+    for (long i = 0; i < b->per_producer; ++i){
+        job.offset = i;
+        if (b->kind == KIND_MUTEX){
+            locked_push(&b->locked, &job);
+        } else if (b->kind == KIND_QUEUE){
+            queue_push(&b->queue, &job);
+        } else{
+            while (ring_try_push(&b->ring, &job) != 0){
+                sched_yield();
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg){
+    BenchThread *t = arg;
+    Bench *b = t->bench;
+    Job job;
+    while (1){
+        if (b->kind == KIND_MUTEX){
+            if (locked_pop(&b->locked, &job) != 0){
+                break;
+            }
+        } else if (b->kind == KIND_QUEUE){
+            int shard = queue_pop(&b->queue, t->id, &job);
+            if (shard < 0){
+                break;
+            }
+            queue_done(&b->queue, shard);
+        } else{
+            if (__atomic_load_n(&b->consumed, __ATOMIC_RELAXED) >= b->total){
+                break;
+            }
+            if (ring_try_pop(&b->ring, &job) != 0){
+                sched_yield();
+                continue;
+            }
+        }
+        __atomic_add_fetch(&b->consumed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Runs one configuration and returns millions of jobs moved per second
+static double run(int kind, int threads, long jobs, int capacity){
+    //Queue and Ring keep their hot counters on separate cache lines
+    Bench *b = aligned_alloc(64, (sizeof(Bench) + 63) & ~(size_t)63);
+    memset(b, 0, sizeof(Bench));
+    b->kind = kind;
+    b->per_producer = jobs / threads;
+    b->total = b->per_producer * threads;
+    if (kind == KIND_MUTEX){
+        locked_init(&b->locked, capacity);
+    } else if (kind == KIND_QUEUE){
+        queue_init(&b->queue, capacity, threads, QUEUE_FIFO, 0);
+    } else{
+        ring_init(&b->ring, capacity, sizeof(Job));
+    }
+
+    pthread_t prod[threads], cons[threads];
+    BenchThread args[2 * threads];
+    double start = now_sec();
+    for (int i = 0; i < threads; ++i){
+        args[i] = (BenchThread){ b, i };
+        args[threads + i] = (BenchThread){ b, i };
+        pthread_create(&cons[i], NULL, consumer, &args[threads + i]);
+        pthread_create(&prod[i], NULL, producer, &args[i]);
+    }
+    for (int i = 0; i < threads; ++i){
+        pthread_join(prod[i], NULL);
+    }
+    if (kind == KIND_MUTEX){
+        locked_close(&b->locked);
+    } else if (kind == KIND_QUEUE){
+        queue_close(&b->queue);
+    }
+    for (int i = 0; i < threads; ++i){
+        pthread_join(cons[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    if (b->consumed != b->total){
+        fprintf(stderr, "lost jobs: %ld of %ld\n", b->total - b->consumed, b->total);
+    }
+    if (kind == KIND_MUTEX){
+        locked_destroy(&b->locked);
+    } else if (kind == KIND_QUEUE){
+        queue_destroy(&b->queue);
+    } else{
+        ring_destroy(&b->ring);
+    }
+    double rate = b->total / elapsed / 1e6;
+    free(b);
+    return rate;
+}
+
+int main(int argc, char *argv[]){
+    long jobs = argc > 1 ? atol(argv[1]) : 200000;
+    int capacity = argc > 2 ? atoi(argv[2]) : 64;
+    if (jobs <= 0 || capacity <= 0){
+        fprintf(stderr, "Usage: %s [jobs_per_run] [capacity]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%ld jobs per run, capacity %d, %zu-byte jobs, Mjobs/s\n", jobs, capacity, sizeof(Job));
+    printf("%-22s %10s %10s %10s\n", "producers/consumers", "mutex", "ring", "queue");
+    for (int threads = 1; threads <= 64; threads *= 2){
+        double m = run(KIND_MUTEX, threads, jobs, capacity);
+        double r = run(KIND_RING, threads, jobs, capacity);
+        double q = run(KIND_QUEUE, threads, jobs, capacity);
+        printf("%-22d %10.3f %10.3f %10.3f\n", threads, m, r, q);
+    }
+    return 0;
+}
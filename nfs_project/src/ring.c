@@ -0,0 +1,112 @@
+#include "ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+//Sequence number stored at the start of every cell
+static size_t *cell_seq(Ring *ring, size_t pos){
+    return (size_t *)(ring->cells + (pos % ring->capacity) * ring->cell_size);
+}
+
+int ring_init(Ring *ring, size_t capacity, size_t elem_size){
+    memset(ring, 0, sizeof(Ring));
+    //With a single cell a full ring would look empty to the next producer
+    if (capacity < 2){
+        capacity = 2;
+    }
+    ring->elem_size = elem_size;
+    ring->capacity = capacity;
+    ring->cell_size = (sizeof(size_t) + elem_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    ring->cells = malloc(capacity * ring->cell_size);
+    if (!ring->cells){
+        return -1;
+    }
+    //Cell i first expects the producer of position i
+    for (size_t i = 0; i < capacity; ++i){
+        *cell_seq(ring, i) = i;
+    }
+    return 0;
+}
+
+int ring_try_push(Ring *ring, const void *elem){
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (1){
+        size_t *seq = cell_seq(ring, pos);
+        size_t s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(s - pos);
+        if (diff == 0){
+            //The cell is free for this position: claim the position, then fill the cell
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                memcpy(seq + 1, elem, ring->elem_size);
+                __atomic_store_n(seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0){
+            //The cell still holds the element from one lap ago
+            return -1;
+        } else{
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int ring_try_pop(Ring *ring, void *elem){
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while (1){
+        size_t *seq = cell_seq(ring, pos);
+        size_t s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(s - (pos + 1));
+        if (diff == 0){
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                memcpy(elem, seq + 1, ring->elem_size);
+                //Hand the cell to the producer one lap ahead
+                __atomic_store_n(seq, pos + ring->capacity, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0){
+            return -1;
+        } else{
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+size_t ring_size(Ring *ring){
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return head > tail ? head - tail : 0;
+}
+
+int ring_resize(Ring *ring, size_t capacity){
+    size_t head = ring->head;
+    size_t tail = ring->tail;
+    Ring moved;
+    if (capacity < head - tail || ring_init(&moved, capacity, ring->elem_size) != 0){
+        return -1;
+    }
+    for (size_t pos = tail; pos != head; ++pos){
+        ring_try_push(&moved, cell_seq(ring, pos) + 1);
+    }
+    free(ring->cells);
+    ring->cells = moved.cells;
+    ring->capacity = moved.capacity;
+    //Tail first: in between, readers see more elements than there are, not fewer
+    __atomic_store_n(&ring->tail, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, moved.head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void ring_destroy(Ring *ring){
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+void park_wait(unsigned int *word, unsigned int expected){
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void park_wake(unsigned int *word, int count){
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
@@ -0,0 +1,86 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(TimerWheel *wheel, uint64_t now){
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now = now;
+}
+
+//Links a timer into the slot its distance from the current tick selects
+static void place(TimerWheel *wheel, TimerNode *node){
+    uint64_t delta = node->expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))){
+        level++;
+    }
+    TimerNode **slot = &wheel->slots[level][(node->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    node->next = *slot;
+    *slot = node;
+}
+
+void wheel_add(TimerWheel *wheel, TimerNode *node, uint64_t expires){
+    if (expires <= wheel->now){
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now >= WHEEL_SPAN){
+        expires = wheel->now + WHEEL_SPAN - 1;
+    }
+    node->expires = expires;
+    place(wheel, node);
+    wheel->count++;
+}
+
+//Spreads the timers of a higher level slot over the levels below
+static void cascade(TimerWheel *wheel, int level){
+    TimerNode **slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    TimerNode *node = *slot;
+    *slot = NULL;
+    while (node){
+        TimerNode *next = node->next;
+        place(wheel, node);
+        node = next;
+    }
+}
+
+TimerNode *wheel_advance(TimerWheel *wheel, uint64_t now){
+    TimerNode *fired = NULL;
+    while (wheel->now < now){
+        wheel->now++;
+
+        //Whenever a level wraps, the next slot of the level above comes due, highest level first
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && ((wheel->now >> (WHEEL_BITS * top)) & WHEEL_MASK) == 0){
+            top++;
+        }
+        for (int level = top; level > 0; --level){
+            cascade(wheel, level);
+        }
+
+        TimerNode **slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (*slot){
+            TimerNode *node = *slot;
+            *slot = node->next;
+            node->next = fired;
+            fired = node;
+            wheel->count--;
+        }
+    }
+    return fired;
+}
+
+TimerNode *wheel_take_all(TimerWheel *wheel){
+    TimerNode *all = NULL;
+    for (int level = 0; level < WHEEL_LEVELS; ++level){
+        for (int i = 0; i < WHEEL_SLOTS; ++i){
+            while (wheel->slots[level][i]){
+                TimerNode *node = wheel->slots[level][i];
+                wheel->slots[level][i] = node->next;
+                node->next = all;
+                all = node;
+            }
+        }
+    }
+    wheel->count = 0;
+    return all;
+}
@@ -2,71 +2,356 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
 
-//Check if the queue is full
-static int is_full(Queue *q){
-    return q->size == q->capacity;
+#define QUEUE_SPINS 8  //Retries before a thread parks on a futex
+#define QUEUE_RING_MIN 64  //Cells of a lane's ring at startup, and the fewest it shrinks to
+#define QUEUE_SHRINK_MS 1000  //A lane's ring shrinks at most once this often, bursts do not make it flap
+#define RING_RESIZING (INT_MIN / 2)  //Added to a lane's users while its ring is replaced
+
+#define QUEUE_BAND_SMALL (1L << 20)    //Jobs up to this size go to the first band
+#define QUEUE_BAND_MEDIUM (64L << 20)  //and up to this one to the second
+
+//Picks the shard of a job from its destination, so one host's jobs always share a shard
+static int shard_of(const Job *job){
+    return job->dest % QUEUE_SHARDS;
+}
+
+//Picks the lane of a job from its priority class and, under QUEUE_SJF, the bytes it moves
+static int lane_of(const Queue *queue, const Job *job){
+    int prio = job->priority >= 0 && job->priority < PRIO_CLASSES ? job->priority : PRIO_NORMAL;
+    int band = 0;
+    if (queue->policy == QUEUE_SJF){
+        long bytes = job->stripes ? job->length : job->size;
+        band = bytes <= QUEUE_BAND_SMALL ? 0 : bytes <= QUEUE_BAND_MEDIUM ? 1 : 2;
+    }
+    return prio * QUEUE_BANDS + band;
 }
 
-//Check if the queue is empty
-static int is_empty(Queue *q){
-    return q->size == 0;
+//Coarse monotonic clock in milliseconds, cheap enough to read on every pop
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void queue_init(Queue *queue, int capacity){
-    queue->items = malloc(sizeof(Job) * capacity);
-    if (!queue->items){
-        perror("malloc");
-        exit(EXIT_FAILURE);
+//Bumps a futex word and wakes sleepers, the syscall is skipped when nobody sleeps
+static void notify(unsigned int *seq, int *sleepers, int count){
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleepers, __ATOMIC_SEQ_CST) > 0){
+        park_wake(seq, count);
     }
+}
 
-    queue->capacity = capacity;
-    queue->size = 0;
-    queue->head = 0;
-    queue->tail = 0;
+//Sleeps until seq moves past the value read before the caller's last failed attempt
+static void sleep_on(unsigned int *seq, int *sleepers, unsigned int seen){
+    __atomic_add_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+    park_wait(seq, seen);
+    __atomic_sub_fetch(sleepers, 1, __ATOMIC_SEQ_CST);
+}
 
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->not_empty, NULL);
-    pthread_cond_init(&queue->not_full, NULL);
+//Counts the caller as a user of the lane's ring, waiting out a resize
+static Ring *lane_enter(QueueRing *lane){
+    while (__atomic_add_fetch(&lane->users, 1, __ATOMIC_SEQ_CST) < 0){
+        __atomic_sub_fetch(&lane->users, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&lane->users, __ATOMIC_SEQ_CST) < 0){
+            sched_yield();
+        }
+    }
+    return &lane->ring;
 }
 
-//Add a job to the queue
-void queue_push(Queue *queue, const Job *job){
-    pthread_mutex_lock(&queue->mutex);
+static void lane_leave(QueueRing *lane){
+    __atomic_sub_fetch(&lane->users, 1, __ATOMIC_SEQ_CST);
+}
+
+//Resizes the lane's ring once no push or pop is using it
+//Returns -1 only if memory ran out; a resize already under way elsewhere counts as done
+static int lane_resize(QueueRing *lane, size_t capacity){
+    int users = __atomic_load_n(&lane->users, __ATOMIC_SEQ_CST);
+    do{
+        if (users < 0){
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&lane->users, &users, users + RING_RESIZING, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    while (__atomic_load_n(&lane->users, __ATOMIC_SEQ_CST) != RING_RESIZING){
+        sched_yield();
+    }
 
-    while (is_full(queue)){
-        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    int rc = 0;
+    //The ring may have changed since the caller looked at it
+    if (capacity != lane->ring.capacity && capacity >= ring_size(&lane->ring)){
+        rc = ring_resize(&lane->ring, capacity);
+        if (rc == 0){
+            __atomic_store_n(&lane->resized_ms, now_ms(), __ATOMIC_RELAXED);
+        }
     }
+    __atomic_sub_fetch(&lane->users, RING_RESIZING, __ATOMIC_SEQ_CST);
+    return rc;
+}
+
+void queue_init(Queue *queue, int capacity, int workers, int policy, int aging_ms){
+    memset(queue, 0, sizeof(Queue));
+    queue->capacity = capacity > 1 ? capacity : 1;
+    for (int i = 0; i < QUEUE_SHARDS; ++i){
+        for (int lane = 0; lane < QUEUE_LANES; ++lane){
+            size_t cells = queue->capacity < QUEUE_RING_MIN ? queue->capacity : QUEUE_RING_MIN;
+            if (ring_init(&queue->shards[i].lanes[lane].ring, cells, sizeof(Job)) != 0){
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    queue->fair_share = workers > 1 ? (workers + 1) / 2 : 1;
+    queue->policy = policy;
+    queue->aging_ms = aging_ms;
+}
 
-    memcpy(&queue->items[queue->tail], job, sizeof(Job));
-    queue->tail = (queue->tail + 1) % queue->capacity;
-    queue->size++;
+//Add a job to its lane in the shard of its destination, blocking only while the queue is full
+int queue_push(Queue *queue, const Job *job){
+    int spins = 0;
+    while (1){
+        //Reading the sequence before trying means a pop after the attempt cannot be missed
+        unsigned int seen = __atomic_load_n(&queue->space_seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)){
+            return -1;
+        }
+        //Taking a place unconditionally and handing it back when there was none avoids a CAS loop
+        if (__atomic_fetch_add(&queue->waiting, 1, __ATOMIC_SEQ_CST) < queue->capacity){
+            break;
+        }
+        __atomic_sub_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+        if (spins++ < QUEUE_SPINS){
+            sched_yield();
+            continue;
+        }
+        sleep_on(&queue->space_seq, &queue->blocked_producers, seen);
+    }
 
-    pthread_cond_signal(&queue->not_empty);
-    pthread_mutex_unlock(&queue->mutex);
+    //The place is taken, so a full ring only needs to grow: it never holds more jobs than the queue
+    int lane = lane_of(queue, job);
+    QueueRing *slot = &queue->shards[shard_of(job)].lanes[lane];
+    while (1){
+        unsigned int seen = __atomic_load_n(&queue->space_seq, __ATOMIC_SEQ_CST);
+        Ring *ring = lane_enter(slot);
+        int rc = ring_try_push(ring, job);
+        size_t size = ring->capacity * 2;
+        lane_leave(slot);
+        if (rc == 0){
+            break;
+        }
+        if (lane_resize(slot, size < (size_t)queue->capacity ? size : (size_t)queue->capacity) != 0){
+            //Out of memory: wait for a pop to make room, as a bounded ring would
+            sleep_on(&queue->space_seq, &queue->blocked_producers, seen);
+        }
+    }
+    //A lane that was empty starts waiting now, its earlier pops say nothing about this job
+    QueueLane *state = &queue->lanes[lane];
+    if (__atomic_fetch_add(&state->queued, 1, __ATOMIC_SEQ_CST) <= 0){
+        __atomic_store_n(&state->served_ms, now_ms(), __ATOMIC_RELAXED);
+    }
+    notify(&queue->job_seq, &queue->idle_workers, 1);
+    return 0;
 }
 
-//Remove a job from the queue
-void queue_pop(Queue *queue, Job *out_job){
-    pthread_mutex_lock(&queue->mutex);
+//Takes a job from a lane of the shard if it has one and (unless any is set) the shard is below its fair share
+static int try_take(Queue *queue, int idx, int lane, int any, long long now, Job *out_job){
+    QueueShard *shard = &queue->shards[idx];
+    if (!any && __atomic_load_n(&shard->active, __ATOMIC_RELAXED) >= queue->fair_share){
+        return 0;
+    }
+    QueueRing *slot = &shard->lanes[lane];
+    //Empty rings are passed over without entering them, which would write to their lane
+    if (ring_size(&slot->ring) == 0){
+        return 0;
+    }
+    Ring *ring = lane_enter(slot);
+    int rc = ring_try_pop(ring, out_job);
+    size_t size = ring->capacity;
+    int shrink = size > QUEUE_RING_MIN && rc == 0 &&
+                 now - __atomic_load_n(&slot->resized_ms, __ATOMIC_RELAXED) >= QUEUE_SHRINK_MS &&
+                 ring_size(ring) * 8 < size;
+    lane_leave(slot);
+    if (rc != 0){
+        return 0;
+    }
+    //A ring that stayed mostly empty gives back half its cells
+    if (shrink){
+        lane_resize(slot, size / 2 > QUEUE_RING_MIN ? size / 2 : QUEUE_RING_MIN);
+    }
+    __atomic_sub_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&shard->active, 1, __ATOMIC_RELAXED);
+    QueueLane *state = &queue->lanes[lane];
+    __atomic_sub_fetch(&state->queued, 1, __ATOMIC_SEQ_CST);
+    //The clock ticks in milliseconds, most pops leave the shared line unwritten
+    if (__atomic_load_n(&state->served_ms, __ATOMIC_RELAXED) != now){
+        __atomic_store_n(&state->served_ms, now, __ATOMIC_RELAXED);
+    }
+    //One pop frees one place in the queue, so one blocked producer is enough
+    notify(&queue->space_seq, &queue->blocked_producers, 1);
+    return 1;
+}
 
-    while (is_empty(queue)){
-        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+//Takes a job of the lane, scanning the shards starting at home
+static int take_lane(Queue *queue, int home, int lane, int any, long long now, Job *out_job){
+    if (__atomic_load_n(&queue->lanes[lane].queued, __ATOMIC_SEQ_CST) <= 0){
+        return -1;
+    }
+    for (int i = 0; i < QUEUE_SHARDS; ++i){
+        int idx = (home + i) % QUEUE_SHARDS;
+        if (try_take(queue, idx, lane, any, now, out_job)){
+            return idx;
+        }
     }
-    memcpy(out_job, &queue->items[queue->head], sizeof(Job));
-    queue->head = (queue->head + 1) % queue->capacity;
-    queue->size--;
+    return -1;
+}
 
-    pthread_cond_signal(&queue->not_full);
-    pthread_mutex_unlock(&queue->mutex);
+//Returns the waiting lane that has gone longest without a pop, if that exceeds the aging limit, or -1
+static int aged_lane(Queue *queue, long long now){
+    if (queue->aging_ms <= 0){
+        return -1;
+    }
+    int oldest = -1;
+    long long oldest_ms = now - queue->aging_ms;
+    for (int lane = 0; lane < QUEUE_LANES; ++lane){
+        long long served = __atomic_load_n(&queue->lanes[lane].served_ms, __ATOMIC_RELAXED);
+        if (served <= oldest_ms && __atomic_load_n(&queue->lanes[lane].queued, __ATOMIC_RELAXED) > 0){
+            oldest = lane;
+            oldest_ms = served;
+        }
+    }
+    return oldest;
+}
+
+//Picks the next job: a starving lane first, then the lanes in priority order,
+//preferring shards below their fair share over any others
+static int take_any(Queue *queue, int home, Job *out_job){
+    long long now = now_ms();
+    int aged = aged_lane(queue, now);
+    for (int any = 0; any <= 1; ++any){
+        if (aged >= 0){
+            int idx = take_lane(queue, home, aged, any, now, out_job);
+            if (idx >= 0){
+                return idx;
+            }
+        }
+        for (int lane = 0; lane < QUEUE_LANES; ++lane){
+            int idx = take_lane(queue, home, lane, any, now, out_job);
+            if (idx >= 0){
+                return idx;
+            }
+        }
+    }
+    return -1;
+}
+
+//Remove a job from the queue, stealing from other shards when the home shard is empty
+int queue_pop(Queue *queue, int home, Job *out_job){
+    home %= QUEUE_SHARDS;
+    int spins = 0;
+    while (1){
+        unsigned int seen = __atomic_load_n(&queue->job_seq, __ATOMIC_SEQ_CST);
+        int idx = take_any(queue, home, out_job);
+        if (idx >= 0){
+            return idx;
+        }
+        //A job usually follows soon under load: give producers the CPU a few times before paying for a futex sleep
+        if (spins++ < QUEUE_SPINS){
+            sched_yield();
+            continue;
+        }
+        if (__atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)){
+            return take_any(queue, home, out_job);
+        }
+        sleep_on(&queue->job_seq, &queue->idle_workers, seen);
+    }
+}
+
+//Workers never sleep while any shard holds a job, so finishing one needs no wakeup
+void queue_done(Queue *queue, int shard){
+    __atomic_sub_fetch(&queue->shards[shard].active, 1, __ATOMIC_RELAXED);
+}
+
+void queue_stats(Queue *queue, long *waiting, long *running){
+    *waiting = 0;
+    *running = 0;
+    for (int lane = 0; lane < QUEUE_LANES; ++lane){
+        int n = __atomic_load_n(&queue->lanes[lane].queued, __ATOMIC_RELAXED);
+        *waiting += n > 0 ? n : 0;
+    }
+    for (int i = 0; i < QUEUE_SHARDS; ++i){
+        *running += __atomic_load_n(&queue->shards[i].active, __ATOMIC_RELAXED);
+    }
+}
+
+void queue_close(Queue *queue){
+    __atomic_store_n(&queue->closed, 1, __ATOMIC_SEQ_CST);
+    notify(&queue->job_seq, &queue->idle_workers, INT_MAX);
+    notify(&queue->space_seq, &queue->blocked_producers, INT_MAX);
 }
 
 void queue_destroy(Queue *queue){
-    if (queue->items){
-        free(queue->items);
+    for (int i = 0; i < QUEUE_SHARDS; ++i){
+        for (int lane = 0; lane < QUEUE_LANES; ++lane){
+            ring_destroy(&queue->shards[i].lanes[lane].ring);
+        }
     }
+}
+
+struct PathBlock{
+    int refs;     //The arena while the block is current, plus one per stored name
+    size_t used;  //Bytes of the block in use, header included
+};
 
-    pthread_mutex_destroy(&queue->mutex);
-    pthread_cond_destroy(&queue->not_empty);
-    pthread_cond_destroy(&queue->not_full);
+static void block_release(PathBlock *block){
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        free(block);
+    }
+}
+
+//Blocks are aligned to their size, so a name finds its block by masking its address
+static PathBlock *block_of(const char *path){
+    return (PathBlock *)((uintptr_t)path & ~(uintptr_t)(PATH_BLOCK_SIZE - 1));
+}
+
+const char *path_store(PathArena *arena, const char *name){
+    size_t len = strlen(name) + 1;
+    if (len > PATH_BLOCK_SIZE - sizeof(PathBlock)){
+        return NULL;
+    }
+    PathBlock *block = arena->current;
+    if (!block || block->used + len > PATH_BLOCK_SIZE){
+        block = aligned_alloc(PATH_BLOCK_SIZE, PATH_BLOCK_SIZE);
+        if (!block){
+            return NULL;
+        }
+        block->refs = 1;
+        block->used = sizeof(PathBlock);
+        path_arena_close(arena);
+        arena->current = block;
+    }
+
+    char *path = (char *)block + block->used;
+    memcpy(path, name, len);
+    block->used += len;
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    return path;
+}
+
+void path_retain(const char *path){
+    __atomic_add_fetch(&block_of(path)->refs, 1, __ATOMIC_RELAXED);
+}
+
+void path_release(const char *path){
+    block_release(block_of(path));
+}
+
+void path_arena_close(PathArena *arena){
+    if (arena->current){
+        block_release(arena->current);
+        arena->current = NULL;
+    }
 }
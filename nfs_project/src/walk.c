@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+#include "walk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define WALK_PATH_MAX 4096
+
+//Record layout getdents64 fills the buffer with
+struct linux_dirent64{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct DirReader{
+    int fd;
+    size_t len;  //Bytes returned by the last getdents64
+    size_t pos;  //Offset of the next record in buf
+    uint64_t ino;  //Inode of the entry returned last
+    char buf[WALK_DENTS_BUF] __attribute__((aligned(8)));
+};
+
+DirReader *dir_reader_open(void){
+    DirReader *reader = malloc(sizeof(DirReader));
+    if (reader){
+        reader->fd = -1;
+        reader->len = 0;
+        reader->pos = 0;
+    }
+    return reader;
+}
+
+void dir_reader_close(DirReader *reader){
+    free(reader);
+}
+
+int dir_reader_reset(DirReader *reader, int fd, uint64_t offset){
+    reader->fd = fd;
+    reader->len = 0;
+    reader->pos = 0;
+    return lseek(fd, (off_t)offset, SEEK_SET) < 0 ? -1 : 0;
+}
+
+int dir_reader_next(DirReader *reader, const char **name, int *type, uint64_t *next_offset){
+    while (1){
+        if (reader->pos < reader->len){
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(reader->buf + reader->pos);
+            reader->pos += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0){
+                continue;
+            }
+            *name = d->d_name;
+            *type = d->d_type;
+            *next_offset = (uint64_t)d->d_off;
+            reader->ino = d->d_ino;
+            return 1;
+        }
+
+        long n = syscall(SYS_getdents64, reader->fd, reader->buf, sizeof(reader->buf));
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return n == 0 ? 0 : -1;
+        }
+        reader->len = n;
+        reader->pos = 0;
+    }
+}
+
+//Resolves DT_UNKNOWN and fetches the metadata a listing needs
+//Returns the entry's type (DT_REG, DT_DIR or DT_UNKNOWN for anything else), st is filled when have_stat is set
+static int entry_type(int dir_fd, const char *name, int type, int meta, struct stat *st, int *have_stat){
+    *have_stat = 0;
+    if (type == DT_UNKNOWN || (type == DT_REG && meta)){
+        if (fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW) != 0){
+            return DT_UNKNOWN;
+        }
+        *have_stat = 1;
+        return S_ISDIR(st->st_mode) ? DT_DIR : S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    return type == DT_DIR || type == DT_REG ? type : DT_UNKNOWN;
+}
+
+//Formats the entry of a regular file named parent/name, returns its length or 0 if it does not fit
+static size_t format_entry(char *out, size_t room, int meta, const struct stat *st, const char *parent, const char *name){
+    const char *sep = parent[0] ? "/" : "";
+    int n;
+    if (meta){
+        n = snprintf(out, room, "%lld %lld %llu %s%s%s\n", (long long)st->st_size,
+                     (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec,
+                     (unsigned long long)st->st_ino, parent, sep, name);
+    } else{
+        n = snprintf(out, room, "%s%s%s\n", parent, sep, name);
+    }
+    return n > 0 && (size_t)n < room ? (size_t)n : 0;
+}
+
+//Opens a subdirectory without following symbolic links
+static int open_subdir(int dir_fd, const char *name){
+    return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+//A directory waiting to be listed, path is relative to the root ("" for the root itself)
+typedef struct WalkDir{
+    struct WalkDir *next;
+    char path[];
+} WalkDir;
+
+//State shared by the threads walking one tree
+typedef struct{
+    int root_fd;
+    int meta;
+    pthread_mutex_t lock;
+    pthread_cond_t more;  //A directory was queued or the walk is over
+    WalkDir *pending;     //Stack of directories to list, depth first keeps it short
+    int busy;             //Directories being listed right now
+    int failed;           //The stream broke, every thread stops
+
+    pthread_mutex_t out_lock;  //Entries of one thread go out as one contiguous write
+    StreamOut *out;
+} Walk;
+
+//Per-thread state: a directory reader and the entries collected before they are written to the stream
+typedef struct{
+    DirReader *reader;
+    size_t used;
+    char buf[CONN_BUF_SIZE];
+} WalkBuf;
+
+static int flush_entries(Walk *walk, WalkBuf *wb){
+    int rc = 0;
+    if (wb->used > 0){
+        pthread_mutex_lock(&walk->out_lock);
+        rc = stream_write(walk->out, wb->buf, wb->used);
+        pthread_mutex_unlock(&walk->out_lock);
+        wb->used = 0;
+    }
+    return rc;
+}
+
+//Queues a subdirectory for any thread to list
+static void push_dir(Walk *walk, const char *parent, const char *name){
+    size_t len = strlen(parent) + strlen(name) + 2;
+    if (len > WALK_PATH_MAX){
+        return;
+    }
+    WalkDir *dir = malloc(sizeof(WalkDir) + len);
+    if (!dir){
+        return;
+    }
+    snprintf(dir->path, len, "%s%s%s", parent, parent[0] && name[0] ? "/" : "", name);
+
+    pthread_mutex_lock(&walk->lock);
+    dir->next = walk->pending;
+    walk->pending = dir;
+    pthread_cond_signal(&walk->more);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+//Adds one regular file to the thread's buffer, flushing it first when full
+static int add_entry(Walk *walk, WalkBuf *wb, const char *parent, const char *name, const struct stat *st){
+    char entry[WALK_PATH_MAX + 96];
+    size_t n = format_entry(entry, sizeof(entry), walk->meta, st, parent, name);
+    if (n == 0){
+        return 0;
+    }
+    if (wb->used + n > sizeof(wb->buf) && flush_entries(walk, wb) != 0){
+        return -1;
+    }
+    memcpy(wb->buf + wb->used, entry, n);
+    wb->used += n;
+    return 0;
+}
+
+//Lists one directory: files become entries, subdirectories are queued
+static int list_dir(Walk *walk, WalkBuf *wb, const WalkDir *dir){
+    int fd = open_subdir(walk->root_fd, dir->path[0] ? dir->path : ".");
+    if (fd < 0){
+        return 0;
+    }
+    if (dir_reader_reset(wb->reader, fd, 0) != 0){
+        close(fd);
+        return 0;
+    }
+
+    int rc = 0;
+    const char *name;
+    int type;
+    uint64_t off;
+    while (rc == 0 && dir_reader_next(wb->reader, &name, &type, &off) > 0){
+        struct stat st;
+        int have_stat;
+        type = entry_type(fd, name, type, walk->meta, &st, &have_stat);
+        if (type == DT_DIR){
+            push_dir(walk, dir->path, name);
+        } else if (type == DT_REG){
+            rc = add_entry(walk, wb, dir->path, name, have_stat ? &st : NULL);
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+static void walk_fail(Walk *walk){
+    pthread_mutex_lock(&walk->lock);
+    walk->failed = 1;
+    pthread_cond_broadcast(&walk->more);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+//Lists queued directories until the whole tree is done
+static void *walk_thread(void *arg){
+    Walk *walk = arg;
+    WalkBuf *wb = malloc(sizeof(WalkBuf));
+    if (wb){
+        wb->reader = dir_reader_open();
+    }
+    if (!wb || !wb->reader){
+        free(wb);
+        walk_fail(walk);
+        return NULL;
+    }
+    wb->used = 0;
+
+    while (1){
+        pthread_mutex_lock(&walk->lock);
+        while (!walk->pending && walk->busy > 0 && !walk->failed){
+            pthread_cond_wait(&walk->more, &walk->lock);
+        }
+        if (!walk->pending || walk->failed){
+            pthread_cond_broadcast(&walk->more);
+            pthread_mutex_unlock(&walk->lock);
+            break;
+        }
+        WalkDir *dir = walk->pending;
+        walk->pending = dir->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        int rc = list_dir(walk, wb, dir);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+        if (rc != 0){
+            walk->failed = 1;
+        }
+        //The last busy thread with nothing left to hand out ends the walk
+        if (walk->failed || (!walk->pending && walk->busy == 0)){
+            pthread_cond_broadcast(&walk->more);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+
+    if (flush_entries(walk, wb) != 0){
+        walk_fail(walk);
+    }
+    dir_reader_close(wb->reader);
+    free(wb);
+    return NULL;
+}
+
+//Writes the entries of the tree below start (relative to root_fd, "" for the root itself) to out,
+//listed by up to WALK_THREADS threads; returns 0 on success and -1 if the stream broke
+static int walk_stream(int root_fd, const char *start, int meta, StreamOut *out, int threads){
+    Walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.root_fd = root_fd;
+    walk.meta = meta;
+    walk.out = out;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.more, NULL);
+    pthread_mutex_init(&walk.out_lock, NULL);
+    push_dir(&walk, start, "");
+
+    //The calling thread walks too, helpers that cannot be started are simply missing
+    pthread_t helpers[WALK_THREADS - 1];
+    int started = 0;
+    for (int i = 0; i < threads - 1 && i < WALK_THREADS - 1; ++i){
+        if (pthread_create(&helpers[started], NULL, walk_thread, &walk) == 0){
+            started++;
+        }
+    }
+    walk_thread(&walk);
+    for (int i = 0; i < started; ++i){
+        pthread_join(helpers[i], NULL);
+    }
+
+    while (walk.pending){
+        WalkDir *next = walk.pending->next;
+        free(walk.pending);
+        walk.pending = next;
+    }
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.more);
+    pthread_mutex_destroy(&walk.out_lock);
+    return walk.failed ? -1 : 0;
+}
+
+int walk_send_tree(int root_fd, int meta, int sock, uint32_t stream_id){
+    StreamOut *out = stream_out_open(sock, stream_id);
+    if (!out){
+        return -1;
+    }
+    int rc = walk_stream(root_fd, "", meta, out, WALK_THREADS);
+    if (rc == 0){
+        rc = stream_flush(out, 1);
+    }
+    free(out);
+    return rc;
+}
+
+//One open directory of a paged walk
+typedef struct{
+    int fd;
+    uint64_t resume;     //getdents64 offset just past the last entry handled
+    uint64_t child_off;  //Offset of the entry of the subdirectory open below this one
+    uint64_t ino;        //Inode of the directory, as its parent's entry gives it
+    size_t path_len;     //Length of the directory's relative path
+} PageLevel;
+
+//A directory the cursor stands in: where its entry starts in its parent, and its inode
+typedef struct{
+    uint64_t off;
+    uint64_t ino;
+} CursorStep;
+
+//Parses "<off>:<ino>/.../<pos>" into the steps down and the position in the deepest directory
+//Returns the number of steps, or -1 if the cursor is malformed
+static int parse_cursor(const char *cursor, CursorStep *steps, uint64_t *resume){
+    *resume = 0;
+    if (!cursor[0]){
+        return 0;
+    }
+
+    int count = 0;
+    const char *p = cursor;
+    while (1){
+        char *end;
+        errno = 0;
+        unsigned long long v = strtoull(p, &end, 16);
+        if (end == p || errno != 0){
+            return -1;
+        }
+        if (!*end){
+            *resume = v;
+            return count;
+        }
+        if (*end != ':' || count == WALK_PAGE_DEPTH - 1){
+            return -1;
+        }
+        steps[count].off = v;
+        p = end + 1;
+        errno = 0;
+        v = strtoull(p, &end, 16);
+        if (end == p || errno != 0 || *end != '/'){
+            return -1;
+        }
+        steps[count++].ino = v;
+        p = end + 1;
+    }
+}
+
+//Writes the cursor of the open directories, returns 0 if it fits
+static int format_cursor(const PageLevel *levels, int top, char *next, size_t next_len){
+    size_t used = 0;
+    for (int i = 0; i < top; ++i){
+        int n = snprintf(next + used, next_len - used, "%llx:%llx/", (unsigned long long)levels[i].child_off,
+                         (unsigned long long)levels[i + 1].ino);
+        if (n < 0 || (size_t)n >= next_len - used){
+            return -1;
+        }
+        used += n;
+    }
+    int n = snprintf(next + used, next_len - used, "%llx", (unsigned long long)levels[top].resume);
+    return n < 0 || (size_t)n >= next_len - used ? -1 : 0;
+}
+
+int walk_send_page(int root_fd, int meta, int recursive, const char *cursor, uint64_t max_entries,
+                   int sock, uint32_t stream_id, char *next, size_t next_len){
+    CursorStep steps[WALK_PAGE_DEPTH];
+    uint64_t resume;
+    int depth = parse_cursor(cursor, steps, &resume);
+    if (depth < 0){
+        return -2;
+    }
+    next[0] = '\0';
+
+    PageLevel levels[WALK_PAGE_DEPTH];
+    char path[WALK_PATH_MAX];
+    path[0] = '\0';
+    int top = 0;
+    levels[0].fd = open_subdir(root_fd, ".");
+    levels[0].resume = resume;
+    levels[0].ino = 0;
+    levels[0].path_len = 0;
+    if (levels[0].fd < 0){
+        return -2;
+    }
+    DirReader *reader = dir_reader_open();
+    StreamOut *out = stream_out_open(sock, stream_id);
+    int rc = reader && out ? 0 : -1;
+
+    //Find the directories the cursor stands in again, each from its entry in the one above
+    //A directory that vanished or whose entry now names something else is finished: its parent goes on
+    //from that entry, which is handled afresh
+    for (int i = 0; rc == 0 && i < depth; ++i){
+        const char *name;
+        int type;
+        uint64_t off;
+        struct stat st;
+        int have_stat;
+        int fd = -1;
+        size_t len = levels[top].path_len + (top ? 1 : 0);
+        if (dir_reader_reset(reader, levels[top].fd, steps[i].off) == 0 &&
+            dir_reader_next(reader, &name, &type, &off) > 0 && reader->ino == steps[i].ino &&
+            len + strlen(name) < sizeof(path) && entry_type(levels[top].fd, name, type, 0, &st, &have_stat) == DT_DIR){
+            fd = open_subdir(levels[top].fd, name);
+        }
+        if (fd < 0){
+            levels[top].resume = steps[i].off;
+            break;
+        }
+        snprintf(path + levels[top].path_len, sizeof(path) - levels[top].path_len, "%s%s", top ? "/" : "", name);
+        levels[top].resume = off;
+        levels[top].child_off = steps[i].off;
+        top++;
+        levels[top].fd = fd;
+        levels[top].resume = i + 1 == depth ? resume : 0;
+        levels[top].ino = steps[i].ino;
+        levels[top].path_len = len + strlen(name);
+    }
+    if (rc == 0 && dir_reader_reset(reader, levels[top].fd, levels[top].resume) != 0){
+        rc = -1;
+    }
+
+    uint64_t count = 0;
+    while (rc == 0 && top >= 0){
+        if (max_entries > 0 && count >= max_entries){
+            break;
+        }
+        const char *name;
+        int type;
+        uint64_t start = levels[top].resume;
+        uint64_t off;
+        //A directory that cannot be read further counts as finished
+        if (dir_reader_next(reader, &name, &type, &off) <= 0){
+            close(levels[top].fd);
+            if (--top >= 0){
+                path[levels[top].path_len] = '\0';
+                if (dir_reader_reset(reader, levels[top].fd, levels[top].resume) != 0){
+                    rc = -1;
+                }
+            }
+            continue;
+        }
+        levels[top].resume = off;
+
+        struct stat st;
+        int have_stat;
+        type = entry_type(levels[top].fd, name, type, meta, &st, &have_stat);
+        if (type == DT_DIR && recursive){
+            //A path too long to name its entries holds nothing a listing could report
+            size_t len = levels[top].path_len + (top ? 1 : 0) + strlen(name);
+            if (len >= sizeof(path)){
+                continue;
+            }
+            uint64_t ino = reader->ino;
+            snprintf(path + levels[top].path_len, sizeof(path) - levels[top].path_len, "%s%s", top ? "/" : "", name);
+            if (top + 1 == WALK_PAGE_DEPTH){
+                //Too deep for the cursor: the whole subtree goes into this page, then the reader is back
+                rc = walk_stream(root_fd, path, meta, out, 1);
+                path[levels[top].path_len] = '\0';
+                if (rc == 0 && dir_reader_reset(reader, levels[top].fd, levels[top].resume) != 0){
+                    rc = -1;
+                }
+                continue;
+            }
+            int fd = open_subdir(levels[top].fd, name);
+            if (fd < 0){
+                path[levels[top].path_len] = '\0';
+                continue;
+            }
+            levels[top].child_off = start;
+            top++;
+            levels[top].fd = fd;
+            levels[top].resume = 0;
+            levels[top].ino = ino;
+            levels[top].path_len = len;
+            if (dir_reader_reset(reader, fd, 0) != 0){
+                rc = -1;
+            }
+        } else if (type == DT_REG){
+            char entry[WALK_PATH_MAX + 96];
+            size_t n = format_entry(entry, sizeof(entry), meta, have_stat ? &st : NULL, path, name);
+            if (n > 0){
+                rc = stream_write(out, entry, n);
+                count++;
+            }
+        }
+    }
+
+    if (rc == 0 && top >= 0 && format_cursor(levels, top, next, next_len) != 0){
+        rc = -1;
+    }
+    for (int i = 0; i <= top; ++i){
+        close(levels[i].fd);
+    }
+    if (rc == 0){
+        rc = stream_flush(out, 1);
+    }
+    dir_reader_close(reader);
+    free(out);
+    return rc;
+}
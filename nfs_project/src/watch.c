@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include "watch.h"
+#include "walk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define WATCH_PATH_MAX 4096
+#define WATCH_BATCH_MAX 65536  //Changed paths that are sent without waiting for the coalescing window
+
+//IN_CREATE is only acted on for directories, a new file is reported once it is closed after writing
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_CREATE | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+//State of one watched tree
+typedef struct{
+    const char *root;  //Watched directory as requested
+    int root_fd;
+    int inotify_fd;
+    char **dirs;       //Relative path of the directory behind every watch descriptor, NULL when unused
+    int dir_cap;
+    DirReader *reader;
+    char **pending;    //Changed paths waiting for the next batch
+    size_t pending_count;
+    size_t pending_cap;
+    int overflow;      //The kernel dropped events, only a rescan can tell what changed
+} Watcher;
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//Joins a relative directory and a name, returns 0 if the result fits
+static int join_path(char *out, size_t room, const char *parent, const char *name){
+    int n = snprintf(out, room, "%s%s%s", parent, parent[0] && name[0] ? "/" : "", name);
+    return n >= 0 && (size_t)n < room ? 0 : -1;
+}
+
+static void pending_add(Watcher *w, const char *rel){
+    if (w->pending_count == w->pending_cap){
+        size_t cap = w->pending_cap ? w->pending_cap * 2 : 256;
+        char **grown = realloc(w->pending, cap * sizeof(char *));
+        if (!grown){
+            w->overflow = 1;
+            return;
+        }
+        w->pending = grown;
+        w->pending_cap = cap;
+    }
+    char *copy = strdup(rel);
+    if (!copy){
+        w->overflow = 1;
+        return;
+    }
+    w->pending[w->pending_count++] = copy;
+}
+
+static void pending_clear(Watcher *w){
+    for (size_t i = 0; i < w->pending_count; ++i){
+        free(w->pending[i]);
+    }
+    w->pending_count = 0;
+}
+
+//Remembers the directory behind a watch descriptor; a directory moved within the tree keeps its descriptor
+static int set_dir(Watcher *w, int wd, const char *rel){
+    if (wd >= w->dir_cap){
+        int cap = w->dir_cap ? w->dir_cap : 64;
+        while (cap <= wd){
+            cap *= 2;
+        }
+        char **grown = realloc(w->dirs, cap * sizeof(char *));
+        if (!grown){
+            return -1;
+        }
+        memset(grown + w->dir_cap, 0, (cap - w->dir_cap) * sizeof(char *));
+        w->dirs = grown;
+        w->dir_cap = cap;
+    }
+    char *copy = strdup(rel);
+    if (!copy){
+        return -1;
+    }
+    free(w->dirs[wd]);
+    w->dirs[wd] = copy;
+    return 0;
+}
+
+//A directory waiting for its watch, path is relative to the root
+typedef struct WatchDir{
+    struct WatchDir *next;
+    char path[];
+} WatchDir;
+
+static WatchDir *push_dir(WatchDir *stack, const char *parent, const char *name){
+    char rel[WATCH_PATH_MAX];
+    if (join_path(rel, sizeof(rel), parent, name) != 0){
+        return stack;
+    }
+    WatchDir *dir = malloc(sizeof(WatchDir) + strlen(rel) + 1);
+    if (!dir){
+        return stack;
+    }
+    strcpy(dir->path, rel);
+    dir->next = stack;
+    return dir;
+}
+
+//Watches rel and every directory below it; report also queues the files found there, since a
+//directory created or moved in after the watch started may have been filled before its own watch existed
+//Returns 0 on success and -1 if a directory could not be watched
+static int add_tree(Watcher *w, const char *rel, int report){
+    WatchDir *stack = push_dir(NULL, rel, "");
+    int rc = 0;
+    while (stack){
+        WatchDir *dir = stack;
+        stack = dir->next;
+
+        //The watch goes first: a file created while the directory is read is then seen one way or the other
+        char path[WATCH_PATH_MAX];
+        int fd = -1;
+        int wd = -1;
+        if (join_path(path, sizeof(path), w->root, dir->path) == 0){
+            wd = inotify_add_watch(w->inotify_fd, path, WATCH_MASK);
+        }
+        if (wd >= 0 && set_dir(w, wd, dir->path) == 0){
+            fd = openat(w->root_fd, dir->path[0] ? dir->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd < 0 || dir_reader_reset(w->reader, fd, 0) != 0){
+            //A directory removed again in the meantime is no error
+            if (errno != ENOENT && errno != ENOTDIR){
+                rc = -1;
+            }
+            if (fd >= 0){
+                close(fd);
+            }
+            free(dir);
+            continue;
+        }
+
+        const char *name;
+        int type;
+        uint64_t off;
+        while (dir_reader_next(w->reader, &name, &type, &off) > 0){
+            if (type == DT_UNKNOWN){
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0){
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR){
+                stack = push_dir(stack, dir->path, name);
+            } else if (type == DT_REG && report){
+                char file[WATCH_PATH_MAX];
+                if (join_path(file, sizeof(file), dir->path, name) == 0){
+                    pending_add(w, file);
+                }
+            }
+        }
+        close(fd);
+        free(dir);
+    }
+    return rc;
+}
+
+static void handle_event(Watcher *w, const struct inotify_event *ev){
+    if (ev->mask & IN_Q_OVERFLOW){
+        w->overflow = 1;
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= w->dir_cap || !w->dirs[ev->wd]){
+        return;
+    }
+    if (ev->mask & IN_IGNORED){
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0){
+        return;
+    }
+
+    char rel[WATCH_PATH_MAX];
+    if (join_path(rel, sizeof(rel), w->dirs[ev->wd], ev->name) != 0){
+        return;
+    }
+    if (ev->mask & IN_ISDIR){
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)){
+            add_tree(w, rel, 1);
+        }
+    } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)){
+        pending_add(w, rel);
+    }
+}
+
+//Reads every queued inotify event, returns 0 on success
+static int read_events(Watcher *w){
+    char buf[WATCH_EVENT_BUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1){
+        ssize_t n = read(w->inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            return errno == EAGAIN ? 0 : -1;
+        }
+        for (char *p = buf; p < buf + n; ){
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handle_event(w, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+static int compare_paths(const void *a, const void *b){
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//Sends the collected changes as one batch of entries, each path once with its current metadata
+//Lost events are reported instead as an empty frame flagged FRAME_RESCAN
+static int send_batch(Watcher *w, StreamOut *out){
+    if (w->overflow){
+        w->overflow = 0;
+        pending_clear(w);
+        return frame_send(out->sock, OP_DATA, FRAME_RESCAN, out->stream_id, NULL, 0);
+    }
+
+    qsort(w->pending, w->pending_count, sizeof(char *), compare_paths);
+    char entry[WATCH_PATH_MAX + 64];
+    int rc = 0;
+    for (size_t i = 0; i < w->pending_count && rc == 0; ++i){
+        if (i > 0 && strcmp(w->pending[i], w->pending[i - 1]) == 0){
+            continue;
+        }
+        struct stat st;
+        if (fstatat(w->root_fd, w->pending[i], &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)){
+            continue;
+        }
+        int n = snprintf(entry, sizeof(entry), "%lld %lld %llu %s\n", (long long)st.st_size,
+                         (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+                         (unsigned long long)st.st_ino, w->pending[i]);
+        if (n <= 0 || (size_t)n >= sizeof(entry)){
+            continue;
+        }
+        //An entry never spans two frames, so the receiver can parse every frame on its own
+        if (out->len + n > sizeof(out->buf)){
+            rc = stream_flush(out, 0);
+        }
+        if (rc == 0){
+            rc = stream_write(out, entry, n);
+        }
+    }
+    pending_clear(w);
+    return rc == 0 ? stream_flush(out, 0) : -1;
+}
+
+int watch_tree(const char *dir, Conn *conn, uint32_t stream_id){
+    int sock = conn->fd;
+    Watcher w = {0};
+    w.root = dir;
+    w.root_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    w.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    w.reader = dir_reader_open();
+    StreamOut *out = stream_out_open(sock, stream_id);
+
+    int rc = 0;
+    const char *err = NULL;
+    if (w.root_fd < 0 || w.inotify_fd < 0 || !w.reader || !out){
+        err = strerror(errno);
+    } else if (add_tree(&w, "", 0) != 0){
+        err = errno == ENOSPC ? "too many directories to watch" : strerror(errno);
+    }
+    if (err){
+        rc = frame_send(sock, OP_ERR, 0, stream_id, err, strlen(err));
+    } else if (frame_send(sock, OP_OK, 0, stream_id, NULL, 0) != 0){
+        rc = -1;
+    }
+
+    //Anything arriving from the peer, normally the end of the connection, ends the watch
+    long long due = 0;
+    while (!err && rc == 0){
+        struct pollfd fds[2] = { { w.inotify_fd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+        int waiting = w.pending_count > 0 || w.overflow;
+        int timeout = -1;
+        if (waiting){
+            long long left = due - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        int n = poll(fds, 2, timeout);
+        if (n < 0){
+            rc = errno == EINTR ? 0 : -1;
+            continue;
+        }
+        if (fds[1].revents){
+            break;
+        }
+        if ((fds[0].revents & POLLIN) && read_events(&w) != 0){
+            rc = -1;
+            break;
+        }
+        if (!waiting && (w.pending_count > 0 || w.overflow)){
+            due = now_ms() + WATCH_COALESCE_MS;
+        }
+        if ((w.pending_count > 0 || w.overflow) && (now_ms() >= due || w.pending_count >= WATCH_BATCH_MAX)){
+            rc = send_batch(&w, out);
+        }
+    }
+
+    pending_clear(&w);
+    free(w.pending);
+    for (int i = 0; i < w.dir_cap; ++i){
+        free(w.dirs[i]);
+    }
+    free(w.dirs);
+    free(out);
+    dir_reader_close(w.reader);
+    if (w.inotify_fd >= 0){
+        close(w.inotify_fd);
+    }
+    if (w.root_fd >= 0){
+        close(w.root_fd);
+    }
+    return rc;
+}
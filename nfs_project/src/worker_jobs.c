@@ -1,180 +1,938 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "worker_jobs.h"
+#include "protocol.h"
+#include "conn_pool.h"
 #include "utils.h"
+#include "mapping.h"
+#include "logger.h"
+#include "metrics.h"
 
 volatile sig_atomic_t is_terminating = 0;
 //Synchronization primitives for shutdown signaling
 pthread_mutex_t terminate_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t terminate_cond = PTHREAD_COND_INITIALIZER;
-extern FILE *log_file;
 extern Queue job_queue;
+int direct_transfer = 0;
+int verify_retries = 0;
 
-//Connect to a remote server (source or target client)
-static int connect_to(const char *ip, int port){
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0){
+long stripe_size = 64L << 20;
+int batch_files = 256;
+long batch_bytes = 4L << 20;
+
+//Per-thread state of a sync worker
+typedef struct{
+    long tid;
+    int pipe_fds[2];  //Relay pipe for splice(), -1 when unavailable
+    const SyncMapping *map;  //Mapping of the current job, relays stop between frames once it is cancelled
+    uint64_t moved;  //Payload bytes of the current job, for the metrics
+    char buf[CONN_BUF_SIZE];  //Copy buffer for bytes that cannot be spliced
+} WorkerContext;
+
+//Reads and discards len bytes of a reply payload
+static int skip_bytes(Conn *conn, uint64_t len){
+    char temp[256];
+    while (len > 0){
+        size_t n = len < sizeof(temp) ? len : sizeof(temp);
+        if (conn_read_exact(conn, temp, n) != 0){
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+//Parse the PULL reply frame and extract file size and mtime
+static int get_file_info(Conn *conn, uint32_t sid, long *out_size, int64_t *out_mtime){
+    FrameHeader hdr;
+    if (conn_read_frame(conn, &hdr) != 0 || hdr.stream_id != sid){
+        return -1;
+    }
+    if (hdr.opcode != OP_OK || (hdr.length != sizeof(uint64_t) && hdr.length != 2 * sizeof(uint64_t))){
         return -1;
     }
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0){
-        close(s);
+    uint64_t info[2] = { 0, htobe64((uint64_t)-1) };
+    if (conn_read_exact(conn, info, hdr.length) != 0){
         return -1;
     }
+    *out_size = (long)be64toh(info[0]);
+    *out_mtime = (int64_t)be64toh(info[1]);
+    return *out_size >= 0 ? 0 : -1;
+}
 
-    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0){
-        close(s);
+//Sends a request frame whose payload is the given big-endian u64 fields followed by the job's file path
+static int send_request(int sock, int opcode, int flags, uint32_t sid, const uint64_t *fields, int nfields,
+                        const char *dir, const char *name){
+    char payload[FRAME_MAX_REQUEST];
+    size_t off = 0;
+    for (int i = 0; i < nfields; ++i){
+        uint64_t be = htobe64(fields[i]);
+        memcpy(payload + off, &be, sizeof(be));
+        off += sizeof(be);
+    }
+    int n = snprintf(payload + off, sizeof(payload) - off, "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= sizeof(payload) - off){
         return -1;
     }
-    return s;
+    return frame_send(sock, opcode, flags, sid, payload, off + n);
 }
 
-//Parse the response header and extract file size
-static int get_file_info(int sock, long *out_size){
-    char hdr[128];
-    int r = read(sock, hdr, sizeof(hdr) - 1);
-    if (r <= 0){
+//Sends a request frame whose payload is the job's file path on the given side
+static int send_path_request(int sock, int opcode, uint32_t sid, const char *dir, const char *name){
+    return send_request(sock, opcode, 0, sid, NULL, 0, dir, name);
+}
+
+//Sends a PUSH, PATCH or COMMIT request carrying the mtime the target should give the file
+static int send_push_request(int sock, int opcode, int flags, uint32_t sid, const SyncMapping *map, const Job *job, int64_t mtime){
+    uint64_t fields[1] = { (uint64_t)mtime };
+    return send_request(sock, opcode, FRAME_META | flags, sid, fields, 1, map->dst_path, job->filename);
+}
+
+//Reads an OK reply carrying one big-endian u64, returns 0 on success
+static int read_u64_reply(Conn *conn, uint32_t sid, uint64_t *out){
+    FrameHeader hdr;
+    if (conn_read_frame(conn, &hdr) != 0 || hdr.stream_id != sid || hdr.opcode != OP_OK ||
+        hdr.length != sizeof(*out) || conn_read_exact(conn, out, sizeof(*out)) != 0){
         return -1;
+    }
+    *out = be64toh(*out);
+    return 0;
+}
 
+//What the source reports once the DATA of a PULL with FRAME_DIGEST or FRAME_COMPRESS is sent
+typedef struct{
+    uint64_t digest;   //FRAME_DIGEST: digest of the file bytes sent
+    uint64_t bytes;    //FRAME_COMPRESS: file bytes sent, packed or not
+    uint64_t pack_ns;  //FRAME_COMPRESS: time the source spent packing
+} PullTrailer;
+
+//Reads the trailer of a PULL requested with the given flags, returns 0 on success
+static int read_trailer(Conn *conn, uint32_t sid, int flags, PullTrailer *out){
+    uint64_t fields[3];
+    size_t count = ((flags & FRAME_DIGEST) ? 1 : 0) + ((flags & FRAME_COMPRESS) ? 2 : 0);
+    if (count == 0){
+        return 0;
     }
-    hdr[r] = 0;
-    char *sp = strchr(hdr, ' ');
-    if (!sp){
+    FrameHeader hdr;
+    if (conn_read_frame(conn, &hdr) != 0 || hdr.stream_id != sid || hdr.opcode != OP_OK ||
+        hdr.length != count * sizeof(fields[0]) || conn_read_exact(conn, fields, hdr.length) != 0){
         return -1;
     }
+    size_t i = 0;
+    if (flags & FRAME_DIGEST){
+        out->digest = be64toh(fields[i++]);
+    }
+    if (flags & FRAME_COMPRESS){
+        out->bytes = be64toh(fields[i++]);
+        out->pack_ns = be64toh(fields[i]);
+    }
+    return 0;
+}
 
-    *sp = 0;
-    *out_size = atol(hdr);
-    return *out_size >= 0 ? 0 : -1;
+//Appends the compression ratio and packing time of a relayed stream to a log message
+static void describe_packing(char *msg, size_t len, const PullTrailer *trailer, long wire){
+    size_t used = strlen(msg);
+    double ratio = trailer->bytes ? 100.0 * wire / trailer->bytes : 100.0;
+    snprintf(msg + used, len - used, ", %llu -> %ld bytes (%.1f%%), packed in %.1f ms",
+             (unsigned long long)trailer->bytes, wire, ratio, trailer->pack_ns / 1e6);
 }
 
-//Build a descriptive string for logging purposes
-static void make_path(char *out, size_t len, const Job *job, int is_src){
-    snprintf(out, len, "%s/%s@%s:%d",
-             is_src ? job->src_dir : job->dst_dir,
-             job->filename,
-             is_src ? job->src_ip : job->dst_ip,
-             is_src ? job->src_port : job->dst_port);
+//Perform PULL operation from source client, flags may ask for FRAME_DIGEST
+//FRAME_COMPRESS is added to them when the mapping compresses and both clients support it
+static int pull(const SyncMapping *map, const Job *job, const Conn *dst, int *flags, Conn **conn_out,
+                uint32_t *sid_out, long *size_out, int64_t *mtime_out){
+    Conn *conn = pool_acquire(map->src_host, map->src_port);
+    if (!conn){
+        return -1;
+    }
+    if (map->compress && (conn->caps & dst->caps & CAP_COMPRESS)){
+        *flags |= FRAME_COMPRESS;
+    }
+
+    uint32_t sid = next_stream_id();
+    long long start = metrics_now();
+    if (send_request(conn->fd, OP_PULL, *flags, sid, NULL, 0, map->src_path, job->filename) != 0 ||
+        get_file_info(conn, sid, size_out, mtime_out) != 0){
+        pool_release(map->src_host, map->src_port, conn, 0);
+        return -1;
+    }
+    metrics_latency(LAT_FIRST_BYTE, metrics_now() - start);
+    *conn_out = conn;
+    *sid_out = sid;
+    return 0;
+}
+
+//(Re)creates the worker's relay pipe; a pipe left holding bytes after a failure is replaced
+static void reset_pipe(WorkerContext *ctx){
+    if (ctx->pipe_fds[0] >= 0){
+        close(ctx->pipe_fds[0]);
+        close(ctx->pipe_fds[1]);
+    }
+    if (pipe2(ctx->pipe_fds, O_CLOEXEC) < 0){
+        ctx->pipe_fds[0] = -1;
+        ctx->pipe_fds[1] = -1;
+        return;
+    }
+    fcntl(ctx->pipe_fds[1], F_SETPIPE_SZ, FRAME_CHUNK);
 }
 
-//Log the outcome of a sync operation
-static void log_result(const char *src, const char *dst, long tid, const char *op, const char *status, const char *msg){
-    char ts[32];
-    time_t now = time(NULL);
-    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    fprintf(log_file, "[%s] [%s] [%s] [%ld] [%s] [%s] [%s]\n", ts, src, dst, tid, op, status, msg);
-    fflush(log_file);
+//Moves len payload bytes from the source connection to the target socket
+//more is set when further frames follow, so the kernel can coalesce segments
+static int relay_payload(WorkerContext *ctx, Conn *src, int sock, uint64_t len, int more){
+    //Bytes the reader already buffered go out with a plain write
+    while (len > 0 && src->start != src->end){
+        ssize_t r = conn_read_some(src, ctx->buf, len < sizeof(ctx->buf) ? len : sizeof(ctx->buf));
+        if (r <= 0 || write_all(sock, ctx->buf, r) != 0){
+            return -1;
+        }
+        len -= r;
+    }
+
+    //The rest crosses socket -> pipe -> socket without entering user space
+    while (len > 0 && ctx->pipe_fds[0] >= 0){
+        size_t want = len < FRAME_CHUNK ? len : FRAME_CHUNK;
+        ssize_t n = splice(src->fd, NULL, ctx->pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0){
+            return -1;
+        }
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EINVAL){
+                break;
+            }
+            return -1;
+        }
+        len -= n;
+
+        int flags = SPLICE_F_MOVE | (len > 0 || more ? SPLICE_F_MORE : 0);
+        while (n > 0){
+            ssize_t m = splice(ctx->pipe_fds[0], NULL, sock, NULL, n, flags);
+            if (m < 0 && errno == EINTR){
+                continue;
+            }
+            if (m <= 0){
+                reset_pipe(ctx);
+                return -1;
+            }
+            n -= m;
+        }
+    }
+
+    //Fallback when splice() is unavailable
+    while (len > 0){
+        ssize_t r = conn_read_some(src, ctx->buf, len < sizeof(ctx->buf) ? len : sizeof(ctx->buf));
+        if (r <= 0 || write_all(sock, ctx->buf, r) != 0){
+            return -1;
+        }
+        len -= r;
+    }
+    return 0;
 }
 
-//Perform PULL operation from source client
-static int pull(const Job *job, int *fd_out, long *size_out){
-    int sock = connect_to(job->src_ip, job->src_port);
-    if (sock < 0){
+//Forwards a DATA stream up to and including its FIN frame under a new stream id
+//first is the stream's first header when the caller already read it
+//Returns the number of payload bytes relayed, or -1 on error
+static long relay_stream(WorkerContext *ctx, Conn *from, int sock, uint32_t sid, const FrameHeader *first){
+    long sent = 0;
+    while (1){
+        //Dropping the half-sent stream is the only way to stop it, the caller then discards both connections
+        if (mapping_cancelled(ctx->map)){
+            return -1;
+        }
+        FrameHeader hdr;
+        if (first){
+            hdr = *first;
+            first = NULL;
+        } else if (conn_read_frame(from, &hdr) != 0){
+            return -1;
+        }
+        if (hdr.opcode != OP_DATA){
+            return -1;
+        }
+
+        //Forward the header unchanged apart from the stream id; MSG_MORE lets it share a segment with the payload
+        unsigned char out[FRAME_HDR_SIZE];
+        frame_encode(out, OP_DATA, hdr.flags, sid, hdr.length);
+        int fin = hdr.flags & FRAME_FIN;
+        if (send(sock, out, sizeof(out), hdr.length > 0 ? MSG_MORE : 0) != sizeof(out) ||
+            relay_payload(ctx, from, sock, hdr.length, !fin) != 0){
+            return -1;
+        }
+        sent += hdr.length;
+        ctx->moved += hdr.length;
+
+        if (fin){
+            return sent;
+        }
+    }
+}
+
+//Perform PUSH operation to target client, relaying the source's DATA frames; the lease on dst ends here
+//flags are those of the PULL (src_sid); its trailer is returned along with the bytes relayed
+//With FRAME_DIGEST both sides hash the stream: the source's digest comes in the trailer,
+//the target's with its acknowledgement
+//Returns 0 on success, 1 if the digests differ (both connections stay usable) and -1 on error
+static int push(WorkerContext *ctx, const SyncMapping *map, const Job *job, Conn *src, uint32_t src_sid, Conn *dst,
+                int flags, long size, int64_t mtime, PullTrailer *trailer, long *wire){
+    int sock = dst->fd;
+
+    uint32_t sid = next_stream_id();
+    if (send_push_request(sock, OP_PUSH, flags & FRAME_DIGEST, sid, map, job, mtime) != 0){
+        pool_release(map->dst_host, map->dst_port, dst, 0);
+        return -1;
+    }
+
+    //Compressed frames are forwarded as they are, the target unpacks them
+    long sent = relay_stream(ctx, src, sock, sid, NULL);
+    int ok = sent >= 0 && read_trailer(src, src_sid, flags, trailer) == 0;
+    uint64_t got_digest = 0;
+
+    //The target acknowledges once the file is written and closed
+    if (ok){
+        FrameHeader ack;
+        if (flags & FRAME_DIGEST){
+            ok = read_u64_reply(dst, sid, &got_digest) == 0;
+        } else if (conn_read_frame(dst, &ack) != 0 || ack.stream_id != sid || ack.opcode != OP_OK){
+            ok = 0;
+        }
+    }
+
+    //A failed transfer leaves the stream half-sent, so only clean connections go back to the pool
+    pool_release(map->dst_host, map->dst_port, dst, ok);
+    *wire = sent;
+    long bytes = (flags & FRAME_COMPRESS) ? (long)trailer->bytes : sent;
+    if (!ok || bytes != size){
+        return -1;
+    }
+    return !(flags & FRAME_DIGEST) || trailer->digest == got_digest ? 0 : 1;
+}
+
+//Reads the message of an OP_ERR reply into err as "target refused: <message>"
+//Returns 1 if the whole message was read, so the connection may be reused
+static int read_refusal(Conn *conn, const FrameHeader *hdr, char *err, size_t err_len){
+    char msg[256];
+    size_t n = hdr->length < sizeof(msg) - 1 ? hdr->length : sizeof(msg) - 1;
+    int whole = n == hdr->length && conn_read_exact(conn, msg, n) == 0;
+    msg[whole ? n : 0] = '\0';
+    snprintf(err, err_len, "target refused: %s", msg);
+    return whole;
+}
+
+//Runs the delta exchange on two leased connections
+//The target signs its copy, the source answers with a delta that the target applies
+//Returns the number of delta bytes relayed, or -1 with reusable cleared when a stream was left half-read
+static long exchange_delta(WorkerContext *ctx, const SyncMapping *map, const Job *job, Conn *src, Conn *dst, int *reusable, char *err, size_t err_len){
+    *reusable = 0;
+    uint32_t sig_sid = next_stream_id();
+    FrameHeader first;
+    if (send_path_request(dst->fd, OP_SIGS, sig_sid, map->dst_path, job->filename) != 0 ||
+        conn_read_frame(dst, &first) != 0 || first.stream_id != sig_sid){
+        snprintf(err, err_len, "no signatures from target");
+        return -1;
+    }
+    //Targets that cannot sign the file (or do not know SIGS) refuse before any DATA
+    if (first.opcode == OP_ERR){
+        *reusable = read_refusal(dst, &first, err, err_len);
+        return -1;
+    }
+
+    uint32_t sid = next_stream_id();
+    long size;
+    int64_t mtime;
+    if (send_path_request(src->fd, OP_DELTA, sid, map->src_path, job->filename) != 0 ||
+        relay_stream(ctx, dst, src->fd, sid, &first) < 0 ||
+        get_file_info(src, sid, &size, &mtime) != 0){
+        snprintf(err, err_len, "source cannot build delta");
+        return -1;
+    }
+
+    uint32_t patch_sid = next_stream_id();
+    long sent;
+    if (send_push_request(dst->fd, OP_PATCH, 0, patch_sid, map, job, mtime) != 0 ||
+        (sent = relay_stream(ctx, src, dst->fd, patch_sid, NULL)) < 0){
+        snprintf(err, err_len, "delta relay failed");
+        return -1;
+    }
+
+    FrameHeader ack;
+    uint64_t rebuilt;
+    if (conn_read_frame(dst, &ack) != 0 || ack.stream_id != patch_sid ||
+        ack.opcode != OP_OK || ack.length != sizeof(rebuilt) ||
+        conn_read_exact(dst, &rebuilt, sizeof(rebuilt)) != 0){
+        snprintf(err, err_len, "target cannot apply delta");
+        return -1;
+    }
+    *reusable = 1;
+    if ((long)be64toh(rebuilt) != size){
+        snprintf(err, err_len, "rebuilt size mismatch");
         return -1;
     }
+    return sent;
+}
 
-    dprintf(sock, "PULL %s/%s\n", job->src_dir, job->filename);
+//Updates the target's existing copy by sending only the blocks that changed
+static int sync_delta(WorkerContext *ctx, const SyncMapping *map, const Job *job, char *msg, size_t msg_len){
+    Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+    if (!dst){
+        snprintf(msg, msg_len, "cannot reach target");
+        return -1;
+    }
+    Conn *src = pool_acquire(map->src_host, map->src_port);
+    if (!src){
+        pool_release(map->dst_host, map->dst_port, dst, 1);
+        snprintf(msg, msg_len, "cannot reach source");
+        return -1;
+    }
 
-    if (get_file_info(sock, size_out) != 0){
-        close(sock);
+    int reusable;
+    long sent = exchange_delta(ctx, map, job, src, dst, &reusable, msg, msg_len);
+    pool_release(map->src_host, map->src_port, src, sent >= 0);
+    pool_release(map->dst_host, map->dst_port, dst, reusable);
+    if (sent < 0){
         return -1;
     }
-    *fd_out = sock;
+    snprintf(msg, msg_len, "delta %ld of %ld bytes", sent, job->size);
     return 0;
 }
 
-//Perform PUSH operation to target client
-static int push(const Job *job, int fd, long size){
-    int sock = connect_to(job->dst_ip, job->dst_port);
-    if (sock < 0){
+//Runs the chunk negotiation on two leased connections
+//The source lists its chunks, the target answers with the ones it does not hold and only those are relayed
+//Returns the number of chunk bytes relayed with the bytes the target reused,
+//or -1 with src_ok/dst_ok cleared for a connection whose stream was left half-read
+static long exchange_chunks(WorkerContext *ctx, const SyncMapping *map, const Job *job, Conn *src, Conn *dst,
+                            int *src_ok, int *dst_ok, uint64_t *reused, char *err, size_t err_len){
+    *src_ok = 0;
+    *dst_ok = 0;
+    uint32_t sid = next_stream_id();
+    long size;
+    int64_t mtime;
+    if (send_path_request(src->fd, OP_CHUNKS, sid, map->src_path, job->filename) != 0 ||
+        get_file_info(src, sid, &size, &mtime) != 0){
+        snprintf(err, err_len, "source cannot list chunks");
         return -1;
     }
 
-    dprintf(sock, "PUSH %s/%s -1 start\n", job->dst_dir, job->filename);
+    uint32_t dst_sid = next_stream_id();
+    FrameHeader first;
+    if (send_push_request(dst->fd, OP_DEDUP, 0, dst_sid, map, job, mtime) != 0 ||
+        relay_stream(ctx, src, dst->fd, dst_sid, NULL) < 0 ||
+        conn_read_frame(dst, &first) != 0 || first.stream_id != dst_sid){
+        snprintf(err, err_len, "chunk list relay failed");
+        return -1;
+    }
+    //A target that cannot build the file refuses in place of the want list, the source is left waiting for it
+    if (first.opcode == OP_ERR){
+        *dst_ok = read_refusal(dst, &first, err, err_len);
+        return -1;
+    }
 
-    char buf[4096];
-    long sent = 0;
+    long sent;
+    if (relay_stream(ctx, dst, src->fd, sid, &first) < 0 ||
+        (sent = relay_stream(ctx, src, dst->fd, dst_sid, NULL)) < 0){
+        snprintf(err, err_len, "chunk relay failed");
+        return -1;
+    }
+    *src_ok = 1;
 
-    while (sent < size){
-        ssize_t r = read(fd, buf, sizeof(buf));
-        if (r <= 0){
-            break;
+    FrameHeader ack;
+    uint64_t info[2];
+    if (conn_read_frame(dst, &ack) != 0 || ack.stream_id != dst_sid){
+        snprintf(err, err_len, "no reply from target");
+        return -1;
+    }
+    if (ack.opcode == OP_ERR){
+        *dst_ok = read_refusal(dst, &ack, err, err_len);
+        return -1;
+    }
+    if (ack.opcode != OP_OK || ack.length != sizeof(info) || conn_read_exact(dst, info, sizeof(info)) != 0){
+        snprintf(err, err_len, "bad reply from target");
+        return -1;
+    }
+    *dst_ok = 1;
+    if ((long)be64toh(info[0]) != size){
+        snprintf(err, err_len, "rebuilt size mismatch");
+        return -1;
+    }
+    *reused = be64toh(info[1]);
+    return sent;
+}
+
+//Sends the file as the chunks the target cannot find in its chunk index
+static int sync_dedup(WorkerContext *ctx, const SyncMapping *map, const Job *job, char *msg, size_t msg_len){
+    Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+    if (!dst){
+        snprintf(msg, msg_len, "cannot reach target");
+        return -1;
+    }
+    if (!(dst->caps & CAP_DEDUP)){
+        pool_release(map->dst_host, map->dst_port, dst, 1);
+        snprintf(msg, msg_len, "target has no chunk index");
+        return -1;
+    }
+    Conn *src = pool_acquire(map->src_host, map->src_port);
+    if (!src){
+        pool_release(map->dst_host, map->dst_port, dst, 1);
+        snprintf(msg, msg_len, "cannot reach source");
+        return -1;
+    }
+
+    int src_ok;
+    int dst_ok;
+    uint64_t reused = 0;
+    long sent = exchange_chunks(ctx, map, job, src, dst, &src_ok, &dst_ok, &reused, msg, msg_len);
+    pool_release(map->src_host, map->src_port, src, src_ok);
+    pool_release(map->dst_host, map->dst_port, dst, dst_ok);
+    if (sent < 0){
+        return -1;
+    }
+    snprintf(msg, msg_len, "reused %llu of %ld bytes, sent %ld", (unsigned long long)reused, job->size, sent);
+    return 0;
+}
+
+//Moves one stripe: a ranged PULL from the source relayed into a ranged PUSH on the target's part file
+static int transfer_stripe(WorkerContext *ctx, const SyncMapping *map, const Job *job, char *msg, size_t msg_len){
+    Conn *src = pool_acquire(map->src_host, map->src_port);
+    if (!src){
+        return -1;
+    }
+    //The target is leased first so the stripe is only compressed when it can be unpacked
+    Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+    if (!dst){
+        pool_release(map->src_host, map->src_port, src, 1);
+        return -1;
+    }
+    int flags = FRAME_RANGE;
+    if (map->compress && (src->caps & dst->caps & CAP_COMPRESS)){
+        flags |= FRAME_COMPRESS;
+    }
+
+    uint32_t sid = next_stream_id();
+    uint64_t range[2] = { job->offset, job->length };
+    long size;
+    int64_t mtime;
+    long long start = metrics_now();
+    //A source file that changed since it was listed cannot be assembled from stripes
+    if (send_request(src->fd, OP_PULL, flags, sid, range, 2, map->src_path, job->filename) != 0 ||
+        get_file_info(src, sid, &size, &mtime) != 0 || size != job->size || mtime != job->mtime){
+        pool_release(map->src_host, map->src_port, src, 0);
+        pool_release(map->dst_host, map->dst_port, dst, 1);
+        return -1;
+    }
+    metrics_latency(LAT_FIRST_BYTE, metrics_now() - start);
+
+    uint32_t push_sid = next_stream_id();
+    uint64_t part[2] = { job->offset, job->size };
+    long sent = -1;
+    PullTrailer trailer = { 0 };
+    if (send_request(dst->fd, OP_PUSH, FRAME_RANGE, push_sid, part, 2, map->dst_path, job->filename) == 0){
+        sent = relay_stream(ctx, src, dst->fd, push_sid, NULL);
+    }
+    int drained = sent >= 0 && read_trailer(src, sid, flags, &trailer) == 0;
+    pool_release(map->src_host, map->src_port, src, drained);
+
+    long bytes = (flags & FRAME_COMPRESS) ? (long)trailer.bytes : sent;
+    int ok = drained && bytes == job->length;
+    FrameHeader ack;
+    int acked = sent >= 0 && conn_read_frame(dst, &ack) == 0 && ack.stream_id == push_sid &&
+                ack.opcode == OP_OK && ack.length == 0;
+    ok = ok && acked;
+    pool_release(map->dst_host, map->dst_port, dst, acked);
+    if (ok && (flags & FRAME_COMPRESS)){
+        describe_packing(msg, msg_len, &trailer, sent);
+    }
+    return ok ? 0 : -1;
+}
+
+//Asks the target to move the completed part file into place
+static int commit_stripes(const SyncMapping *map, const Job *job){
+    Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+    if (!dst){
+        return -1;
+    }
+    uint32_t sid = next_stream_id();
+    FrameHeader ack;
+    int ok = send_push_request(dst->fd, OP_COMMIT, 0, sid, map, job, job->mtime) == 0 &&
+             conn_read_frame(dst, &ack) == 0 && ack.stream_id == sid;
+    int reusable = ok && (ack.length == 0 || skip_bytes(dst, ack.length) == 0);
+    pool_release(map->dst_host, map->dst_port, dst, reusable);
+    return ok && ack.opcode == OP_OK ? 0 : -1;
+}
+
+//Failure message of a job step, or "cancelled" if the step failed because the mapping was cancelled
+static const char *fail_reason(const SyncMapping *map, const char *msg){
+    return mapping_cancelled(map) ? "cancelled" : msg;
+}
+
+//Sends HASH for the job's file on one side, returns the stream id or 0 on failure
+static uint32_t request_hash(Conn *conn, const char *dir, const Job *job){
+    uint32_t sid = next_stream_id();
+    return send_path_request(conn->fd, OP_HASH, sid, dir, job->filename) == 0 ? sid : 0;
+}
+
+//Reads a HASH reply, returns 0 with the digest and size of the file or -1
+static int read_hash(Conn *conn, uint32_t sid, uint64_t *digest, uint64_t *size){
+    FrameHeader hdr;
+    uint64_t info[2];
+    if (conn_read_frame(conn, &hdr) != 0 || hdr.stream_id != sid){
+        return -1;
+    }
+    if (hdr.opcode != OP_OK || hdr.length != sizeof(info)){
+        skip_bytes(conn, hdr.length);
+        return -1;
+    }
+    if (conn_read_exact(conn, info, sizeof(info)) != 0){
+        return -1;
+    }
+    *digest = be64toh(info[0]);
+    *size = be64toh(info[1]);
+    return 0;
+}
+
+//Checks that the target's copy of the job's file matches the source, as both are on disk now
+//Both sides hash at the same time; returns 0 if they match, 1 if they differ and -1 if either could not hash
+static int verify_file(const SyncMapping *map, const Job *job){
+    Conn *src = pool_acquire(map->src_host, map->src_port);
+    Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+    uint32_t src_sid = src ? request_hash(src, map->src_path, job) : 0;
+    uint32_t dst_sid = dst ? request_hash(dst, map->dst_path, job) : 0;
+
+    uint64_t src_digest, src_size, dst_digest, dst_size;
+    int src_ok = src_sid && read_hash(src, src_sid, &src_digest, &src_size) == 0;
+    int dst_ok = dst_sid && read_hash(dst, dst_sid, &dst_digest, &dst_size) == 0;
+    if (src){
+        pool_release(map->src_host, map->src_port, src, src_ok);
+    }
+    if (dst){
+        pool_release(map->dst_host, map->dst_port, dst, dst_ok);
+    }
+    if (!src_ok || !dst_ok){
+        return -1;
+    }
+    return src_digest == dst_digest && src_size == dst_size ? 0 : 1;
+}
+
+//Verifies a file written by a step that does not hash its stream (delta, SENDTO, striped copy)
+//A mismatch is logged as a failed VERIFY; returns 0 if verification is off or the copy matches
+static int check_copy(WorkerContext *ctx, const SyncMapping *map, const Job *job){
+    if (verify_retries == 0){
+        return 0;
+    }
+    int r = verify_file(map, job);
+    if (r != 0){
+        log_transfer(map, job, ctx->tid, LOG_VERIFY, LOG_FAIL, fail_reason(map, r > 0 ? "digest mismatch" : "cannot hash"));
+        return -1;
+    }
+    log_transfer(map, job, ctx->tid, LOG_VERIFY, LOG_OK, "digests match");
+    return 0;
+}
+
+//Copies the file through the manager: a PULL from the source relayed into a PUSH on the target
+//With verification both clients hash the stream, and a mismatched copy is made again up to verify_retries times
+//A compressing mapping's log line carries the ratio and the source's packing time
+static int relay_copy(WorkerContext *ctx, const SyncMapping *map, const Job *job){
+    long tid = ctx->tid;
+    for (int attempt = 0; ; ++attempt){
+        //The target is leased first so the data is only compressed when it can be unpacked
+        Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+        if (!dst){
+            log_transfer(map, job, tid, LOG_PUSH, LOG_FAIL, fail_reason(map, "cannot reach target"));
+            return -1;
+        }
+
+        Conn *src;
+        uint32_t src_sid;
+        long fsize;
+        int64_t mtime;
+        int flags = verify_retries > 0 ? FRAME_DIGEST : 0;
+        if (pull(map, job, dst, &flags, &src, &src_sid, &fsize, &mtime) != 0){
+            pool_release(map->dst_host, map->dst_port, dst, 1);
+            log_transfer(map, job, tid, LOG_PULL, LOG_FAIL, fail_reason(map, "pull error"));
+            return -1;
+        }
+        log_transfer(map, job, tid, LOG_PULL, LOG_OK, "done");
+
+        PullTrailer trailer = { 0 };
+        long wire = 0;
+        int r = push(ctx, map, job, src, src_sid, dst, flags, fsize, mtime, &trailer, &wire);
+        if (r < 0){
+            log_transfer(map, job, tid, LOG_PUSH, LOG_FAIL, fail_reason(map, "push error"));
+        } else if (r > 0){
+            log_transfer(map, job, tid, LOG_PUSH, LOG_FAIL, "digest mismatch");
+        } else{
+            char msg[192] = "done";
+            if (flags & FRAME_COMPRESS){
+                describe_packing(msg, sizeof(msg), &trailer, wire);
+            }
+            if (flags & FRAME_DIGEST){
+                strncat(msg, ", digest verified", sizeof(msg) - strlen(msg) - 1);
+            }
+            log_transfer(map, job, tid, LOG_PUSH, LOG_OK, msg);
+        }
+        //The source stream is only fully drained when the push completed
+        pool_release(map->src_host, map->src_port, src, r >= 0);
+        if (r <= 0 || attempt >= verify_retries || mapping_cancelled(map)){
+            return r == 0 ? 0 : -1;
+        }
+    }
+}
+
+//Transfers one stripe; the worker that finishes the last stripe of a file commits it
+//Returns 0 if the stripe (and the commit, when this worker made it) succeeded
+static int process_stripe(WorkerContext *ctx, const SyncMapping *map, const Job *job){
+    char msg[192];
+    snprintf(msg, sizeof(msg), "stripe %ld+%ld", job->offset, job->length);
+    StripeGroup *group = job->stripes;
+    int rc = transfer_stripe(ctx, map, job, msg, sizeof(msg));
+    if (rc != 0){
+        __atomic_store_n(&group->failed, 1, __ATOMIC_RELAXED);
+        log_transfer(map, job, ctx->tid, LOG_STRIPE, LOG_FAIL, fail_reason(map, msg));
+    } else{
+        log_transfer(map, job, ctx->tid, LOG_STRIPE, LOG_OK, msg);
+    }
+
+    if (__atomic_sub_fetch(&group->remaining, 1, __ATOMIC_ACQ_REL) > 0){
+        return rc;
+    }
+    if (__atomic_load_n(&group->failed, __ATOMIC_RELAXED)){
+        log_transfer(map, job, ctx->tid, LOG_COMMIT, LOG_FAIL, "a stripe failed");
+    } else if (commit_stripes(map, job) != 0){
+        log_transfer(map, job, ctx->tid, LOG_COMMIT, LOG_FAIL, "commit error");
+        rc = -1;
+    } else{
+        log_transfer(map, job, ctx->tid, LOG_COMMIT, LOG_OK, "done");
+        //A striped copy that does not match is replaced by a whole copy
+        if (check_copy(ctx, map, job) != 0 && !mapping_cancelled(map)){
+            rc = relay_copy(ctx, map, job);
         }
-        dprintf(sock, "PUSH %s/%s %zd ", job->dst_dir, job->filename, r);
-        write(sock, buf, r);
-        sent += r;
     }
+    free(group);
+    return rc;
+}
 
-    dprintf(sock, "PUSH %s/%s 0 done\n", job->dst_dir, job->filename);
-    close(sock);
-    return sent == size ? 0 : -1;
+//Sends the batch's names as the DATA stream that follows a PACK request
+static int send_names(int sock, uint32_t sid, const char *names, size_t len){
+    size_t off = 0;
+    do{
+        size_t n = len - off < FRAME_CHUNK ? len - off : FRAME_CHUNK;
+        if (frame_send(sock, OP_DATA, off + n == len ? FRAME_FIN : 0, sid, names + off, n) != 0){
+            return -1;
+        }
+        off += n;
+    } while (off < len);
+    return 0;
 }
 
-//Process a single sync job
-static void process_job(const Job *job, long tid){
-    int src_fd;
-    long fsize;
+//Moves a batch of small files as one archive stream: PACK on the source relayed into UNPACK on the target
+static int transfer_batch(WorkerContext *ctx, const SyncMapping *map, const Job *job, char *msg, size_t msg_len){
+    Conn *src = pool_acquire(map->src_host, map->src_port);
+    if (!src){
+        snprintf(msg, msg_len, "cannot reach source");
+        return -1;
+    }
+    uint32_t sid = next_stream_id();
+    if (frame_send(src->fd, OP_PACK, 0, sid, map->src_path, strlen(map->src_path)) != 0 ||
+        send_names(src->fd, sid, job->batch, strlen(job->batch)) != 0){
+        pool_release(map->src_host, map->src_port, src, 0);
+        snprintf(msg, msg_len, "pack request failed");
+        return -1;
+    }
+
+    Conn *dst = pool_acquire(map->dst_host, map->dst_port);
+    uint32_t dst_sid = next_stream_id();
+    long sent = -1;
+    if (dst && frame_send(dst->fd, OP_UNPACK, 0, dst_sid, map->dst_path, strlen(map->dst_path)) == 0){
+        sent = relay_stream(ctx, src, dst->fd, dst_sid, NULL);
+    }
+    pool_release(map->src_host, map->src_port, src, sent >= 0);
+    if (!dst){
+        snprintf(msg, msg_len, "cannot reach target");
+        return -1;
+    }
+
+    FrameHeader ack;
+    uint32_t counts[2];
+    int ok = sent >= 0 && conn_read_frame(dst, &ack) == 0 && ack.stream_id == dst_sid &&
+             ack.opcode == OP_OK && ack.length == sizeof(counts) &&
+             conn_read_exact(dst, counts, sizeof(counts)) == 0;
+    pool_release(map->dst_host, map->dst_port, dst, ok);
+    if (!ok){
+        snprintf(msg, msg_len, "batch transfer failed");
+        return -1;
+    }
+    uint32_t failed = be32toh(counts[1]);
+    snprintf(msg, msg_len, "%u files, %u failed, %ld bytes", be32toh(counts[0]), failed, sent);
+    return failed == 0 ? 0 : -1;
+}
 
-    char src_str[1024];
-    char dst_str[1024];
-    make_path(src_str, sizeof(src_str), job, 1);
-    make_path(dst_str, sizeof(dst_str), job, 0);
+//Ask the source to send the file straight to the target, the manager only receives the outcome
+static int send_direct(WorkerContext *ctx, const SyncMapping *map, const Job *job, char *err, size_t err_len){
+    Conn *src = pool_acquire(map->src_host, map->src_port);
+    if (!src){
+        snprintf(err, err_len, "cannot reach source");
+        return -1;
+    }
 
-    //Pull from source
-    if (pull(job, &src_fd, &fsize) != 0){
-        log_result(src_str, dst_str, tid, "PULL", "FAIL", "pull error");
-        return;
+    char payload[FRAME_MAX_REQUEST];
+    int n = snprintf(payload, sizeof(payload), "%s/%s %s:%d %s/%s",
+                     map->src_path, job->filename, map->dst_host, map->dst_port, map->dst_path, job->filename);
+    uint32_t sid = next_stream_id();
+    FrameHeader hdr;
+    if (n < 0 || (size_t)n >= sizeof(payload) ||
+        frame_send(src->fd, OP_SENDTO, 0, sid, payload, n) != 0 ||
+        conn_read_frame(src, &hdr) != 0 || hdr.stream_id != sid){
+        snprintf(err, err_len, "no reply from source");
+        pool_release(map->src_host, map->src_port, src, 0);
+        return -1;
+    }
+
+    int reusable = 0;
+    int rc = -1;
+    if (hdr.opcode == OP_OK && hdr.length == sizeof(uint64_t)){
+        uint64_t size;
+        reusable = conn_read_exact(src, &size, sizeof(size)) == 0;
+        rc = reusable ? 0 : -1;
+        ctx->moved += reusable ? be64toh(size) : 0;
+    } else if (hdr.opcode == OP_ERR && hdr.length < err_len){
+        reusable = conn_read_exact(src, err, hdr.length) == 0;
+        err[reusable ? hdr.length : 0] = '\0';
+    } else{
+        snprintf(err, err_len, "bad reply from source");
+    }
+    pool_release(map->src_host, map->src_port, src, reusable);
+    return rc;
+}
+
+//Process a single sync job, returns 0 if it succeeded
+//Copies made by delta or SENDTO that fail verification are made again through the manager
+//Dedup copies are checked by the target against the source's digest of the whole file
+static int process_job(WorkerContext *ctx, const SyncMapping *map, const Job *job){
+    long tid = ctx->tid;
+
+    if (job->stripes){
+        return process_stripe(ctx, map, job);
+    }
+    if (job->batch){
+        char msg[256];
+        int ok = transfer_batch(ctx, map, job, msg, sizeof(msg)) == 0;
+        log_transfer(map, job, tid, LOG_BATCH, ok ? LOG_OK : LOG_FAIL, ok ? msg : fail_reason(map, msg));
+        free(job->batch);
+        return ok ? 0 : -1;
+    }
+
+    //A dedup mapping's large file is built by the target from the chunks it holds plus the missing ones
+    if (map->dedup && job->size >= DEDUP_MIN_SIZE){
+        char msg[256];
+        int ok = sync_dedup(ctx, map, job, msg, sizeof(msg)) == 0;
+        log_transfer(map, job, tid, LOG_DEDUP, ok ? LOG_OK : LOG_FAIL, ok ? msg : fail_reason(map, msg));
+        if (ok){
+            return 0;
+        }
+        if (mapping_cancelled(map)){
+            return -1;
+        }
+    }
+
+    //A large file the target already holds is patched in place, a full copy is the fallback
+    if (job->dst_size >= DELTA_MIN_SIZE && job->size >= DELTA_MIN_SIZE){
+        char msg[256];
+        int ok = sync_delta(ctx, map, job, msg, sizeof(msg)) == 0;
+        log_transfer(map, job, tid, LOG_DELTA, ok ? LOG_OK : LOG_FAIL, ok ? msg : fail_reason(map, msg));
+        if (ok && check_copy(ctx, map, job) == 0){
+            return 0;
+        }
+        if (mapping_cancelled(map)){
+            return -1;
+        }
     }
-    log_result(src_str, dst_str, tid, "PULL", "OK", "done");
 
-    //Push to target
-    if (push(job, src_fd, fsize) != 0){
-        log_result(src_str, dst_str, tid, "PUSH", "FAIL", "push error");
+    //Direct mode keeps the manager out of the data path, relaying is the fallback
+    if (direct_transfer){
+        char err[256];
+        if (send_direct(ctx, map, job, err, sizeof(err)) == 0){
+            log_transfer(map, job, tid, LOG_SENDTO, LOG_OK, "done");
+            if (check_copy(ctx, map, job) == 0){
+                return 0;
+            }
+        } else{
+            log_transfer(map, job, tid, LOG_SENDTO, LOG_FAIL, err);
+        }
+        if (mapping_cancelled(map)){
+            return -1;
+        }
     }
-    else{
-        log_result(src_str, dst_str, tid, "PUSH", "OK", "done");
+
+    return relay_copy(ctx, map, job);
+}
+
+//Gives up a job of a cancelled mapping without contacting either side
+//A dropped stripe fails its file, the last stripe to go frees the group instead of committing it
+static void drop_job(const Job *job){
+    if (job->stripes){
+        __atomic_store_n(&job->stripes->failed, 1, __ATOMIC_RELAXED);
+        if (__atomic_sub_fetch(&job->stripes->remaining, 1, __ATOMIC_ACQ_REL) == 0){
+            free(job->stripes);
+        }
     }
-    close(src_fd);
+    free(job->batch);
 }
 
 //Main loop for each worker thread
 void *sync_worker_loop(void *arg){
-    long tid = (long)arg;
+    WorkerContext *ctx = malloc(sizeof(WorkerContext));
+    if (!ctx){
+        return NULL;
+    }
+    ctx->tid = (long)arg;
+    ctx->pipe_fds[0] = -1;
+    ctx->pipe_fds[1] = -1;
+    ctx->map = NULL;
+    reset_pipe(ctx);
+    metrics_worker(ctx->tid);
 
+    //Workers spread their home shards so they only contend when stealing
     while (1){
         Job job;
-        //Wait for job availability
-        pthread_mutex_lock(&job_queue.mutex);
-        while (job_queue.size == 0 && !is_terminating){
-            pthread_cond_wait(&job_queue.not_empty, &job_queue.mutex);
-        }
-        //If shutting down and queue is empty, exit loop
-        if (is_terminating && job_queue.size == 0){
-            pthread_mutex_unlock(&job_queue.mutex);
+        int shard = queue_pop(&job_queue, (int)ctx->tid, &job);
+        if (shard < 0){
             break;
         }
+        //Jobs of a cancelled mapping are stale and leave the queue without any transfer
+        SyncMapping *map = mapping_get(job.mapping);
+        if (mapping_cancelled(map)){
+            drop_job(&job);
+        } else{
+            ctx->map = map;
+            ctx->moved = 0;
+            long long start = metrics_job_start();
+            int ok = process_job(ctx, map, &job) == 0;
+            metrics_job(map, ctx->moved, ok, metrics_now() - start);
+        }
+        queue_done(&job_queue, shard);
 
-        //Fetch job from queue
-        memcpy(&job, &job_queue.items[job_queue.head], sizeof(Job));
-        job_queue.head = (job_queue.head + 1) % job_queue.capacity;
-        job_queue.size--;
-
-        pthread_cond_signal(&job_queue.not_full);
-        pthread_mutex_unlock(&job_queue.mutex);
-
-        process_job(&job, tid);
+        //Release what the job held once it is finished
+        if (job.filename){
+            path_release(job.filename);
+        }
+        mapping_unref(map);
     }
 
+    if (ctx->pipe_fds[0] >= 0){
+        close(ctx->pipe_fds[0]);
+        close(ctx->pipe_fds[1]);
+    }
+    free(ctx);
     return NULL;
 }
\ No newline at end of file